@@ -0,0 +1,109 @@
+/* Measures the SoA intersection kernels on every instruction set the CPU
+ * supports, casting random rays at random spheres and quads.
+ *
+ * Usage: intersect_bench [primitives] [rays]
+ */
+#include "bvh.h"
+#include "scene_soa.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+struct Result {
+    GLfloat dist;
+    GLint sphere_slot;
+    GLint quad_slot;
+};
+
+/* Intersect every ray with every primitive using the current kernels */
+static std::vector<Result> run(SceneSoA const& soa, std::vector<vec3> const& origins,
+                               std::vector<vec3> const& dirs) {
+    std::vector<Result> results(origins.size());
+
+    for (size_t i = 0; i < origins.size(); i++) {
+        Result& result {results[i]};
+        result = {RAY_MAX_DIST, -1, -1};
+        soa.intersect_spheres(0, soa.radius.size(), origins[i], dirs[i],
+                              result.dist, result.sphere_slot);
+        soa.intersect_quads(0, soa.plane_d.size(), origins[i], dirs[i],
+                            result.dist, result.quad_slot);
+    }
+    return results;
+}
+
+int main(int argc, char* argv[]) {
+    size_t const primitives {argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024};
+    size_t const rays {argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000};
+
+    std::mt19937 gen {1234};
+    std::uniform_real_distribution<GLfloat> pos {-20.0, 20.0};
+    std::uniform_real_distribution<GLfloat> size {0.1, 1.5};
+    Material const material {Material().lambertian({0.5, 0.5, 0.5})};
+
+    std::vector<Sphere> spheres {};
+    std::vector<Quad> quads {};
+    std::vector<GLint> refs {};
+    for (size_t i = 0; i < primitives / 2; i++) {
+        spheres.emplace_back(vec3(pos(gen), pos(gen), pos(gen)), size(gen), material);
+        refs.push_back(BVH::make_ref(BVH::SPHERE, i));
+    }
+    for (size_t i = 0; i < primitives - primitives / 2; i++) {
+        quads.emplace_back(vec3(pos(gen), pos(gen), pos(gen)),
+                           vec3(size(gen), 0.0, size(gen)),
+                           vec3(0.0, size(gen), size(gen)), material);
+        refs.push_back(BVH::make_ref(BVH::QUAD, i));
+    }
+
+    SceneSoA soa {};
+    soa.build(spheres, quads, refs);
+
+    std::vector<vec3> origins {};
+    std::vector<vec3> dirs {};
+    for (size_t i = 0; i < rays; i++) {
+        vec3 const target {pos(gen), pos(gen), pos(gen)};
+        vec3 const origin {pos(gen), pos(gen), pos(gen)};
+        vec3 const dir {target - origin};
+        origins.push_back(origin);
+        dirs.push_back(dir / dir.length());
+    }
+
+    std::printf("%zu primitives, %zu rays\n", primitives, rays);
+
+    std::vector<Result> reference {};
+    double scalar_rate {0.0};
+    SceneSoA::ISA const best {SceneSoA::best_isa()};
+
+    for (SceneSoA::ISA isa : {SceneSoA::ISA::SCALAR, SceneSoA::ISA::SSE, SceneSoA::ISA::AVX2}) {
+        if (isa > best) {
+            break;
+        }
+        SceneSoA::use_isa(isa);
+
+        auto const start {std::chrono::steady_clock::now()};
+        std::vector<Result> const results {run(soa, origins, dirs)};
+        std::chrono::duration<double> const elapsed {std::chrono::steady_clock::now() - start};
+        double const rate {rays / elapsed.count()};
+
+        // Different operation order may flip hits at grazing angles
+        size_t mismatches {0};
+        if (reference.empty()) {
+            reference = results;
+            scalar_rate = rate;
+        } else {
+            for (size_t i = 0; i < rays; i++) {
+                if (results[i].sphere_slot != reference[i].sphere_slot ||
+                    results[i].quad_slot != reference[i].quad_slot) {
+                    mismatches++;
+                }
+            }
+        }
+
+        std::printf("%-8s %12.0f rays/sec  %5.2fx scalar  %zu mismatches\n",
+                    SceneSoA::isa_name(isa), rate, rate / scalar_rate, mismatches);
+    }
+
+    SceneSoA::use_isa(best);
+    return 0;
+}
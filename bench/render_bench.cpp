@@ -0,0 +1,318 @@
+/* Renders the canonical scenes headlessly through the renderer and reports
+ * the throughput of each as JSON: the built in scene, a field of many
+ * spheres, a Cornell style box of quads and a scene of mostly glass.
+ *
+ * Rays per second are an estimate. The GPU does not count its rays, so the
+ * rays per sample of each scene are measured by tracing a small image with
+ * the CPU tracer, which follows the same paths, and scaled by the samples
+ * per second of the render.
+ *
+ * Given the results of an earlier run, scenes whose samples per second fell
+ * by more than the tolerance are flagged, and the exit status is 2.
+ *
+ * Usage: render_bench --renderer PATH --scenes DIR [--output DIR]
+ *                     [--frames N] [--samples N] [--backend gpu|cpu|wavefront]
+ *                     [--baseline FILE] [--tolerance FRACTION]
+ */
+#include "cpu_tracer.h"
+#include "scene_file.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Size of the image traced to measure the rays per sample
+static size_t const PROBE_WIDTH {160};
+static size_t const PROBE_HEIGHT {120};
+static GLint const PROBE_SAMPLES {4};
+
+struct Options {
+    std::string renderer {};
+    std::string scenes {};
+    std::string output {"bench"};
+    std::string backend {"gpu"};
+    std::string baseline {};
+    GLuint frames {8};
+    GLint samples {4};
+    double tolerance {0.1};
+};
+
+struct BenchScene {
+    std::string name;
+    SceneFile::Scene scene;
+    // Render the scene built into the renderer rather than a scene file
+    bool built_in;
+};
+
+struct Result {
+    std::string name;
+    double seconds;
+    double samples_per_second;
+    double rays_per_sample;
+    double rays_per_second;
+    double baseline {0.0}; // Samples per second of the baseline, 0 if none
+    bool regression {false};
+};
+
+/* A field of small random spheres around three large ones, seeded so every
+ * run builds the same scene */
+static SceneFile::Scene many_spheres() {
+    SceneFile::Scene scene {};
+    scene.camera = Camera({0.0, 2.0, 6.0}, 60);
+    scene.camera.pitch = 0.3;
+
+    std::mt19937 gen {1234};
+    std::uniform_real_distribution<GLfloat> unit {0.0, 1.0};
+
+    for (GLint a = -11; a < 11; a++) {
+        for (GLint b = -11; b < 11; b++) {
+            vec3 const center {a + 0.9f * unit(gen), 0.2, b + 0.9f * unit(gen)};
+            GLfloat const choice {unit(gen)};
+            vec3 const albedo {unit(gen), unit(gen), unit(gen)};
+
+            Material material {};
+            if (choice < 0.8) {
+                material.lambertian(albedo * albedo);
+            } else if (choice < 0.95) {
+                material.metal(albedo * 0.5f + vec3(0.5, 0.5, 0.5), 0.5f * unit(gen));
+            } else {
+                material.dielectric({1.0, 1.0, 1.0}, 1.5);
+            }
+            scene.spheres.emplace_back(center, 0.2, material);
+        }
+    }
+
+    Material glass {};
+    Material diffuse {};
+    Material metal {};
+    glass.dielectric({1.0, 1.0, 1.0}, 1.5);
+    diffuse.lambertian({0.4, 0.2, 0.1});
+    metal.metal({0.7, 0.6, 0.5}, 0.0);
+    scene.spheres.emplace_back(vec3(0.0, 1.0, 0.0), 1.0, glass);
+    scene.spheres.emplace_back(vec3(-4.0, 1.0, 0.0), 1.0, diffuse);
+    scene.spheres.emplace_back(vec3(4.0, 1.0, 0.0), 1.0, metal);
+    return scene;
+}
+
+/* Returns: The mean number of rays cast per sample of the scene */
+static double rays_per_sample(SceneFile::Scene const& scene) {
+    GLArray<Sphere> spheres {};
+    GLArray<Quad> quads {};
+    spheres.assign(scene.spheres.data(), scene.spheres.size());
+    quads.assign(scene.quads.data(), scene.quads.size());
+
+    CPUTracer tracer {PROBE_WIDTH, PROBE_HEIGHT, std::thread::hardware_concurrency()};
+    tracer.set_scene(spheres, quads, scene.meshes, scene.ground_plane);
+    tracer.reset();
+
+    SampleBudget budget {};
+    budget.samples = PROBE_SAMPLES;
+    tracer.trace(scene.camera, 0, budget);
+    return static_cast<double>(tracer.rays()) / (PROBE_WIDTH * PROBE_HEIGHT * PROBE_SAMPLES);
+}
+
+static std::string read_file(std::string const& path) {
+    std::ifstream file {path};
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+/* Find a number in a JSON object written by the renderer or by an earlier
+ * run, starting the search at @from. Only meant for the flat objects these
+ * files hold.
+ *
+ * Returns: The number, or -1.0 if the key is missing */
+static double json_number(std::string const& json, std::string const& key, size_t from = 0) {
+    size_t const found {json.find("\"" + key + "\":", from)};
+    size_t const end {json.find('}', from)};
+    if (found == std::string::npos || found > end) {
+        return -1.0;
+    }
+    return std::strtod(json.c_str() + found + key.size() + 3, nullptr);
+}
+
+/* Render a scene in a renderer process of its own, so every scene starts
+ * from a fresh context
+ *
+ * Returns: The seconds the frames took */
+static double render(Options const& options, BenchScene const& bench) {
+    std::filesystem::path const output {options.output};
+    std::string const stats {(output / (bench.name + ".json")).string()};
+    std::filesystem::remove(stats);
+
+    std::ostringstream command {};
+    command << '"' << options.renderer << "\" --headless --motion-fps 0"
+            << " --frames " << options.frames << " --samples " << options.samples
+            << " --backend " << options.backend
+            << " --output \"" << (output / (bench.name + ".ppm")).string() << '"'
+            << " --stats \"" << stats << '"';
+    if (!bench.built_in) {
+        std::string const scene {(output / (bench.name + ".rtsc")).string()};
+        SceneFile::write(scene, bench.scene);
+        command << " --scene \"" << scene << '"';
+    }
+    // Keep the log of the renderer off the JSON written to stdout
+    command << " 1>&2";
+
+    if (std::system(command.str().c_str()) != 0) {
+        throw std::runtime_error("Rendering " + bench.name + " failed");
+    }
+    double const seconds {json_number(read_file(stats), "seconds")};
+    if (seconds <= 0.0) {
+        throw std::runtime_error("Rendering " + bench.name + " reported no time");
+    }
+    return seconds;
+}
+
+/* Compare against the results of an earlier run, flagging the scenes that
+ * got slower than the tolerance allows */
+static void compare(std::vector<Result>& results, Options const& options) {
+    std::string const baseline {read_file(options.baseline)};
+
+    for (Result& result : results) {
+        size_t const scene {baseline.find("\"name\": \"" + result.name + "\"")};
+        if (scene == std::string::npos) {
+            std::cerr << "No baseline for " << result.name << std::endl;
+            continue;
+        }
+        result.baseline = json_number(baseline, "samples_per_second", scene);
+        if (result.baseline <= 0.0) {
+            continue;
+        }
+
+        double const change {result.samples_per_second / result.baseline - 1.0};
+        result.regression = change < -options.tolerance;
+        std::fprintf(stderr, "%-8s %+6.1f%% samples/sec against the baseline%s\n",
+                     result.name.c_str(), change * 100.0,
+                     result.regression ? "  REGRESSION" : "");
+    }
+}
+
+static void write_results(std::ostream& out, std::vector<Result> const& results,
+                          Options const& options) {
+    out << "{\n"
+        << "  \"backend\": \"" << options.backend << "\",\n"
+        << "  \"frames\": " << options.frames << ",\n"
+        << "  \"samples_per_pixel\": " << options.samples << ",\n"
+        << "  \"width\": " << GL::WIDTH << ",\n"
+        << "  \"height\": " << GL::HEIGHT << ",\n"
+        << "  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        Result const& result {results[i]};
+        out << "    {\"name\": \"" << result.name << "\""
+            << ", \"seconds\": " << result.seconds
+            << ", \"samples_per_second\": " << result.samples_per_second
+            << ", \"rays_per_sample\": " << result.rays_per_sample
+            << ", \"rays_per_second\": " << result.rays_per_second;
+        if (result.baseline > 0.0) {
+            out << ", \"baseline_samples_per_second\": " << result.baseline
+                << ", \"regression\": " << (result.regression ? "true" : "false");
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+static void print_usage(char const* name) {
+    std::cerr << "Usage: " << name << " --renderer PATH --scenes DIR [--output DIR]\n"
+              << "       [--frames N] [--samples N] [--backend gpu|cpu|wavefront]\n"
+              << "       [--baseline FILE] [--tolerance FRACTION]\n"
+              << "  --renderer PATH  The RayTracer executable\n"
+              << "  --scenes DIR     The scenes directory of the source tree\n"
+              << "  --output DIR     Where the images and results go (default bench)\n"
+              << "  --frames N       Frames rendered per scene (default 8)\n"
+              << "  --samples N      Samples per pixel and frame (default 4)\n"
+              << "  --backend NAME   Trace on the gpu (default), the cpu or the gpu in\n"
+              << "                   wavefront stages\n"
+              << "  --baseline FILE  Results of an earlier run to compare against\n"
+              << "  --tolerance FRACTION\n"
+              << "                   Slowdown flagged as a regression (default 0.1)\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options {};
+    for (int i = 1; i < argc; i++) {
+        bool const has_value {i + 1 < argc};
+
+        if (!std::strcmp(argv[i], "--renderer") && has_value) {
+            options.renderer = argv[++i];
+        } else if (!std::strcmp(argv[i], "--scenes") && has_value) {
+            options.scenes = argv[++i];
+        } else if (!std::strcmp(argv[i], "--output") && has_value) {
+            options.output = argv[++i];
+        } else if (!std::strcmp(argv[i], "--frames") && has_value) {
+            options.frames = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--samples") && has_value) {
+            options.samples = std::stoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--backend") && has_value) {
+            options.backend = argv[++i];
+        } else if (!std::strcmp(argv[i], "--baseline") && has_value) {
+            options.baseline = argv[++i];
+        } else if (!std::strcmp(argv[i], "--tolerance") && has_value) {
+            options.tolerance = std::stod(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.renderer.empty() || options.scenes.empty() || options.frames < 1 ||
+        options.samples < 1 || (options.backend != "gpu" && options.backend != "cpu" &&
+                                options.backend != "wavefront")) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results {};
+    try {
+        std::filesystem::path const scenes {options.scenes};
+        std::vector<BenchScene> const benches {
+            // The built in scene has a text copy to measure its rays on
+            {"default", SceneFile::read_text((scenes / "default.scene").string()), true},
+            {"spheres", many_spheres(), false},
+            {"cornell", SceneFile::read_text((scenes / "cornell.scene").string()), false},
+            {"glass", SceneFile::read_text((scenes / "glass.scene").string()), false},
+        };
+        std::filesystem::create_directories(options.output);
+
+        for (BenchScene const& bench : benches) {
+            double const seconds {render(options, bench)};
+            double const samples {static_cast<double>(GL::WIDTH) * GL::HEIGHT *
+                                  options.frames * options.samples};
+            double const rays {rays_per_sample(bench.scene)};
+            results.push_back({bench.name, seconds, samples / seconds, rays,
+                               rays * samples / seconds});
+        }
+
+        if (!options.baseline.empty()) {
+            compare(results, options);
+        }
+
+        std::string const path {(std::filesystem::path(options.output) / "results.json").string()};
+        std::ofstream file {path};
+        write_results(file, results, options);
+        if (!file) {
+            throw std::runtime_error("Failed to write " + path);
+        }
+    } catch (std::runtime_error const& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    write_results(std::cout, results, options);
+    for (Result const& result : results) {
+        if (result.regression) {
+            return 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "tracer_objects.h"
+#include <vector>
+
+/* A node of the flattened hierarchy, two texels in the shader. The left
+ * child of an interior node always directly follows its parent. */
+struct BVHNode {
+    vec3 min;
+    GLint count;   // Primitives in a leaf, 0 for interior nodes
+    vec3 max;
+    GLint offset;  // First primitive reference of a leaf, right child otherwise
+};
+
+/* Primitive references packed in fours to fill a texel */
+struct BVHRefs {
+    GLint refs[4];
+};
+
+struct BVH {
+    // Primitive types, stored in the low bits of a reference
+    GLint static const SPHERE {0};
+    GLint static const QUAD {1};
+    GLint static const INSTANCE {2};
+    GLint static const TYPE_BITS {2};
+
+    // Keeps the shader traversal stack bounded
+    size_t static const MAX_DEPTH {30};
+    // Largest leaf the shader is handed
+    size_t static const GPU_LEAF_SIZE {4};
+    // Largest leaf the CPU tracer is handed, one AVX2 packet of primitives
+    size_t static const CPU_LEAF_SIZE {8};
+
+    struct Primitive {
+        AABB bounds;
+        GLint ref;
+    };
+
+    std::vector<BVHNode> nodes;
+    std::vector<GLint> refs;
+
+    static GLint make_ref(GLint type, GLint index);
+    static GLint ref_type(GLint ref);
+    static GLint ref_index(GLint ref);
+    void build(std::vector<Primitive> primitives, size_t max_leaf_size);
+    std::vector<BVHRefs> packed_refs() const;
+
+private:
+    size_t build_node(std::vector<Primitive>& primitives, size_t begin, size_t end,
+                      size_t max_leaf_size, size_t depth);
+};
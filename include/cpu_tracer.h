@@ -0,0 +1,94 @@
+#pragma once
+#include "bvh.h"
+#include "camera.h"
+#include "gl.h"
+#include "mesh.h"
+#include "scene_soa.h"
+#include "thread_pool.h"
+#include "tracer_objects.h"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/* Path tracer running on the CPU, for machines without a usable GPU. It
+ * mirrors frag_trace.glsl and accumulates into the same layout as the GPU
+ * accumulation buffer: RGBA floats, bottom row first, holding the sum of
+ * the samples and the sample count in alpha. Adaptive sampling works on the
+ * tiles handed to the workers, which match the tiles of the GPU mask. */
+class CPUTracer {
+public:
+    // Pixels along each side of the tiles handed to the workers
+    size_t static constexpr TILE_SIZE {SampleBudget::ADAPTIVE_TILE};
+
+    CPUTracer(size_t width, size_t height, size_t thread_count);
+
+    void set_scene(GLArray<Sphere> const& spheres, GLArray<Quad> const& quads,
+                   MeshSet meshes, bool ground_plane);
+    void set_viewport(size_t width, size_t height);
+    void set_region(size_t x, size_t y, size_t width, size_t height);
+    void reset();
+    void trace(Camera const& camera, GLuint frame, SampleBudget const& budget);
+
+    std::vector<GLfloat> const& pixels() const;
+    size_t threads() const;
+    uint64_t rays() const;
+
+private:
+    struct Ray {
+        vec3 origin;
+        vec3 dir;
+    };
+
+    struct Hit {
+        vec3 p;
+        vec3 normal;
+        GLfloat t;
+        bool front_face;
+        Material material;
+        // Type and index of the primitive as in BVH references, -1 for the
+        // ground plane
+        GLint type {-1};
+        GLint index {-1};
+    };
+
+    class RNG;
+
+    void trace_tile(size_t tile, Matrix4 const& view, GLint fov, GLuint frame,
+                    SampleBudget const& budget);
+    vec3 ray_color(Ray ray, RNG& rng, SampleBudget const& budget, uint64_t& rays) const;
+    vec3 sample_lights(Hit const& hit, GLfloat u_pick, GLfloat const u[2], uint64_t& rays) const;
+    GLfloat emitter_pdf(Hit const& hit, Ray const& ray) const;
+    void update_active_tiles(GLfloat threshold);
+    bool tile_converged(size_t tile, GLfloat threshold) const;
+    bool trace_scene(Ray const& ray, Hit& hit) const;
+    GLfloat mesh_hit(Mesh const& mesh, Ray const& ray, RayShear const& shear,
+                     vec3 const& inv_dir, GLfloat dist, GLint& triangle) const;
+
+    // Size of the accumulated image, and of the part of it that is traced
+    size_t width;
+    size_t height;
+    size_t view_width;
+    size_t view_height;
+    // Rectangle of the image whose tiles are traced, corners inclusive and
+    // exclusive
+    size_t region_x0 {0};
+    size_t region_y0 {0};
+    size_t region_x1 {SIZE_MAX};
+    size_t region_y1 {SIZE_MAX};
+    std::vector<GLfloat> accum;
+    std::vector<GLfloat> moments; // Sums of squared sample luminance
+    std::vector<size_t> active_tiles;
+    GLint sample_boost {1};
+    std::vector<Sphere> spheres {};
+    std::vector<Quad> quads {};
+    MeshSet meshes {};
+    BVH bvh {};
+    SceneSoA soa {};
+    bool ground_plane {true};
+    LightList lights {};
+    // Any primitive emits, so paths draw samples for the lights
+    bool emissive {false};
+    // Rays cast into the scene since the tracer was made
+    std::atomic<uint64_t> rays_cast {0};
+    ThreadPool pool;
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include "renderer.h"
+#include <string>
+#include <vector>
+
+/* Headless renders split across processes. A coordinator cuts the image into
+ * bands of rows and the frames of each band into sample ranges, hands them
+ * out to the workers connected to it over TCP and adds up the accumulation
+ * buffers they send back. Workers must render the same scene at the same
+ * size and sample budget, with the same sampler and backend, for their
+ * tiles to add up to the image a single process would.
+ *
+ * Messages are fixed size structs in the byte order of the machines, which
+ * are assumed to share it. */
+namespace Distributed {
+    int coordinate(Renderer::Settings const& settings,
+                   std::vector<std::string> const& worker_command);
+    int work(Renderer::Settings const& settings);
+};
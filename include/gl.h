@@ -2,14 +2,24 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <limits>
+#include <map>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include <cassert>
 
 
 namespace GL {
     static int const WIDTH {1280};
     static int const HEIGHT {960};
+    // Size of arrays that are only limited by what the driver can allocate
+    static size_t const UNBOUNDED {std::numeric_limits<size_t>::max()};
     
     typedef struct FBO {
         GLuint fbo;
@@ -18,59 +28,244 @@ namespace GL {
         void use() const;
     } FBO;
 
-    GLFWwindow* init();
+    GLFWwindow* init(int major = 0, int minor = 0);
+    GLFWwindow* create_shared_context(GLFWwindow* const window);
+    bool init_headless(int major = 3, int minor = 3);
+    void terminate_headless();
     void run_loop(GLFWwindow* const window, std::function<void()> const& callback);
     std::string read_file(std::string const& file_path);
     GLuint compile_shader(std::string const& source, GLenum const type);
     GLuint create_program(std::string const& vertex_code, std::string const& fragment_code);
+    GLuint create_compute_program(std::string const& compute_code);
+    void set_program_cache(std::string const& directory);
+    std::string default_program_cache();
     GLuint create_program_from_file(std::string const& vertex_path, std::string const& fragment_path);
-    FBO create_fbo();
+    FBO create_fbo(GLint internal_format, GLsizei width = WIDTH, GLsizei height = HEIGHT);
+    FBO wrap_texture(GLuint texture);
+    GLuint attach_texture(FBO const& fbo, GLenum attachment, GLint internal_format,
+                          GLsizei width = WIDTH, GLsizei height = HEIGHT);
+    void save_fbo(FBO const& fbo, std::string const& file_path);
     GLuint get_binding_point();
+    GLuint get_texture_unit();
+    std::string add_defines(std::string const& source, std::vector<std::string> const& defines);
+
+    /* Variants of one program, compiled on first use for each set of
+     * preprocessor defines. A define is a name optionally followed by a
+     * space and its value, like "MAX_BOUNCE 8". Built from a single source
+     * the variants are compute programs. */
+    class ProgramCache {
+    public:
+        ProgramCache() = default;
+        ProgramCache(std::string const& vertex_code, std::string const& fragment_code);
+        explicit ProgramCache(std::string const& compute_code);
+
+        GLuint get(std::vector<std::string> const& defines);
+        size_t size() const;
+
+    private:
+        std::string vertex_code;
+        std::string fragment_code;
+        std::string compute_code;
+        std::map<std::string, GLuint> programs {};
+    };
+
+    /* Summary of the latest durations of something, in seconds */
+    struct TimingStats {
+        size_t count;
+        double average;
+        double p50;
+        double p95;
+        double p99;
+    };
+
+    /* Rolling window of durations to take averages and percentiles over */
+    class TimingHistory {
+    public:
+        // Durations kept, a few seconds of frames
+        size_t static constexpr SIZE {256};
+
+        void add(double seconds);
+        TimingStats stats() const;
+
+    private:
+        std::deque<double> times {};
+    };
+
+    /* GPU time of a pass, measured by wrapping its commands in
+     * GL_TIME_ELAPSED queries. The queries go round a ring and are read a
+     * few frames later, once the GPU has caught up with them, so measuring
+     * never stalls the pipeline. A pass finding every query still in
+     * flight goes unmeasured. Each pass may say how much work it did, to
+     * tell the time a unit of it takes. */
+    class GPUTimer {
+    public:
+        size_t static constexpr RING_SIZE {4};
+
+        void begin();
+        void end(double work = 1.0);
+        void collect();
+        TimingStats stats() const;
+        double rate() const;
+
+    private:
+        std::vector<GLuint> queries {};
+        std::vector<double> work {}; // Of the pass each query measures
+        double latest_rate {0.0};
+        size_t first {0}; // Oldest query in flight
+        size_t pending {0};
+        bool active {false};
+        TimingHistory history {};
+    };
 };
 
 
-template <typename T, size_t MAX_SIZE>
+template <typename T, size_t MAX_SIZE = GL::UNBOUNDED>
 class GLArray {
 public:
+    /* Back the array with a uniform block holding at most MAX_SIZE elements */
     void bind(GLuint program, std::string const& block_name) {
+        static_assert(MAX_SIZE != GL::UNBOUNDED, "Uniform blocks need a fixed size");
+
         this->program = program;
-        this->block_name = block_name;
+        this->name = block_name;
+        this->target = GL_UNIFORM_BUFFER;
         // WARN: This is absolutely not thread safe
         this->binding_point = GL::get_binding_point();
 
         // Create a uniform buffer object
-        glGenBuffers(1, &ubo);
-        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
 
         // Allocate memory in the buffer
         glBufferData(
             GL_UNIFORM_BUFFER, sizeof(T) * MAX_SIZE, nullptr, GL_STATIC_DRAW
         );
+        capacity = MAX_SIZE;
 
         GLuint const block_index = glGetUniformBlockIndex(program, block_name.c_str());
 
         // Bind the buffer to a binding point
-        glBindBufferBase(GL_UNIFORM_BUFFER, binding_point, ubo);
+        glBindBufferBase(GL_UNIFORM_BUFFER, binding_point, buffer);
 
         glUniformBlockBinding(program, block_index, binding_point);
+        mark_dirty(0, vector.size());
+    }
+
+    /* Back the array with a texture buffer that grows along with the array.
+     * The shader reads it through an isamplerBuffer, one ivec4 texel at a
+     * time, so T has to be a whole number of texels. */
+    void bind_texture(GLuint program, std::string const& sampler_name) {
+        static_assert(sizeof(T) % TEXEL_SIZE == 0, "Elements must fill whole texels");
+
+        this->program = program;
+        this->name = sampler_name;
+        this->target = GL_TEXTURE_BUFFER;
+        // WARN: Neither is this
+        this->texture_unit = GL::get_texture_unit();
+
+        glGenBuffers(1, &buffer);
+        glGenTextures(1, &texture);
+        reserve(std::max(vector.size(), INITIAL_CAPACITY));
+
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, sampler_name.c_str()), texture_unit);
+    }
+
+    /* Stream a texture buffer through a persistently mapped ring of copies
+     * instead of updating it in place, so edits every frame never wait on
+     * the GPU reading the previous frame. Needs GL 4.4 buffer storage.
+     *
+     * Returns: false if the driver lacks support and the array stays as is */
+    bool enable_ring_buffer() {
+        assert(target == GL_TEXTURE_BUFFER);
+
+        if (!GLEW_ARB_buffer_storage || !GLEW_ARB_texture_buffer_range) {
+            return false;
+        }
+
+        ring = true;
+        reserve(capacity);
+        return true;
     }
 
     /* Bind to a variable that will track the size of the array */
     void bind_size(GLuint program, std::string const& size_name) {
+        this->size_name = size_name;
         size_var = glGetUniformLocation(program, size_name.c_str());
+        uploaded_size = UNKNOWN_SIZE;
+    }
+
+    /* Have another program read the array through the same buffer, for when
+     * it moves between variants of a shader */
+    void rebind(GLuint program) {
+        this->program = program;
+
+        if (target == GL_TEXTURE_BUFFER) {
+            glUseProgram(program);
+            glUniform1i(glGetUniformLocation(program, name.c_str()), texture_unit);
+        } else if (target == GL_UNIFORM_BUFFER) {
+            GLuint const block_index {glGetUniformBlockIndex(program, name.c_str())};
+            if (block_index != GL_INVALID_INDEX) {
+                glUniformBlockBinding(program, block_index, binding_point);
+            }
+        }
+
+        if (!size_name.empty()) {
+            bind_size(program, size_name);
+        }
     }
 
-    void upload() const {
-        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, vector.size() * sizeof(T), vector.data());
+    /* Let another program read a texture buffer array as well, setting its
+     * size variable to the current size. The array keeps updating its own
+     * program, so this is repeated whenever the size may have changed. */
+    void share(GLuint program) const {
+        assert(target == GL_TEXTURE_BUFFER);
 
-        if (size_var != -1) {
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, name.c_str()), texture_unit);
+        if (!size_name.empty()) {
+            glUniform1i(glGetUniformLocation(program, size_name.c_str()), vector.size());
+        }
+    }
+
+    /* Upload the modified parts of the array, skipping the call entirely if
+     * nothing changed since the last upload */
+    void upload() {
+        if (target == GL_TEXTURE_BUFFER && vector.size() > capacity) {
+            reserve(std::max(vector.size(), 2 * capacity));
+        }
+
+        if (!dirty_ranges.empty()) {
+            if (ring) {
+                upload_ring();
+            } else {
+                glBindBuffer(target, buffer);
+                for (auto const& [begin, end] : dirty_ranges) {
+                    glBufferSubData(
+                        target, begin * sizeof(T), (end - begin) * sizeof(T), &vector[begin]
+                    );
+                }
+            }
+            dirty_ranges.clear();
+        }
+        shrunk = false;
+
+        if (size_var != -1 && uploaded_size != vector.size()) {
             glUniform1i(size_var, vector.size());
+            uploaded_size = vector.size();
         }
     }
 
+    /* Whether any element changed, or any was removed, since the last
+     * upload */
+    bool dirty() const {
+        return !dirty_ranges.empty() || shrunk;
+    }
+
     T& at(size_t index) {
-        return vector.at(index);
+        T& value {vector.at(index)};
+        mark_dirty(index, index + 1);
+        return value;
     }
 
     T const& at(size_t index) const {
@@ -79,6 +274,7 @@ public:
 
     T& operator[](size_t index) {
         assert(index < MAX_SIZE);
+        mark_dirty(index, index + 1);
         return vector[index];
     }
 
@@ -87,6 +283,10 @@ public:
         return vector[index];
     }
 
+    T const* data() const {
+        return vector.data();
+    }
+
     bool empty() const {
         return vector.empty();
     }
@@ -101,30 +301,193 @@ public:
 
     void clear() {
         vector.clear();
+        dirty_ranges.clear();
+        shrunk = true;
     }
 
     void erase(size_t index) {
         vector.erase(vector.begin() + index);
+        shrunk = true;
+        // Everything after the erased element moved down a slot
+        mark_dirty(index, vector.size());
     }
 
     void push_back(T const& value) {
         assert(vector.size() < MAX_SIZE);
         vector.push_back(value);
+        mark_dirty(vector.size() - 1, vector.size());
     } 
 
     void push_back(T&& value) {
+        assert(vector.size() < MAX_SIZE);
         vector.push_back(std::forward<T>(value));
+        mark_dirty(vector.size() - 1, vector.size());
+    }
+
+    /* Replace the whole array with a block of elements in one copy, like a
+     * section of a mapped file, to be sent in a single upload */
+    void assign(T const* values, size_t count) {
+        assert(count <= MAX_SIZE);
+        shrunk = shrunk || count < vector.size();
+        vector.assign(values, values + count);
+        dirty_ranges.clear();
+        mark_dirty(0, vector.size());
     }
 
     void pop_back() {
         vector.pop_back();
+        shrunk = true;
+        // Drop whatever part of the dirty ranges is now out of bounds
+        mark_dirty(0, 0);
     }
 
 private:
-    GLuint ubo;
+    // Texture buffers are read as RGBA32I texels
+    static size_t constexpr TEXEL_SIZE {4 * sizeof(GLint)};
+    static size_t constexpr INITIAL_CAPACITY {64};
+    // Copies in a ring, enough for the CPU to stay a frame or two ahead
+    static size_t constexpr RING_SLOTS {3};
+    static size_t constexpr UNKNOWN_SIZE {std::numeric_limits<size_t>::max()};
+
+    /* Merge a range of modified elements into the sorted, disjoint list of
+     * ranges that need to be uploaded */
+    void mark_dirty(size_t begin, size_t end) {
+        std::vector<std::pair<size_t, size_t>> merged {};
+        bool inserted {begin >= end};
+
+        for (auto [b, e] : dirty_ranges) {
+            e = std::min(e, vector.size());
+            if (b >= e) {
+                continue;
+            }
+
+            if (!inserted && e >= begin && b <= end) {
+                // Overlapping or touching, swallow it into the new range
+                begin = std::min(begin, b);
+                end = std::max(end, e);
+                continue;
+            }
+            if (!inserted && b > end) {
+                merged.emplace_back(begin, end);
+                inserted = true;
+            }
+            merged.emplace_back(b, e);
+        }
+
+        if (!inserted) {
+            merged.emplace_back(begin, end);
+        }
+        dirty_ranges = std::move(merged);
+    }
+
+    /* Reallocate the texture buffer to fit a number of elements */
+    void reserve(size_t new_capacity) {
+        GLint max_texels {};
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+        if (new_capacity * sizeof(T) / TEXEL_SIZE > static_cast<size_t>(max_texels)) {
+            throw std::runtime_error("Texture buffer " + name + " exceeds the driver limit");
+        }
+
+        capacity = new_capacity;
+        if (ring) {
+            reserve_ring();
+        } else {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+            glBufferData(GL_TEXTURE_BUFFER, capacity * sizeof(T), nullptr, GL_STATIC_DRAW);
+
+            // Reattach the new storage to the texture
+            glActiveTexture(GL_TEXTURE0 + texture_unit);
+            glBindTexture(GL_TEXTURE_BUFFER, texture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, buffer);
+            glActiveTexture(GL_TEXTURE0);
+        }
+
+        // The new storage starts out empty
+        mark_dirty(0, vector.size());
+    }
+
+    /* Allocate an immutable, persistently mapped buffer with a slot for each
+     * copy in the ring */
+    void reserve_ring() {
+        // Immutable storage can't be resized, so start over with a new buffer
+        for (GLsync& fence : fences) {
+            if (fence) {
+                glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+                glDeleteSync(fence);
+                fence = nullptr;
+            }
+        }
+        glDeleteBuffers(1, &buffer);
+        glGenBuffers(1, &buffer);
+
+        GLint alignment {};
+        glGetIntegerv(GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        slot_size = (capacity * sizeof(T) + alignment - 1) / alignment * alignment;
+
+        GLbitfield const flags {GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT};
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferStorage(GL_TEXTURE_BUFFER, slot_size * RING_SLOTS, nullptr, flags);
+        mapped = static_cast<unsigned char*>(
+            glMapBufferRange(GL_TEXTURE_BUFFER, 0, slot_size * RING_SLOTS, flags)
+        );
+        slot = 0;
+
+        glActiveTexture(GL_TEXTURE0 + texture_unit);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBufferRange(GL_TEXTURE_BUFFER, GL_RGBA32I, buffer, 0, slot_size);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    /* Write the array into the next slot of the ring and point the texture
+     * at it */
+    void upload_ring() {
+        // Fence the slot the previous frames read from, then move on to the
+        // oldest one once the GPU is done with it
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot = (slot + 1) % RING_SLOTS;
+
+        if (fences[slot]) {
+            while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT)
+                   == GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(fences[slot]);
+            fences[slot] = nullptr;
+        }
+
+        // Each slot misses the edits made while the others were in use, so
+        // the whole array is copied rather than just the dirty ranges
+        if (!vector.empty()) {
+            std::memcpy(mapped + slot * slot_size, vector.data(), vector.size() * sizeof(T));
+        }
+
+        glActiveTexture(GL_TEXTURE0 + texture_unit);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBufferRange(GL_TEXTURE_BUFFER, GL_RGBA32I, buffer, slot * slot_size, slot_size);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // Nanoseconds to wait on a fence before checking again
+    static GLuint64 constexpr FENCE_TIMEOUT {1000000};
+
+    GLuint buffer;
+    GLuint texture;
+    GLenum target;
     GLuint program;
     GLuint binding_point;
+    GLuint texture_unit;
+    size_t capacity {};
     GLint size_var {-1};
-    std::string block_name;
+    size_t uploaded_size {UNKNOWN_SIZE};
+    std::string name;
+    std::string size_name;
     std::vector<T> vector {};
+    std::vector<std::pair<size_t, size_t>> dirty_ranges {};
+    // Removed elements leave nothing to upload but still change the array
+    bool shrunk {false};
+
+    // Persistently mapped ring state
+    bool ring {false};
+    unsigned char* mapped {nullptr};
+    size_t slot_size {};
+    size_t slot {};
+    GLsync fences[RING_SLOTS] {};
 };
@@ -28,10 +28,14 @@ struct Matrix4 {
     Matrix4& rotx(GLfloat angle);
     Matrix4& roty(GLfloat angle);
     Matrix4& rotz(GLfloat angle);
+    Matrix4& scale(GLfloat x, GLfloat y, GLfloat z);
     Matrix4& look_at(vec3 const& pos, vec3 const& look, vec3 const& up);
      
     Matrix4 operator+(Matrix4 const& other) const;
     Matrix4 operator*(Matrix4 const& other) const;
+    vec3 transform_point(vec3 const& p) const;
+    vec3 transform_vector(vec3 const& v) const;
+    Matrix4 inverse_affine() const;
 
     void upload(GLuint program, std::string const& var) const;
 
@@ -54,6 +58,7 @@ struct vec3 {
 
     vec3 operator+(vec3 const& other) const;
     vec3 operator-(vec3 const& other) const;
+    vec3 operator-() const;
     vec3 operator*(GLfloat f) const;
     vec3 operator*(vec3 const& other) const;
     vec3 operator/(GLfloat f) const;
@@ -64,6 +69,7 @@ struct vec3 {
     bool operator==(vec3 const& other) const;
     vec3& operator+=(vec3 const& other);
     vec3& operator-=(vec3 const& other);
+    GLfloat operator[](size_t axis) const;
 
     vec3 normalize();
     GLfloat length() const;
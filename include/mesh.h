@@ -0,0 +1,86 @@
+#pragma once
+#include "bvh.h"
+#include "tracer_objects.h"
+#include <string>
+#include <vector>
+
+/* A vertex of a mesh, one texel in the shader */
+struct MeshVertex {
+    vec3 p;
+    GLfloat pad;
+};
+
+/* Vertex indices of a triangle, one texel in the shader */
+struct MeshTriangle {
+    GLint v[3];
+    GLint pad;
+};
+
+/* Geometry shared by the instances placed in the scene, two texels in the
+ * shader. Its BVH is a range of the mesh nodes starting at root, whose
+ * leaves index the mesh triangles, whose corners index the mesh vertices,
+ * all by absolute index. The bounds are in the mesh's own space. */
+struct Mesh {
+    vec3 min;
+    GLint root;
+    vec3 max;
+    GLint triangle_count;
+
+    AABB bounds() const;
+};
+
+/* A placement of a mesh, seven texels in the shader. Rays are moved into
+ * the space of the mesh rather than the mesh being copied into the scene,
+ * so every copy of an object shares its triangles and hierarchy. */
+struct Instance {
+    // Top three rows of the inverse of the placement, taking points from
+    // the scene into the space of the mesh
+    GLfloat world_to_object[12];
+    vec3 min; // Bounds in the scene
+    GLint mesh;
+    vec3 max;
+    GLint pad;
+    Material material;
+
+    Instance() = default;
+    Instance(Mesh const& geometry, GLint mesh, Matrix4 const& transform,
+             Material const& material);
+    AABB bounds() const;
+    vec3 to_object_point(vec3 const& p) const;
+    vec3 to_object_vector(vec3 const& v) const;
+    vec3 normal_to_world(vec3 const& normal) const;
+};
+
+/* Triangles read from a model file, before they get a BVH */
+struct TriangleMesh {
+    std::vector<vec3> vertices {};
+    std::vector<MeshTriangle> triangles {};
+
+    static TriangleMesh load_obj(std::string const& path);
+};
+
+/* The meshes of a scene and their instances laid out for the tracers, each
+ * mesh with its own BVH over its triangles. The top level BVH of the scene
+ * references instances. */
+struct MeshSet {
+    std::vector<Mesh> meshes {};
+    std::vector<Instance> instances {};
+    std::vector<MeshVertex> vertices {};
+    std::vector<MeshTriangle> triangles {};
+    std::vector<BVHNode> nodes {};
+
+    GLint add(TriangleMesh const& mesh);
+    void add_instance(GLint mesh, Matrix4 const& transform, Material const& material);
+};
+
+/* Precomputed per ray for the watertight ray/triangle test of Woop,
+ * Benthin and Wald, which shears the ray onto the z axis so shared edges
+ * are tested with the same arithmetic from both sides */
+struct RayShear {
+    size_t kx, ky, kz;
+    GLfloat sx, sy, sz;
+
+    RayShear(vec3 const& dir);
+    GLfloat triangle_hit(vec3 const& origin, vec3 const& v0, vec3 const& v1,
+                         vec3 const& v2) const;
+};
@@ -1,45 +1,302 @@
 #pragma once
+#include "bvh.h"
 #include "camera.h"
+#include "cpu_tracer.h"
 #include "gl.h"
+#include "mesh.h"
 #include "model.h"
+#include "scene_file.h"
+#include "spsc_queue.h"
 #include "tracer_objects.h"
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <thread>
 
 namespace Renderer {
+    enum class Backend {
+        GPU,
+        CPU,
+        // Compute shader stages passing queues of paths along, GL 4.3
+        WAVEFRONT,
+    };
+
+    enum class Sampler {
+        RANDOM, // Independent random numbers from a PCG generator per pixel
+        SOBOL, // Owen scrambled Sobol points, which cover the pixel evenly
+    };
+
+    struct Settings {
+        // Render offscreen and write the result to a file instead of
+        // opening a window
+        bool headless {false};
+        // Number of accumulated frames to render in headless mode
+        GLuint frames {100};
+        // Output image for headless mode (binary PPM)
+        std::string output {"render.ppm"};
+        // Stream the scene through persistently mapped buffers, for scenes
+        // that are edited every frame
+        bool stream_scene {false};
+        // Which tracer renders the frames
+        Backend backend {Backend::GPU};
+        // Worker threads of the CPU backend
+        size_t threads {std::thread::hardware_concurrency()};
+        // Samples and path depth of each frame
+        SampleBudget budget {};
+        // Where the samples of the GPU tracer come from
+        Sampler sampler {Sampler::SOBOL};
+        // Seconds per frame to hold while the camera moves by tracing at a
+        // lower resolution, 0 always traces at full resolution
+        double target_frame_time {1.0 / 30.0};
+        // Directory keeping linked shader programs between runs, empty to
+        // always compile them
+        std::string program_cache {GL::default_program_cache()};
+        // Binary scene file to render, empty for the built in scene
+        std::string scene {};
+        // File receiving the time and size of a headless render as JSON,
+        // empty for none
+        std::string stats {};
+        // Report the GPU time of the trace and display passes every second,
+        // and once at the end in headless mode
+        bool timings {false};
+        // Filter the noise out of the image before it is displayed, guided
+        // by the albedo, normal and depth the trace writes alongside
+        bool denoise {false};
+        // Seconds of GPU time to trace for in each frame, splitting the image
+        // into tiles traced over several frames when it takes longer. 0
+        // traces the whole image every frame. GPU backend only.
+        double trace_budget {0.0};
+        // Carry the accumulated samples into the new view when the camera
+        // moves instead of starting over. Needs a window and a GPU backend.
+        bool reproject {true};
+        // Hand the tiles and sample ranges of a headless render to worker
+        // processes connecting on this port instead of tracing them here.
+        // -1 renders alone, 0 listens on any free port.
+        GLint coordinate_port {-1};
+        // Worker processes the coordinator starts on this machine
+        size_t local_workers {0};
+        // host:port of a coordinator to trace for instead of rendering alone
+        std::string coordinator {};
+    };
+
+    /* A rectangle of the image traced by one draw */
+    struct Tile {
+        GLint x, y;
+        GLsizei width, height;
+    };
+
+    /* The camera and traced resolution some samples belong to */
+    struct View {
+        Camera camera;
+        GLsizei width, height;
+    };
+
+    // Views the window thread can get ahead of the render thread by
+    static size_t const VIEW_QUEUE_SIZE {64};
+
+    /* Latest durations of the passes of a frame, in seconds */
+    struct Timings {
+        GL::TimingStats trace; // GPU time of tracing, or of uploading a CPU frame
+        GL::TimingStats present; // GPU time of resolving to the screen
+        GL::TimingStats frame; // Wall time between frames
+    };
+
     struct State {
         GLFWwindow* window;
+        Settings settings;
+
+        // With a window, tracing runs on a thread of its own in a context
+        // sharing the window's, so a long trace never holds up input. The
+        // window thread moves its own copy of the camera and sends the views
+        // over in order.
+        std::thread render_thread;
+        GLFWwindow* render_context;
+        SPSCQueue<Camera, VIEW_QUEUE_SIZE> views;
+        Camera input_camera;
+        bool camera_sent; // The render thread has the latest input camera
+        double last_move; // When the render thread last got a new view
+        double last_trace;
+        std::atomic<bool> stopping;
+        std::exception_ptr render_error;
+
+        // Displayed images go from the render thread to the window in three
+        // slots: one being drawn, the latest finished one and the one on
+        // screen. The finished slot is swapped for the others atomically,
+        // flagged while the window has not taken it yet. The fences tell
+        // when the GPU is done drawing into a slot and showing it.
+        GL::FBO fbo_display[3]; // Of the render context
+        GL::FBO window_display[3]; // The same textures in the window context
+        std::atomic<GLuint> display_ready;
+        GLuint display_back; // Slot of the render thread
+        GLuint display_front; // Slot of the window thread
+        GLsync drawn_fences[3];
+        GLsync shown_fences[3];
+        // Average trace and display time in ms for the title of the window,
+        // which only the window thread may set
+        std::atomic<double> title_trace, title_present;
+        std::atomic<bool> title_pending;
 
         // OpenGL variables
-        GLuint program;
+        GLuint program; // The variant of the trace shader in use
+        GL::ProgramCache trace_programs;
+        std::vector<std::string> scene_defines;
         GLuint tex_program;
+        GLuint mask_program;
         GLuint VAO, VBO;
-        GLuint frame;
+        GLuint frame; // Frames accumulated since the last reset
+        GLuint samples; // Samples per pixel accumulated since the last reset
         
         struct ShaderUniforms {
             GLint resolution;
-            GLint time;
+            GLint first_sample;
             GLint frame;
             GLint view_matrix;
             GLint fov;
+            GLint samples_per_pixel;
+            GLint max_bounce;
+            GLint roulette_depth;
+            GLint adaptive;
+            GLint light_power;
         } uniforms;
 
         // Frame buffer objects
-        GL::FBO fbo_current;
-        GL::FBO fbo_prev;
+        // Float sums of linear radiance, with the sample count in alpha, and
+        // of squared luminance in a second target
+        GL::FBO fbo_accum;
+        GLuint accum_moments;
+        // Sums of the features the denoiser follows edges by, albedo with
+        // depth in alpha and normals
+        GLuint accum_albedo, accum_normal;
+        GLuint albedo_unit, normal_unit;
+        // One texel per adaptive sampling tile, 0.0 once it has converged
+        GL::FBO fbo_mask;
+        GLuint mask_unit, moments_unit;
+        // Multiplies the samples of the tiles that have not converged
+        GLint sample_boost;
+        // Wavefront backend: its stages, and the paths, hits, queues and
+        // queue counters they pass along. Waves hold one path per pixel.
+        GL::ProgramCache wavefront_programs;
+        GLuint wave_paths, wave_hits, wave_queues, wave_counters;
+        GLuint wave_size;
+
+        // The view the accumulated samples were traced in
+        View traced_view;
+        // Copy of the accumulation kept when the view changes, to be
+        // reprojected onto the first frame of the new view
+        GL::FBO fbo_history;
+        GLuint history_moments, history_albedo, history_normal;
+        GLuint history_albedo_unit, history_normal_unit;
+        View history_view;
+        bool history_pending;
+        GLuint reproject_program;
+        // Draws onto the radiance and moments of the accumulation buffer
+        GL::FBO fbo_reproject;
+
+        // Denoiser passes alternating between two targets
+        GLuint denoise_program;
+        GL::FBO fbo_denoise[2];
+        GLuint filtered_unit;
+
+        // 8-bit target for the displayed image when there is no window
+        GL::FBO fbo_output;
 
         // Time counters
         double last_time;
+        double last_report;
+        GL::GPUTimer trace_timer;
+        GL::GPUTimer present_timer;
+        GL::TimingHistory frame_history;
+
+        // Part of the accumulation buffer traced, smaller than the window
+        // while the camera moves and upscaled when presented
+        GLsizei trace_width, trace_height;
+        // Durations of the latest frames since the camera started moving
+        std::deque<double> frame_times;
+
+        // Tiles of the image under a trace budget. A pass traces every tile
+        // once, starting where the last pass stopped, and counts as one
+        // accumulated frame once it is through.
+        GLint tile_count;
+        GLint next_tile;
+        GLint tiles_done; // Tiles of the current pass already traced
+        // Pixels traced by the latest frame, the work the trace timer
+        // measures the time of
+        GLsizei traced_pixels;
+
+        // Part of the image traced, all of it when the width is 0. A worker
+        // of a distributed render traces the tile it was handed.
+        Tile region;
+        // Frames of the render traced before this accumulation started, so
+        // the sample ranges of a distributed render continue each other
+        GLuint first_frame;
 
         // Graphics objects
         Model render_base;
-        GLArray<Sphere, 256> spheres;
-        GLArray<Quad, 256> quads;
+        std::unique_ptr<CPUTracer> cpu_tracer;
+        GLArray<Sphere> spheres;
+        GLArray<Quad> quads;
+        bool ground_plane; // The plane hardcoded in the tracers
+
+        // Emissive spheres and quads sampled directly at diffuse bounces,
+        // and the sum of their power
+        GLArray<Light> lights;
+        GLfloat light_power;
+
+        // Triangle meshes with their own hierarchies and their placements in
+        // the scene, as laid out by MeshSet
+        GLArray<Mesh> meshes;
+        GLArray<Instance> instances;
+        GLArray<BVHNode> mesh_nodes;
+        GLArray<MeshTriangle> mesh_triangles;
+        GLArray<MeshVertex> mesh_vertices;
+
+        // Acceleration structure over the spheres, quads and instances
+        GLArray<BVHNode> bvh_nodes;
+        GLArray<BVHRefs> bvh_refs;
+        // The hierarchy came with a loaded scene and matches it already
+        bool bvh_loaded;
 
         Camera camera;
     };
 
     static State state;
 
-    void init();
+    void init(Settings const& settings);
+    int render_headless(Settings const& settings);
+    bool setup_headless(Settings const& settings);
+    std::vector<GLfloat> trace_region(Tile const& region, GLuint first_frame, GLuint frames);
+    void save_accumulation(std::vector<GLfloat> const& pixels);
+    void write_stats(std::string const& path, double elapsed);
+    void setup(Settings const& settings);
+    void load_scene(std::string const& path);
+    void add_default_scene();
+    void render_loop(Settings settings, std::promise<void>& ready);
+    void render_frame();
     void update();
+    void update_resolution(bool moving, double delta);
+    void restart_accumulation();
+    void setup_reprojection();
+    void keep_history();
+    void reproject_history(std::vector<Tile> const& tiles);
+    void trace();
+    std::vector<Tile> schedule_tiles();
+    Tile traced_area();
+    void trace_cpu();
+    void setup_wavefront();
+    void trace_wavefront(bool adaptive);
+    void update_sample_mask();
+    void present(GLuint framebuffer);
+    void setup_denoiser();
+    GLuint denoise();
+    Timings timings();
+    void report_timings();
+    void use_trace_program(GLuint program);
+    std::vector<std::string> scene_defines();
+    std::vector<std::string> trace_defines();
+    void build_bvh();
+    void build_lights();
+    MeshSet mesh_set();
     Model create_fullscreen_quad();
 };
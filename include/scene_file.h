@@ -0,0 +1,113 @@
+#pragma once
+#include "bvh.h"
+#include "camera.h"
+#include "mesh.h"
+#include "tracer_objects.h"
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/* Binary scene files hold the scene in the exact layout the tracers upload,
+ * so loading one is mapping it and handing its sections to the GLArrays.
+ *
+ * Layout, in native byte order:
+ *   Header
+ *   SectionEntry[header.section_count]
+ *   Section data, each starting on a SECTION_ALIGNMENT boundary
+ *
+ * Materials are part of the Sphere, Quad and Instance records, as in the
+ * shader. The mesh and instance sections hold a MeshSet. The BVH sections are optional,
+ * a scene without them gets its hierarchy built on load.
+ */
+namespace SceneFile {
+    uint32_t constexpr MAGIC {0x43535452}; // "RTSC"
+    // Version 2 added meshes, which took another bit of the BVH references.
+    // Version 3 moved their placement and material into instances.
+    uint32_t constexpr VERSION {3};
+    uint64_t constexpr SECTION_ALIGNMENT {16};
+
+    // Header flags
+    uint32_t constexpr GROUND_PLANE {1 << 0};
+
+    enum class Section : uint32_t {
+        SPHERES,
+        QUADS,
+        BVH_NODES,
+        BVH_REFS,
+        MESHES,
+        MESH_NODES,
+        MESH_TRIANGLES,
+        MESH_VERTICES,
+        INSTANCES,
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t section_count;
+        uint32_t flags;
+        vec3 camera_pos;
+        GLint camera_fov;
+        GLfloat camera_pitch;
+        GLfloat camera_yaw;
+        uint32_t pad1, pad2;
+    };
+
+    struct SectionEntry {
+        Section type;
+        uint32_t element_size;
+        uint64_t count;
+        uint64_t offset; // From the start of the file
+    };
+
+    /* A scene in memory, as read from a text scene */
+    struct Scene {
+        Camera camera {{0.0, 0.5, 0.0}, 70};
+        bool ground_plane {true};
+        std::vector<Sphere> spheres {};
+        std::vector<Quad> quads {};
+        MeshSet meshes {};
+    };
+
+    /* Read only view of a scene file mapped into memory. The sections point
+     * into the mapping and are only valid as long as it lives. */
+    class Mapping {
+    public:
+        explicit Mapping(std::string const& path);
+        ~Mapping();
+        Mapping(Mapping const&) = delete;
+        Mapping& operator=(Mapping const&) = delete;
+
+        Header const& header() const;
+        Camera camera() const;
+        bool has_section(Section type) const;
+
+        /* Returns: The elements of a section, or none if the file lacks it */
+        template <typename T>
+        std::pair<T const*, size_t> section(Section type) const {
+            static_assert(std::is_trivially_copyable_v<T>, "Sections are raw copies");
+
+            SectionEntry const* entry {find_section(type)};
+            if (!entry) {
+                return {nullptr, 0};
+            }
+            if (entry->element_size != sizeof(T)) {
+                throw std::runtime_error("Scene file " + path + " has elements of the wrong size");
+            }
+            return {reinterpret_cast<T const*>(data + entry->offset), entry->count};
+        }
+
+    private:
+        SectionEntry const* find_section(Section type) const;
+        std::string check_indices() const;
+
+        std::string path;
+        unsigned char const* data {nullptr};
+        size_t size {};
+    };
+
+    Scene read_text(std::string const& path);
+    void write(std::string const& path, Scene const& scene);
+};
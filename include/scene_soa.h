@@ -0,0 +1,50 @@
+#pragma once
+#include "tracer_objects.h"
+#include <vector>
+
+/* Structure-of-arrays copy of the scene for vectorized intersection on the
+ * CPU. Primitives are stored in the order a BVH references them, so the
+ * spheres and quads of a leaf are each one contiguous range of slots. */
+struct SceneSoA {
+    // Instruction sets the kernels are compiled for
+    enum class ISA {
+        SCALAR,
+        SSE,
+        AVX2,
+    };
+
+    // Spheres
+    std::vector<GLfloat> center_x, center_y, center_z;
+    std::vector<GLfloat> radius;
+    std::vector<GLint> sphere_index;
+
+    // Quads, with what quad_hit derives from Q, u and v precomputed. The
+    // hit coordinates along u and v are dot products with edge_u and edge_v.
+    std::vector<GLfloat> q_x, q_y, q_z;
+    std::vector<GLfloat> normal_x, normal_y, normal_z;
+    std::vector<GLfloat> plane_d;
+    std::vector<GLfloat> edge_u_x, edge_u_y, edge_u_z;
+    std::vector<GLfloat> edge_v_x, edge_v_y, edge_v_z;
+    std::vector<GLint> quad_index;
+
+    // Sphere and quad slots used by the references before each reference,
+    // meshes take none
+    std::vector<GLuint> sphere_prefix;
+    std::vector<GLuint> quad_prefix;
+
+    void build(std::vector<Sphere> const& spheres, std::vector<Quad> const& quads,
+               std::vector<GLint> const& refs);
+
+    size_t sphere_slot(size_t ref) const;
+    size_t quad_slot(size_t ref) const;
+
+    void intersect_spheres(size_t begin, size_t end, vec3 const& origin, vec3 const& dir,
+                           GLfloat& dist, GLint& slot) const;
+    void intersect_quads(size_t begin, size_t end, vec3 const& origin, vec3 const& dir,
+                         GLfloat& dist, GLint& slot) const;
+
+    static ISA best_isa();
+    static void use_isa(ISA isa);
+    static ISA current_isa();
+    static char const* isa_name(ISA isa);
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+using std::size_t;
+
+/* Queue between one producing and one consuming thread that never locks or
+ * waits. It is a ring of SIZE slots holding up to SIZE - 1 items, where only
+ * the producer moves the tail and only the consumer the head, each
+ * publishing the slots it is done with to the other. */
+template <typename T, size_t SIZE>
+class SPSCQueue {
+public:
+    /* Returns: false if the queue is full, leaving the item with the caller */
+    bool push(T const& item) {
+        size_t const tail {this->tail.load(std::memory_order_relaxed)};
+        size_t const next {(tail + 1) % SIZE};
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        items[tail] = item;
+        this->tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /* Returns: false if the queue is empty */
+    bool pop(T& item) {
+        size_t const head {this->head.load(std::memory_order_relaxed)};
+        if (head == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(items[head]);
+        this->head.store((head + 1) % SIZE, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, SIZE> items {};
+    // Apart so the two threads do not write the same cache line
+    alignas(64) std::atomic<size_t> head {0};
+    alignas(64) std::atomic<size_t> tail {0};
+};
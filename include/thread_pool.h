@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::size_t;
+
+/* Pool of worker threads with a task queue each. A worker takes tasks from
+ * the back of its own queue and steals from the front of the others once it
+ * runs dry, so uneven tasks still keep every core busy. */
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    size_t size() const;
+    void run(size_t task_count, std::function<void(size_t)> const& task);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    void work(size_t id);
+    bool pop(size_t id, size_t& task);
+
+    std::vector<std::thread> threads {};
+    std::vector<std::unique_ptr<Queue>> queues {};
+    std::function<void(size_t)> const* current {nullptr};
+    std::atomic<size_t> remaining {};
+
+    std::mutex mutex {};
+    std::condition_variable start {};
+    std::condition_variable done {};
+    size_t generation {};
+    bool stopping {false};
+};
@@ -1,12 +1,58 @@
+#pragma once
 #include "math_utils.h"
+#include <cstddef>
+#include <vector>
 
+// Part of a ray where hits count, the same as in frag_trace.glsl
+static GLfloat const RAY_MIN_DIST {0.001};
+static GLfloat const RAY_MAX_DIST {100.0};
+
+/* How much work goes into each pixel of a traced frame */
+struct SampleBudget {
+    // Paths traced per pixel and frame
+    GLint samples {10};
+    // Bounces before a path is cut off
+    GLint max_bounce {100};
+    // Bounces before Russian roulette may end a path early, disabled when
+    // not below max_bounce
+    GLint roulette_depth {3};
+    // Relative standard error of the mean luminance below which a tile
+    // stops receiving samples, 0 samples every pixel on every frame
+    GLfloat error_threshold {0.0};
+
+    // Adaptive sampling works on square tiles of pixels, judged every few
+    // frames once all their pixels have enough samples. The samples taken
+    // from converged tiles go to the rest, up to a limit.
+    GLint static constexpr ADAPTIVE_TILE {16};
+    GLint static constexpr ADAPTIVE_INTERVAL {4};
+    GLint static constexpr ADAPTIVE_MIN_SAMPLES {64};
+    GLint static constexpr ADAPTIVE_MAX_BOOST {4};
+    // Keeps the relative error of near black pixels from never converging,
+    // passed to frag_mask.glsl so both backends judge tiles alike
+    GLfloat static constexpr ERROR_FLOOR {0.01};
+};
+
+/* Axis aligned bounding box */
+struct AABB {
+    vec3 min;
+    vec3 max;
+
+    AABB();
+    AABB(vec3 const& min, vec3 const& max) : min{min}, max{max} {};
+
+    void grow(vec3 const& p);
+    void grow(AABB const& other);
+    vec3 centroid() const;
+    GLfloat area() const;
+};
 
 struct Material {
     GLuint static const LAMBERTIAN {0};
     GLuint static const METAL {1};
     GLuint static const DIELECTRIC {2};
+    GLuint static const EMISSIVE {3};
 
-    vec3 albedo;
+    vec3 albedo; // The emitted radiance of emissive materials
     GLint material;
     GLfloat fuzz;
     GLfloat ri;
@@ -17,6 +63,7 @@ struct Material {
     Material& lambertian(vec3 const& albedo);
     Material& metal(vec3 const& albedo, GLfloat fuzz);
     Material& dielectric(vec3 const& albedo, GLfloat ri);
+    Material& emissive(vec3 const& radiance);
 };
 
 struct Sphere {
@@ -26,6 +73,8 @@ struct Sphere {
     
     Sphere() = default;
     Sphere(vec3 const& center, GLfloat radius, Material const& material);
+    AABB bounds() const;
+    GLfloat area() const;
 };
 
 struct Quad {
@@ -39,4 +88,32 @@ struct Quad {
 
     Quad() = default;
     Quad(vec3 const& Q, vec3 const& u, vec3 const& v, Material const& material);
+    AABB bounds() const;
+    GLfloat area() const;
+};
+
+/* An emissive sphere or quad that paths sample directly, one texel in the
+ * shader. Lights are picked in proportion to their power, the luminance of
+ * their radiance times their area, and cdf is the share of the total power
+ * held by the lights up to and including this one. */
+struct Light {
+    // The same as the primitive types of BVH references
+    GLint static const SPHERE {0};
+    GLint static const QUAD {1};
+
+    GLint type;
+    GLint index;
+    GLfloat cdf;
+    GLfloat pad;
+
+    static GLfloat power(Material const& material, GLfloat area);
+};
+
+/* The lights of a scene, built from its emissive spheres and quads */
+struct LightList {
+    std::vector<Light> lights {};
+    GLfloat total_power {0.0};
+
+    void build(Sphere const* spheres, size_t sphere_count, Quad const* quads,
+               size_t quad_count);
 };
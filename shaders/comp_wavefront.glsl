@@ -0,0 +1,323 @@
+// Stages of the wavefront path tracer, compiled after frag_trace.glsl with
+// WAVEFRONT defined so the scene, sampling and material functions are the
+// same. Instead of one invocation following a path through every bounce,
+// each dispatch runs one stage over a queue of paths, so neighbouring
+// invocations run the same code and finished paths leave no idle lanes:
+//
+//   GENERATE    Start a sample of every pixel of a wave, queueing its ray
+//   INTERSECT   Trace the queued rays, ending the paths that escape or hit
+//               an emitter and queueing the rest by the material they hit
+//   SHADE       Scatter the paths queued for one material, queueing the
+//               rays of their next bounce
+//   PREPARE     Turn the counts of queues into their sizes and the group
+//               counts of the indirect dispatches reading them
+//   ACCUMULATE  Add the samples of a wave to the accumulation images
+//
+// One of the STAGE_* defines picks the stage. A wave is as many pixels as
+// the path buffers hold, with one path slot per pixel.
+
+const uint GROUP_SIZE = 64u;
+
+#ifdef STAGE_PREPARE
+layout(local_size_x = 1) in;
+#else
+layout(local_size_x = 64) in;
+#endif
+
+// Queues, each as long as a wave. Rays alternate between the two ray
+// queues from bounce to bounce, the material queues follow them.
+const int RAY_QUEUE = 0;
+const int MATERIAL_QUEUE = 2; // Plus the material
+const int QUEUE_COUNT = 5;
+
+struct Path {
+    vec4 origin; // w: density the surface sampled the direction with
+    vec4 dir; // w: bounces taken
+    vec4 throughput;
+    vec4 radiance; // Light the current sample has reached the camera with
+    vec4 sum; // Sum of the finished samples, with their squared luminance in w
+    vec4 albedo_sum; // Sum of the feature albedos, and of the depths in w
+    vec4 normal_sum; // w: 1.0 once the current sample has its features
+    uvec4 sampler; // PCG state, sample index and dimension
+};
+
+// Where a queued path hit, for the stage shading its material
+struct PathHit {
+    vec4 p; // w: hit distance
+    vec4 normal; // w: 1.0 on the front face
+    vec4 albedo; // w: fuzz
+    vec4 ri;
+};
+
+layout(std430, binding = 0) buffer PathBuffer {
+    Path paths[];
+};
+
+layout(std430, binding = 1) buffer HitBuffer {
+    PathHit hits[];
+};
+
+layout(std430, binding = 2) buffer QueueBuffer {
+    uint queues[]; // Queue q starts at q * wave_size
+};
+
+layout(std430, binding = 3) buffer CounterBuffer {
+    uint dispatch_args[QUEUE_COUNT * 3]; // Groups of the dispatches reading each queue
+    uint queue_sizes[QUEUE_COUNT]; // Paths in each queue, as of the last PREPARE
+    uint queue_counts[QUEUE_COUNT]; // Paths pushed since
+};
+
+layout(binding = 0, rgba32f) uniform image2D accum_image;
+layout(binding = 1, r32f) uniform image2D moments_image;
+#ifdef FEATURE_BUFFERS
+layout(binding = 2, rgba32f) uniform image2D albedo_image;
+layout(binding = 3, rgba32f) uniform image2D normal_image;
+#endif
+
+uniform uint wave_start; // First pixel of the wave
+uniform uint wave_size; // Path slots, and the length of every queue
+uniform int sample_pass; // Which of the pixel's samples of the frame GENERATE starts
+uniform int ray_queue; // The ray queue INTERSECT reads, SHADE pushes to the other
+uniform int shade_material; // The material SHADE scatters
+uniform uint prepare_mask; // Bit per queue PREPARE takes the size of
+
+/*
+ * push - Append a path to a queue
+ *
+ * @queue: The queue
+ * @path: Slot of the path
+ */
+void push(int queue, uint path) {
+    uint slot = atomicAdd(queue_counts[queue], 1u);
+    queues[uint(queue) * wave_size + slot] = path;
+}
+
+/*
+ * path_pixel - Get the pixel a path slot traces
+ *
+ * @path: Slot of the path
+ *
+ * Returns: The position of the pixel in the image
+ */
+ivec2 path_pixel(uint path) {
+    uint pixel = wave_start + path;
+    return ivec2(pixel % uint(resolution.x), pixel / uint(resolution.x));
+}
+
+/*
+ * load_sampler - Pick up the sample sequence of a path where it stopped
+ *
+ * @path: Slot of the path
+ */
+void load_sampler(uint path) {
+    pixel_seed = pcg_hash(wave_start + path);
+    rng_state = paths[path].sampler.x;
+    sample_index = paths[path].sampler.y;
+    sample_dimension = paths[path].sampler.z;
+}
+
+/*
+ * store_sampler - Keep the sample sequence of a path for its next stage
+ *
+ * @path: Slot of the path
+ */
+void store_sampler(uint path) {
+    paths[path].sampler = uvec4(rng_state, sample_index, sample_dimension, 0u);
+}
+
+/*
+ * finish_path - Add the light of a finished sample to its pixel
+ *
+ * @path: Slot of the path
+ * @color: The sample's color
+ */
+void finish_path(uint path, vec3 color) {
+    paths[path].sum += vec4(color, luminance(color) * luminance(color));
+}
+
+/*
+ * load_features - Pick up whether a path has its features for the current
+ *                 sample
+ *
+ * @path: Slot of the path
+ */
+void load_features(uint path) {
+    start_features();
+    features_found = paths[path].normal_sum.w > 0.5;
+}
+
+/*
+ * store_features - Add the features a path took in this stage to its sums
+ *
+ * @path: Slot of the path
+ * @bounce: Bounces the path took before the stage
+ */
+void store_features(uint path, int bounce) {
+    vec4 albedo_sum = paths[path].albedo_sum;
+    vec4 normal_sum = paths[path].normal_sum;
+    if (bounce == 0) {
+        albedo_sum.w += feature_depth;
+    }
+    if (features_found && normal_sum.w < 0.5) {
+        albedo_sum.rgb += feature_albedo;
+        normal_sum = vec4(normal_sum.xyz + feature_normal, 1.0);
+    }
+    paths[path].albedo_sum = albedo_sum;
+    paths[path].normal_sum = normal_sum;
+}
+
+#ifdef STAGE_GENERATE
+void main() {
+    uint path = gl_GlobalInvocationID.x;
+    ivec2 pixel = path_pixel(path);
+    if (path >= wave_size || pixel.y >= int(resolution.y) || pixel_converged(pixel)) {
+        return;
+    }
+
+    // Seeded by pixel and frame, the same as the fragment shader
+    pixel_seed = pcg_hash(wave_start + path);
+    if (sample_pass == 0) {
+        rng_state = pcg_hash(pixel_seed ^ uint(frame));
+        paths[path].sum = vec4(0.0);
+        paths[path].albedo_sum = vec4(0.0);
+        paths[path].normal_sum = vec4(0.0);
+    } else {
+        rng_state = paths[path].sampler.x;
+    }
+    start_sample(first_sample + uint(sample_pass));
+
+    Ray ray = ray_create((vec2(pixel) + 0.5) / resolution * 2.0 - 1.0);
+    paths[path].origin = vec4(ray.origin, 0.0);
+    paths[path].dir = vec4(ray.dir, 0.0);
+    paths[path].throughput = vec4(1.0);
+    paths[path].radiance = vec4(0.0);
+    paths[path].normal_sum.w = 0.0;
+    store_sampler(path);
+    push(ray_queue, path);
+}
+#endif
+
+#ifdef STAGE_INTERSECT
+void main() {
+    if (gl_GlobalInvocationID.x >= queue_sizes[ray_queue]) {
+        return;
+    }
+    uint path = queues[uint(ray_queue) * wave_size + gl_GlobalInvocationID.x];
+
+#ifdef HAS_PLANE
+    init_plane();
+#endif
+    Ray ray = Ray(paths[path].origin.xyz, paths[path].dir.xyz);
+    vec3 throughput = paths[path].throughput.xyz;
+    int hit_ref;
+    HitInfo hit_info = get_hit(ray, hit_ref);
+
+#ifdef FEATURE_BUFFERS
+    load_features(path);
+    if (hit_info.t >= MAX_DIST) {
+        record_features(throughput * sky_color(ray), vec3(0.0));
+    } else {
+        record_hit_features(hit_info, throughput, int(paths[path].dir.w));
+    }
+    store_features(path, int(paths[path].dir.w));
+#endif
+
+    if (hit_info.t >= MAX_DIST) {
+        finish_path(path, paths[path].radiance.xyz + throughput * sky_color(ray));
+        return;
+    }
+#ifdef HAS_EMISSIVE
+    if (hit_info.material.material == EMISSIVE) {
+        finish_path(path, paths[path].radiance.xyz +
+                    throughput * emitted(hit_info, hit_ref, ray, paths[path].origin.w));
+        return;
+    }
+#endif
+
+    Material material = hit_info.material;
+    hits[path] = PathHit(vec4(hit_info.p, hit_info.t),
+                         vec4(hit_info.normal, hit_info.front_face ? 1.0 : 0.0),
+                         vec4(material.albedo, material.fuzz), vec4(material.ri));
+    push(MATERIAL_QUEUE + material.material, path);
+}
+#endif
+
+#ifdef STAGE_SHADE
+void main() {
+    int queue = MATERIAL_QUEUE + shade_material;
+    if (gl_GlobalInvocationID.x >= queue_sizes[queue]) {
+        return;
+    }
+    uint path = queues[uint(queue) * wave_size + gl_GlobalInvocationID.x];
+
+#ifdef HAS_PLANE
+    init_plane();
+#endif
+    PathHit hit = hits[path];
+    HitInfo hit_info = HitInfo(hit.p.xyz, hit.normal.xyz, hit.p.w, hit.normal.w > 0.5,
+                               Material(hit.albedo.rgb, shade_material, hit.albedo.w, hit.ri.x));
+    Ray ray = Ray(paths[path].origin.xyz, paths[path].dir.xyz);
+    vec3 throughput = paths[path].throughput.xyz;
+    vec3 radiance = paths[path].radiance.xyz;
+    int bounce = int(paths[path].dir.w);
+    float bsdf_pdf;
+
+    load_sampler(path);
+    bool alive = scatter_path(hit_info, ray, throughput, radiance, bsdf_pdf, bounce);
+
+    // Paths cut off by the bounce limit keep their throughput, as in the
+    // fragment shader
+    if (!alive) {
+        finish_path(path, radiance);
+    } else if (bounce + 1 >= max_bounce) {
+#ifdef FEATURE_BUFFERS
+        load_features(path);
+        record_features(throughput, vec3(0.0));
+        store_features(path, bounce + 1);
+#endif
+        finish_path(path, radiance + throughput);
+    } else {
+        paths[path].origin = vec4(ray.origin, bsdf_pdf);
+        paths[path].dir = vec4(ray.dir, float(bounce + 1));
+        paths[path].throughput = vec4(throughput, 0.0);
+        paths[path].radiance = vec4(radiance, 0.0);
+        store_sampler(path);
+        push(RAY_QUEUE + 1 - ray_queue, path);
+    }
+}
+#endif
+
+#ifdef STAGE_PREPARE
+void main() {
+    for (int queue = 0; queue < QUEUE_COUNT; queue++) {
+        if ((prepare_mask & (1u << uint(queue))) != 0u) {
+            queue_sizes[queue] = queue_counts[queue];
+            queue_counts[queue] = 0u;
+            dispatch_args[3 * queue] = (queue_sizes[queue] + GROUP_SIZE - 1u) / GROUP_SIZE;
+            dispatch_args[3 * queue + 1] = 1u;
+            dispatch_args[3 * queue + 2] = 1u;
+        }
+    }
+}
+#endif
+
+#ifdef STAGE_ACCUMULATE
+void main() {
+    uint path = gl_GlobalInvocationID.x;
+    ivec2 pixel = path_pixel(path);
+    if (path >= wave_size || pixel.y >= int(resolution.y) || pixel_converged(pixel)) {
+        return;
+    }
+
+    // Every pixel belongs to one invocation, so adding needs no atomics
+    vec4 sum = paths[path].sum;
+    imageStore(accum_image, pixel,
+               imageLoad(accum_image, pixel) + vec4(sum.rgb, samples_per_pixel));
+    imageStore(moments_image, pixel, imageLoad(moments_image, pixel) + vec4(sum.w));
+#ifdef FEATURE_BUFFERS
+    imageStore(albedo_image, pixel, imageLoad(albedo_image, pixel) + paths[path].albedo_sum);
+    imageStore(normal_image, pixel, imageLoad(normal_image, pixel) +
+                                    vec4(paths[path].normal_sum.xyz, samples_per_pixel));
+#endif
+}
+#endif
@@ -0,0 +1,187 @@
+#version 330 core
+
+out vec4 out_color;
+
+uniform sampler2D accum_tex; // Accumulated radiance, with the sample count in alpha
+uniform sampler2D moments_tex; // Accumulated squared luminance
+uniform sampler2D albedo_tex; // Accumulated feature albedo, with depth in alpha
+uniform sampler2D normal_tex; // Accumulated feature normals, with their count in alpha
+uniform sampler2D filtered_tex; // Previous pass, color with its variance in alpha
+uniform bool first_pass; // Start from the accumulation buffer
+uniform bool final_pass; // Write the color alone, counting as one sample
+uniform int step_size; // Texels between taps, doubled every pass
+uniform int pass; // Passes run before this one
+uniform int max_passes; // Passes a pixel with a single sample gets
+uniform ivec2 size; // Traced part of the textures
+
+// How far apart the features of two pixels may be before they stop mixing.
+// Luminance is in standard deviations of the mean, depth in pixel widths.
+const float SIGMA_LUMINANCE = 4.0;
+const float SIGMA_NORMAL = 64.0; // Exponent of the cosine between normals
+const float SIGMA_DEPTH = 2.0;
+const float SIGMA_ALBEDO = 0.1;
+
+// Samples a pixel needs before the spread of its own samples is trusted
+// over that of its neighbours
+const float MIN_SAMPLES = 4.0;
+
+// B3 spline, the taps of one side of the 5x5 kernel
+const float KERNEL[3] = float[](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+struct Pixel {
+    vec3 color;
+    float variance; // Of the mean luminance
+    vec3 albedo;
+    vec3 normal;
+    float depth;
+};
+
+/*
+ * luminance - Get the perceived brightness of a linear color
+ *
+ * Returns: float luminance
+ */
+float luminance(const vec3 color) {
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+/*
+ * mean_color - Get the mean of the samples accumulated in a pixel
+ *
+ * Returns: vec3 color
+ */
+vec3 mean_color(ivec2 pixel) {
+    vec4 accum = texelFetch(accum_tex, pixel, 0);
+    return accum.rgb / max(accum.a, 1.0);
+}
+
+/*
+ * mean_variance - Estimate the variance of the mean luminance of a pixel
+ *
+ * Pixels with enough samples have it from their moments. The first few
+ * samples say little about their spread, so until then it comes from the
+ * spread of the means around the pixel.
+ *
+ * Returns: float variance
+ */
+float mean_variance(ivec2 pixel) {
+    vec4 accum = texelFetch(accum_tex, pixel, 0);
+    float n = max(accum.a, 1.0);
+
+    if (n >= MIN_SAMPLES) {
+        float mean = luminance(accum.rgb) / n;
+        float mean_sq = texelFetch(moments_tex, pixel, 0).r / n;
+        return max(mean_sq - mean * mean, 0.0) / n;
+    }
+
+    float sum = 0.0;
+    float sum_sq = 0.0;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            float l = luminance(mean_color(clamp(pixel + ivec2(x, y), ivec2(0), size - 1)));
+            sum += l;
+            sum_sq += l * l;
+        }
+    }
+    return max(sum_sq / 9.0 - (sum / 9.0) * (sum / 9.0), 0.0);
+}
+
+/*
+ * fetch_pixel - Gather what the filter knows of a pixel
+ *
+ * Returns: struct Pixel
+ */
+Pixel fetch_pixel(ivec2 pixel) {
+    vec4 normal_sum = texelFetch(normal_tex, pixel, 0);
+    float n = max(normal_sum.a, 1.0);
+    vec4 albedo = texelFetch(albedo_tex, pixel, 0) / n;
+    vec3 normal = normal_sum.xyz / n;
+
+    if (first_pass) {
+        return Pixel(mean_color(pixel), mean_variance(pixel), albedo.rgb, normal, albedo.a);
+    }
+    vec4 filtered = texelFetch(filtered_tex, pixel, 0);
+    return Pixel(filtered.rgb, filtered.a, albedo.rgb, normal, albedo.a);
+}
+
+/*
+ * pixel_passes - Get the passes a pixel needs, one fewer for every fourfold
+ *                increase of its samples. Reprojected pixels carry more
+ *                samples than the ones traced since the view changed.
+ *
+ * Returns: int passes
+ */
+int pixel_passes(ivec2 pixel) {
+    int passes = max_passes;
+    for (float n = texelFetch(accum_tex, pixel, 0).a; n >= 4.0 && passes > 0; n /= 4.0) {
+        passes--;
+    }
+    return passes;
+}
+
+/*
+ * normal_weight - Weigh two pixels by how closely their normals agree
+ *
+ * Pixels of the sky have no normal and only mix with each other.
+ *
+ * Returns: float weight in [0.0, 1.0]
+ */
+float normal_weight(vec3 a, vec3 b) {
+    float length_a = length(a);
+    float length_b = length(b);
+    if (length_a < 1e-3 || length_b < 1e-3) {
+        return length_a < 1e-3 && length_b < 1e-3 ? 1.0 : 0.0;
+    }
+    return pow(max(dot(a / length_a, b / length_b), 0.0), SIGMA_NORMAL);
+}
+
+/* One pass of the edge avoiding a-trous wavelet filter. Each pass blurs
+ * with a 5x5 kernel whose taps spread further apart, and weighs every tap
+ * by how alike its color, normal, depth and albedo are to the pixel's, so
+ * the blur stops at edges. The variance is filtered along with the color,
+ * letting later passes mix less where the image is already smooth. */
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    Pixel center = fetch_pixel(pixel);
+    if (pass >= pixel_passes(pixel)) {
+        out_color = final_pass ? vec4(center.color, 1.0) : vec4(center.color, center.variance);
+        return;
+    }
+    float center_luminance = luminance(center.color);
+    float luminance_spread = SIGMA_LUMINANCE * sqrt(center.variance) + 1e-4;
+    // A pixel covers about this much depth per pixel width at its distance
+    float depth_spread = SIGMA_DEPTH * 2.0 * center.depth / float(size.y);
+
+    vec3 color = vec3(0.0);
+    float variance = 0.0;
+    float weight_sum = 0.0;
+    for (int y = -2; y <= 2; y++) {
+        for (int x = -2; x <= 2; x++) {
+            ivec2 offset = ivec2(x, y) * step_size;
+            ivec2 tap = pixel + offset;
+            if (any(lessThan(tap, ivec2(0))) || any(greaterThanEqual(tap, size))) {
+                continue;
+            }
+
+            Pixel other = fetch_pixel(tap);
+            float weight = KERNEL[abs(x)] * KERNEL[abs(y)];
+            if (offset != ivec2(0)) {
+                vec3 albedo_difference = other.albedo - center.albedo;
+                weight *= exp(
+                    -abs(luminance(other.color) - center_luminance) / luminance_spread
+                    - abs(other.depth - center.depth) / (depth_spread * length(vec2(offset)) + 1e-4)
+                    - dot(albedo_difference, albedo_difference) / (SIGMA_ALBEDO * SIGMA_ALBEDO));
+                weight *= normal_weight(center.normal, other.normal);
+            }
+
+            color += weight * other.color;
+            variance += weight * weight * other.variance;
+            weight_sum += weight;
+        }
+    }
+
+    // The center always has a weight, so the sum is never zero
+    color /= weight_sum;
+    variance /= weight_sum * weight_sum;
+    out_color = final_pass ? vec4(color, 1.0) : vec4(color, variance);
+}
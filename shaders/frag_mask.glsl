@@ -0,0 +1,58 @@
+#version 330 core
+
+out vec4 out_color;
+
+uniform sampler2D accum_tex; // Accumulated radiance, with the sample count in alpha
+uniform sampler2D moments_tex; // Accumulated squared luminance
+uniform int tile_size;
+uniform float threshold; // Relative error where a pixel counts as converged
+uniform float min_samples; // Samples a pixel needs before it can converge
+uniform float error_floor; // Keeps the error of near black pixels from never converging
+
+/*
+ * luminance - Get the perceived brightness of a linear color
+ *
+ * Returns: float luminance
+ */
+float luminance(const vec3 color) {
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+/*
+ * pixel_error - Estimate how far the accumulated mean of a pixel is from
+ *               converging
+ *
+ * The variance of the samples comes from their first and second moments,
+ * the standard error of the mean follows from it and the sample count.
+ *
+ * Returns: float standard error relative to the mean luminance
+ */
+float pixel_error(const ivec2 pixel) {
+    vec4 accum = texelFetch(accum_tex, pixel, 0);
+    float n = accum.a;
+    if (n < min_samples) {
+        return 1.0 / 0.0;
+    }
+
+    float mean = luminance(accum.rgb) / n;
+    float mean_sq = texelFetch(moments_tex, pixel, 0).r / n;
+    float variance = max(mean_sq - mean * mean, 0.0);
+    return sqrt(variance / n) / (mean + error_floor);
+}
+
+/* One fragment per tile, writing 1.0 while any of its pixels needs more
+ * samples and 0.0 once all of them have converged */
+void main() {
+    ivec2 first = ivec2(gl_FragCoord.xy) * tile_size;
+    ivec2 last = min(first + tile_size, textureSize(accum_tex, 0));
+
+    for (int y = first.y; y < last.y; y++) {
+        for (int x = first.x; x < last.x; x++) {
+            if (!(pixel_error(ivec2(x, y)) <= threshold)) {
+                out_color = vec4(1.0);
+                return;
+            }
+        }
+    }
+    out_color = vec4(0.0);
+}
@@ -0,0 +1,130 @@
+#version 330 core
+
+layout(location = 0) out vec4 out_color;
+layout(location = 1) out vec4 out_moments;
+
+// The first frame of the new view
+uniform sampler2D albedo_tex; // Accumulated feature albedo, with depth in alpha
+uniform sampler2D normal_tex; // Accumulated feature normals, with their count in alpha
+uniform vec2 resolution;
+uniform int FOV;
+uniform mat4 view_matrix;
+
+// What was accumulated in the previous view
+uniform sampler2D history_tex; // Radiance, with the sample count in alpha
+uniform sampler2D history_moments_tex;
+uniform sampler2D history_albedo_tex;
+uniform sampler2D history_normal_tex;
+uniform vec2 history_resolution;
+uniform int history_fov;
+uniform mat4 history_view_inverse; // From the scene into the previous camera
+
+uniform float max_history; // Samples of history a pixel carries at most
+
+// How far the history may be from the surface seen now and still count as
+// the same, depth relative to the distance
+const float DEPTH_TOLERANCE = 0.05;
+const float NORMAL_TOLERANCE = 0.9; // Cosine between the normals
+const float ALBEDO_TOLERANCE = 0.1;
+
+struct Features {
+    vec3 albedo;
+    vec3 normal;
+    float depth;
+    bool valid; // Whether the pixel was traced at all
+};
+
+/*
+ * fetch_features - Get the mean features of a pixel
+ *
+ * @albedo_sampler: Albedo and depth sums
+ * @normal_sampler: Normal sums and their count
+ *
+ * Returns: struct Features
+ */
+Features fetch_features(sampler2D albedo_sampler, sampler2D normal_sampler, ivec2 pixel) {
+    vec4 normal = texelFetch(normal_sampler, pixel, 0);
+    vec4 albedo = texelFetch(albedo_sampler, pixel, 0) / max(normal.a, 1.0);
+    return Features(albedo.rgb, normal.xyz / max(normal.a, 1.0), albedo.a, normal.a > 0.0);
+}
+
+/*
+ * camera_dir - Get the direction through the center of a pixel in the
+ *              space of the camera, the way the trace shader aims its rays
+ *
+ * @ndc: Center of the pixel in normalized device coordinates
+ *
+ * Returns: vec3 direction, not normalized
+ */
+vec3 camera_dir(vec2 ndc, vec2 res, int fov) {
+    return vec3(ndc.x * res.x / res.y, ndc.y, -1.0 / tan(radians(float(fov)) * 0.5));
+}
+
+/*
+ * features_agree - Check whether history shows the surface seen now
+ *
+ * Where the normal and albedo disagree the history shows something else,
+ * which a change of depth alone misses at creases.
+ *
+ * Returns: true if the history can be kept
+ */
+bool features_agree(Features now, Features history, float distance) {
+    if (abs(history.depth - distance) > DEPTH_TOLERANCE * distance) {
+        return false;
+    }
+    vec3 albedo_difference = history.albedo - now.albedo;
+    if (dot(albedo_difference, albedo_difference) > ALBEDO_TOLERANCE * ALBEDO_TOLERANCE) {
+        return false;
+    }
+
+    // Pixels of the sky have no normal
+    float length_now = length(now.normal);
+    float length_history = length(history.normal);
+    if (length_now < 1e-3 || length_history < 1e-3) {
+        return length_now < 1e-3 && length_history < 1e-3;
+    }
+    return dot(now.normal / length_now, history.normal / length_history) >= NORMAL_TOLERANCE;
+}
+
+/* Carry the samples of the previous view into the new one. Each pixel
+ * finds the point it sees by its first hit depth, looks it up in the
+ * previous view and adds what was accumulated there, if it shows the same
+ * surface. The history is capped at max_history samples, so the new view
+ * soon outweighs what drifted in with the reprojection. */
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    Features now = fetch_features(albedo_tex, normal_tex, pixel);
+    if (!now.valid) {
+        discard;
+    }
+
+    vec2 ndc = (vec2(pixel) + 0.5) / resolution * 2.0 - 1.0;
+    vec3 origin = vec3(vec4(0.0, 0.0, 0.0, 1.0) * view_matrix);
+    vec3 target = vec3(vec4(camera_dir(ndc, resolution, FOV), 1.0) * view_matrix);
+    vec3 point = origin + normalize(target - origin) * now.depth;
+
+    // Into the previous camera, which looks down -z
+    vec3 seen = vec3(vec4(point, 1.0) * history_view_inverse);
+    if (seen.z >= 0.0) {
+        discard;
+    }
+    float dist = 1.0 / tan(radians(float(history_fov)) * 0.5);
+    vec2 history_ndc = vec2(seen.x / (history_resolution.x / history_resolution.y),
+                            seen.y) * dist / -seen.z;
+    vec2 position = (history_ndc + 1.0) * 0.5 * history_resolution;
+    if (any(lessThan(position, vec2(0.0))) || any(greaterThanEqual(position, history_resolution))) {
+        discard;
+    }
+
+    ivec2 history_pixel = ivec2(position);
+    Features history = fetch_features(history_albedo_tex, history_normal_tex, history_pixel);
+    if (!history.valid || !features_agree(now, history, length(seen))) {
+        discard;
+    }
+
+    // Added onto the new frame by blending
+    vec4 accum = texelFetch(history_tex, history_pixel, 0);
+    float weight = min(1.0, max_history / max(accum.a, 1.0));
+    out_color = accum * weight;
+    out_moments = texelFetch(history_moments_tex, history_pixel, 0) * weight;
+}
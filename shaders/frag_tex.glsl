@@ -5,8 +5,37 @@ in vec2 tex_coord;
 
 out vec4 out_color;
 
-uniform sampler2D tex;
+uniform sampler2D tex; // Accumulated radiance, with the sample count in alpha
+uniform vec2 scale; // Part of the texture holding the traced image
+
+// Where the tonemapping curve starts to roll off
+const float SHOULDER = 0.8;
+
+/*
+ * tonemap - Compress linear radiance into the displayable range
+ *
+ * Leaves everything below the shoulder untouched and rolls the rest off
+ * smoothly towards 1.0 instead of clipping it.
+ *
+ * Returns: vec3 color within [0.0, 1.0)
+ */
+vec3 tonemap(const vec3 color) {
+    vec3 over = max(color - SHOULDER, 0.0);
+    vec3 rolled = SHOULDER + (1.0 - SHOULDER) * (1.0 - exp(-over / (1.0 - SHOULDER)));
+    return mix(color, rolled, step(SHOULDER, color));
+}
+
+/*
+ * to_gamma - Translate color into gamma space
+ *
+ * Returns: vec3 color
+ */
+vec3 to_gamma(const vec3 color) {
+    return sqrt(color);
+}
 
 void main() {
-    out_color = texture(tex, tex_coord);
+    vec4 accum = texture(tex, tex_coord * scale);
+    vec3 color = accum.rgb / max(accum.a, 1.0);
+    out_color = vec4(to_gamma(tonemap(color)), 1.0);
 }
@@ -1,25 +1,62 @@
 #version 330 core
 
+// What the scene contains, defined for each variant by the program cache.
+// Without them the shader handles any scene.
+#ifndef SCENE_FEATURES
+#define HAS_PLANE
+#define HAS_SPHERES
+#define HAS_QUADS
+#define HAS_MESHES
+#define HAS_LAMBERTIAN
+#define HAS_METAL
+#define HAS_DIELECTRIC
+#define HAS_EMISSIVE
+#endif
+
+// The wavefront stages of comp_wavefront.glsl are compiled after this file
+// with WAVEFRONT defined, sharing everything but the fragment shader's
+// inputs, outputs and main
+#ifndef WAVEFRONT
 in vec2 frag_coord;
 in vec2 tex_coord;
 
-out vec4 out_color;
+layout(location = 0) out vec4 out_color;
+layout(location = 1) out vec4 out_moments; // Sum of squared sample luminance
+#ifdef FEATURE_BUFFERS
+layout(location = 2) out vec4 out_albedo; // Sum of feature albedos, and of depths in w
+layout(location = 3) out vec4 out_normal; // Sum of feature normals, and their count in w
+#endif
+#endif
 
 uniform vec2 resolution; // The screen resolution
-uniform float time; // Time elapsed since program start
-uniform int frame; // Current frame count, used to blend frames
-
-uniform sampler2D prev_frame_tex; // The previous frame as a texture
+uniform int frame; // Frames accumulated since the last reset
+uniform uint first_sample; // Samples each pixel has accumulated
 
 // Camera
 uniform int FOV;
 uniform mat4 view_matrix; // Transform the camera
 
+// Sample budget, where variants may bake in the depths
+uniform int samples_per_pixel;
+#ifdef MAX_BOUNCE
+const int max_bounce = MAX_BOUNCE;
+#else
+uniform int max_bounce;
+#endif
+#ifdef ROULETTE_DEPTH
+const int roulette_depth = ROULETTE_DEPTH;
+#else
+uniform int roulette_depth; // Bounces before paths may be terminated early
+#endif
+
+// Adaptive sampling
+uniform bool adaptive; // Skip the tiles marked as converged in sample_mask
+uniform sampler2D sample_mask; // One texel per tile, 0.0 once converged
+uniform int mask_tile_size;
+
 // Ray
 const float MIN_DIST = 0.001;
 const float MAX_DIST = 100;
-const int SAMPLES_PER_PIXEL = 10;
-const int MAX_BOUNCE = 100;
 
 // Constants
 const float PI = 3.141592;
@@ -29,76 +66,187 @@ const float FAR = 999999999;
 const int LAMBERTIAN = 0;
 const int METAL = 1;
 const int DIELECTRIC = 2;
+const int EMISSIVE = 3; // Albedo holds the radiance, emitted on the front side
 
 /* ================================================================ *
                         UTILITY FUNCTIONS
  * ================================================================ */ 
 
-vec3 rand_seed = vec3(frag_coord.xy, time);
+// Random number state of the pixel, and where its current path is in the
+// sample sequence
+uint rng_state;
+uint pixel_seed;
+uint sample_index;
+uint sample_dimension;
+
+/*
+ * luminance - Get the perceived brightness of a linear color
+ *
+ * Returns: float luminance
+ */
+float luminance(const vec3 color) {
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+/*
+ * pcg_hash - Hash an integer with one round of PCG, after Jarzynski and
+ *            Olano, "Hash Functions for GPU Rendering"
+ *
+ * Returns: uint hash
+ */
+uint pcg_hash(uint v) {
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
 
 /*
- * random - Generate a random float
+ * random - Generate a random float, stepping the PCG state of the pixel
  *
  * Returns: A floating point value within [0.0, 1.0)
  */
 float random() {
-    rand_seed = vec3(rand_seed.xy, rand_seed.z + 3.837);
-    vec3 scale = vec3(12.9898, 78.233, 45.164);
-    float dot_product = dot(rand_seed, scale);
-    return fract(sin(dot_product) * 43758.5453);
+    rng_state = rng_state * 747796405u + 2891336453u;
+    uint word = ((rng_state >> ((rng_state >> 28u) + 4u)) ^ rng_state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return float(word >> 8u) * (1.0 / 16777216.0);
 }
 
+#ifdef SOBOL_SAMPLER
 /*
- * random - Generate a random float
+ * reverse_bits - Reverse the order of the bits of an integer
  *
- * Returns: A floating point value within [min, max)
+ * Returns: uint reversed
  */
-float random(const float min, const float max) {
-    return min + (max - min) * random();
+uint reverse_bits(uint x) {
+    x = ((x & 0xaaaaaaaau) >> 1u) | ((x & 0x55555555u) << 1u);
+    x = ((x & 0xccccccccu) >> 2u) | ((x & 0x33333333u) << 2u);
+    x = ((x & 0xf0f0f0f0u) >> 4u) | ((x & 0x0f0f0f0fu) << 4u);
+    x = ((x & 0xff00ff00u) >> 8u) | ((x & 0x00ff00ffu) << 8u);
+    return (x >> 16u) | (x << 16u);
 }
 
 /*
- * sample_square - Generate a random point in a square
+ * owen_scramble - Randomly permute the binary digits of a sample the way
+ *                 Owen scrambling does, with the hash of Burley,
+ *                 "Practical Hash-based Owen Scrambling"
+ *
+ * @x: The sample, as a fixed point fraction
+ * @seed: Picks the permutation
  *
- * Returns: A vec2 within [-0.5, 0.5)
+ * Returns: uint scrambled sample
  */
-vec2 sample_square() {
-    return vec2(random() - 0.5, random() - 0.5);
+uint owen_scramble(uint x, uint seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
 }
 
 /*
- * vec3_random - Generate a random unit vector
+ * sobol_2d - Get a point of the Owen scrambled two dimensional Sobol
+ *            sequence. The index is shuffled too, so every pair of
+ *            dimensions is its own independent sequence.
  *
- * Returns: A vec3 unit vector
+ * @index: Index of the point
+ * @seed: Picks the scrambling
+ *
+ * Returns: A vec2 within [0.0, 1.0)
  */
-vec3 vec3_random() {
-    vec3 rand = vec3(random(-1, 1), random(-1, 1), random(-1, 1));
-    while (length(rand) < 0.001) {
-        rand = vec3(random(-1, 1), random(-1, 1), random(-1, 1));
+vec2 sobol_2d(uint index, uint seed) {
+    index = owen_scramble(index, seed);
+
+    // The first dimension is the van der Corput sequence, the second comes
+    // from the direction numbers of the polynomial x + 1
+    uint x = reverse_bits(index);
+    uint y = 0u;
+    for (uint v = 1u << 31u; index != 0u; index >>= 1u, v ^= v >> 1u) {
+        y ^= v * (index & 1u);
     }
-    return normalize(rand);
+
+    x = owen_scramble(x, pcg_hash(seed));
+    y = owen_scramble(y, pcg_hash(seed + 1u));
+    return vec2(x >> 8u, y >> 8u) * (1.0 / 16777216.0);
 }
+#endif
 
 /*
- * random_on_hemisphere - Generate a random unit vector from a hemisphere
+ * start_sample - Start drawing the dimensions of a new sample of the pixel
  *
- * @normal: The hemisphere's normal vector
+ * @index: Index of the sample since the accumulation started
+ */
+void start_sample(uint index) {
+    sample_index = index;
+    sample_dimension = 0u;
+}
+
+/*
+ * sample_2d - Draw the next two dimensions of the current sample, from the
+ *             Sobol sequence of the pixel or from its random numbers
+ *
+ * Returns: A vec2 within [0.0, 1.0)
+ */
+vec2 sample_2d() {
+#ifdef SOBOL_SAMPLER
+    uint seed = pcg_hash(pixel_seed ^ pcg_hash(sample_dimension));
+    sample_dimension++;
+    return sobol_2d(sample_index, seed);
+#else
+    return vec2(random(), random());
+#endif
+}
+
+/*
+ * sample_sphere - Map a sample to a direction, uniformly over the sphere
+ *
+ * @u: The sample
  *
  * Returns: A vec3 unit vector
  */
-vec3 random_on_hemisphere(const vec3 normal) {
-    vec3 dir = vec3_random();
-    bool on_hemisphere = dot(dir, normal) > 0.0;
-    return on_hemisphere ? dir : -dir;
+vec3 sample_sphere(vec2 u) {
+    float z = 1.0 - 2.0 * u.x;
+    float r = sqrt(max(1.0 - z * z, 0.0));
+    float phi = 2.0 * PI * u.y;
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 /*
- * to_gamma - Translate color into gamma space
+ * local_to_world - Turn a direction given around the z axis into one around
+ *                  a normal, in the branch free basis of Duff et al.,
+ *                  "Building an Orthonormal Basis, Revisited"
  *
- * Returns: vec4 color
+ * @normal: The unit vector the z axis maps to
+ * @dir: The direction around the z axis
+ *
+ * Returns: vec3 direction
+ */
+vec3 local_to_world(vec3 normal, vec3 dir) {
+    float s = normal.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (s + normal.z);
+    float b = normal.x * normal.y * a;
+    vec3 tangent = vec3(1.0 + s * normal.x * normal.x * a, s * b, -s * normal.x);
+    vec3 bitangent = vec3(b, s + normal.y * normal.y * a, -normal.y);
+    return tangent * dir.x + bitangent * dir.y + normal * dir.z;
+}
+
+/*
+ * sample_cosine_hemisphere - Map a sample to a direction around a normal,
+ *                            with density following the cosine to it
+ *
+ * @normal: The hemisphere's normal vector
+ * @u: The sample
+ *
+ * Returns: A vec3 unit vector
  */
-vec4 to_gamma(const vec4 color) {
-    return vec4(sqrt(color.r), sqrt(color.g), sqrt(color.b), color.b);
+vec3 sample_cosine_hemisphere(vec3 normal, vec2 u) {
+    float r = sqrt(u.x);
+    float phi = 2.0 * PI * u.y;
+    return normalize(local_to_world(
+        normal, vec3(r * cos(phi), r * sin(phi), sqrt(max(1.0 - u.x, 0.0)))
+    ));
 }
 
 /* ================================================================ *
@@ -112,6 +260,18 @@ struct Material {
     float ri;
 };
 
+/*
+ * fetch_material - Unpack a material from two texels of a scene buffer
+ *
+ * @a: Texel holding the albedo and material type
+ * @b: Texel holding the fuzz and refraction index
+ *
+ * Returns: A struct Material
+ */
+Material fetch_material(ivec4 a, ivec4 b) {
+    return Material(intBitsToFloat(a.xyz), a.w, intBitsToFloat(b.x), intBitsToFloat(b.y));
+}
+
 struct HitInfo {
     vec3 p;
     vec3 normal;
@@ -129,19 +289,21 @@ struct Ray {
     vec3 dir;
 };
 
-/* ray_create - Create a random ray from the camera to the fragment
- *              position in the tracing plane
+/* ray_create - Create a random ray from the camera to a pixel in the
+ *              tracing plane
+ *
+ * @coord: Center of the pixel in normalized device coordinates
  *
  * Returns: 3D Ray
  */
-Ray ray_create() {
-    vec2 offset = sample_square();
+Ray ray_create(vec2 coord) {
+    vec2 offset = sample_2d() - 0.5;
     offset.x /= resolution.x;
     offset.y /= resolution.x;
     float aspect_ratio = resolution.x / resolution.y;
     float dist = 1.0 / tan(radians(FOV) * 0.5);
     vec3 ray_pos = vec3(vec4(0.0, 0.0, 0.0, 1.0) * view_matrix);
-    vec3 ray_target = vec3(frag_coord.x * aspect_ratio + offset.x, frag_coord.y + offset.y, -dist);
+    vec3 ray_target = vec3(coord.x * aspect_ratio + offset.x, coord.y + offset.y, -dist);
     ray_target = vec3(vec4(ray_target, 1.0) * view_matrix);
     vec3 ray_dir = normalize(ray_target - ray_pos);
 
@@ -173,12 +335,23 @@ struct Sphere {
     Material material;
 };
 
-// Buffer for spheres uploaded from CPU
-const int MAX_SPHERES = 256;
+// Buffer for spheres uploaded from CPU, three texels per sphere
 uniform int SPHERES_NUM;
-layout(std140) uniform sphere_buffer {
-    Sphere spheres[MAX_SPHERES];
-};
+uniform isamplerBuffer sphere_buffer;
+
+/*
+ * fetch_sphere - Read a sphere from the sphere buffer
+ *
+ * @i: Index of the sphere
+ *
+ * Returns: A struct Sphere
+ */
+Sphere fetch_sphere(int i) {
+    ivec4 a = texelFetch(sphere_buffer, 3 * i);
+    ivec4 b = texelFetch(sphere_buffer, 3 * i + 1);
+    ivec4 c = texelFetch(sphere_buffer, 3 * i + 2);
+    return Sphere(intBitsToFloat(a.xyz), intBitsToFloat(a.w), fetch_material(b, c));
+}
 
 /*
  * get_sphere - Create a struct Sphere
@@ -258,6 +431,13 @@ Plane get_plane(vec3 normal, vec3 point, Material material) {
     return Plane(normal, point, material);
 }
 
+/*
+ * init_plane - Set up the ground plane, the same in every scene that has it
+ */
+void init_plane() {
+    plane = get_plane(vec3(0.0, 1.0, 0.0), vec3(0.0, -0.000, 0.0), Material(vec3(0.86, 0.95, 0.99) * 0.8, 1, 0.05, 0));
+}
+
 /*
  * plane_hit - Get the hit related information from an intersecting sphere and ray
  *
@@ -306,12 +486,26 @@ struct Quad {
     Material material;
 };
 
-// Buffer for quads uploaded from CPU
-const int MAX_QUADS = 256;
+// Buffer for quads uploaded from CPU, five texels per quad
 uniform int QUADS_NUM;
-layout(std140) uniform quad_buffer {
-    Quad quads[MAX_QUADS];
-};
+uniform isamplerBuffer quad_buffer;
+
+/*
+ * fetch_quad - Read a quad from the quad buffer
+ *
+ * @i: Index of the quad
+ *
+ * Returns: A struct Quad
+ */
+Quad fetch_quad(int i) {
+    vec3 Q = intBitsToFloat(texelFetch(quad_buffer, 5 * i).xyz);
+    vec3 u = intBitsToFloat(texelFetch(quad_buffer, 5 * i + 1).xyz);
+    vec3 v = intBitsToFloat(texelFetch(quad_buffer, 5 * i + 2).xyz);
+    Material material = fetch_material(
+        texelFetch(quad_buffer, 5 * i + 3), texelFetch(quad_buffer, 5 * i + 4)
+    );
+    return Quad(Q, u, v, material);
+}
 
 float quad_hit(Quad quad, Ray ray) {
     vec3 n = cross(quad.u, quad.v);
@@ -345,11 +539,375 @@ float quad_hit(Quad quad, Ray ray) {
     return t;
 }
 
+/*
+ * quad_hit_data - Get the hit related information from an intersecting quad
+ *                 and ray. The front of a quad faces along u x v.
+ *
+ * @quad
+ * @ray
+ * @t: The intersection distance
+ *
+ * Returns: A struct HitInfo
+ */
 HitInfo quad_hit_data(Quad quad, Ray ray, float t) {
     vec3 p = ray_at(ray, t);
-    vec3 normal = normalize(cross(quad.u, quad.v));
-    return HitInfo(p, normal, t, true, quad.material);
+    vec3 outward_normal = normalize(cross(quad.u, quad.v));
+    bool front_face = dot(ray.dir, outward_normal) < 0;
+    vec3 normal = front_face ? outward_normal : -outward_normal;
+    return HitInfo(p, normal, t, front_face, quad.material);
+}
+
+/* ================================================================ *
+ *                        TRIANGLE FUNCTIONS                        *
+ * ================================================================ */
+
+// Watertight ray/triangle test of Woop, Benthin and Wald. The ray is
+// sheared onto the z axis once, then every triangle is tested in 2D with
+// the same arithmetic for an edge from either side, so rays never slip
+// through the seams of a mesh.
+struct RayShear {
+    int kx;
+    int ky;
+    int kz;
+    vec3 s; // Shear of the x and y axes, and scale of the z axis
+};
+
+/*
+ * ray_shear - Work out the shear of a ray for triangle tests
+ *
+ * @ray
+ *
+ * Returns: A struct RayShear
+ */
+RayShear ray_shear(Ray ray) {
+    // Shear along the largest component of the direction, swapping the
+    // other two axes when it is negative to keep the winding
+    vec3 d = abs(ray.dir);
+    int kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.dir[kz] < 0.0) {
+        int tmp = kx;
+        kx = ky;
+        ky = tmp;
+    }
+    return RayShear(kx, ky, kz,
+                    vec3(ray.dir[kx] / ray.dir[kz], ray.dir[ky] / ray.dir[kz], 1.0 / ray.dir[kz]));
+}
+
+/*
+ * triangle_hit - Calculate the intersection between a triangle and a ray
+ *
+ * @v0, @v1, @v2: The corners of the triangle
+ * @ray
+ * @shear: The shear of the ray
+ *
+ * Returns: Floating point distance from ray origin, -1.0 on a miss
+ */
+float triangle_hit(vec3 v0, vec3 v1, vec3 v2, Ray ray, RayShear shear) {
+    vec3 a = v0 - ray.origin;
+    vec3 b = v1 - ray.origin;
+    vec3 c = v2 - ray.origin;
+
+    float ax = a[shear.kx] - shear.s.x * a[shear.kz];
+    float ay = a[shear.ky] - shear.s.y * a[shear.kz];
+    float bx = b[shear.kx] - shear.s.x * b[shear.kz];
+    float by = b[shear.ky] - shear.s.y * b[shear.kz];
+    float cx = c[shear.kx] - shear.s.x * c[shear.kz];
+    float cy = c[shear.ky] - shear.s.y * c[shear.kz];
+
+    // Scaled barycentric coordinates, which agree in sign inside
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) {
+        return -1.0;
+    }
+
+    float det = u + v + w;
+    if (det == 0.0) {
+        return -1.0;
+    }
+    vec3 z = shear.s.z * vec3(a[shear.kz], b[shear.kz], c[shear.kz]);
+    return dot(vec3(u, v, w), z) / det;
+}
+
+/* ================================================================ *
+ *                          BVH FUNCTIONS                           *
+ * ================================================================ */
+
+struct BVHNode {
+    vec3 min;
+    int count; // Primitives in a leaf, 0 for interior nodes
+    vec3 max;
+    int offset; // First primitive reference of a leaf, right child otherwise
+};
+
+// Primitive types stored in the low bits of a reference
+const int REF_TYPE_BITS = 2;
+const int REF_TYPE_MASK = 3;
+const int SPHERE_REF = 0;
+const int QUAD_REF = 1;
+const int INSTANCE_REF = 2;
+
+// Flattened hierarchy uploaded from CPU, two texels per node. The left
+// child always follows its parent.
+uniform int BVH_NODES_NUM;
+uniform isamplerBuffer bvh_node_buffer;
+
+// Primitive references of the leaves, packed four to a texel
+uniform isamplerBuffer bvh_ref_buffer;
+
+const int BVH_STACK_SIZE = 32;
+
+/*
+ * bvh_ref - Get a primitive reference of a leaf
+ *
+ * @i: Index into the reference list
+ *
+ * Returns: The reference with the primitive type in the low bit
+ */
+int bvh_ref(int i) {
+    return texelFetch(bvh_ref_buffer, i >> 2)[i & 3];
+}
+
+/*
+ * fetch_bvh_node - Read a node from the node buffer
+ *
+ * @i: Index of the node
+ *
+ * Returns: A struct BVHNode
+ */
+BVHNode fetch_bvh_node(int i) {
+    ivec4 a = texelFetch(bvh_node_buffer, 2 * i);
+    ivec4 b = texelFetch(bvh_node_buffer, 2 * i + 1);
+    return BVHNode(intBitsToFloat(a.xyz), a.w, intBitsToFloat(b.xyz), b.w);
+}
+
+/*
+ * aabb_hit - Calculate where a ray enters a bounding box
+ *
+ * @bmin: The minimum corner of the box
+ * @bmax: The maximum corner of the box
+ * @ray
+ * @inv_dir: The inverse of the ray direction
+ * @dist: The maximum distance to consider
+ *
+ * Returns: The entry distance, or FAR on a miss
+ */
+float aabb_hit(vec3 bmin, vec3 bmax, Ray ray, vec3 inv_dir, float dist) {
+    vec3 t0 = (bmin - ray.origin) * inv_dir;
+    vec3 t1 = (bmax - ray.origin) * inv_dir;
+    vec3 t_near = min(t0, t1);
+    vec3 t_far = max(t0, t1);
+    float enter = max(max(t_near.x, t_near.y), max(t_near.z, 0.0));
+    float exit = min(min(t_far.x, t_far.y), min(t_far.z, dist));
+    return enter <= exit ? enter : FAR;
+}
+
+/* ================================================================ *
+ *                         MESH FUNCTIONS                           *
+ * ================================================================ */
+
+#ifdef HAS_MESHES
+struct Instance {
+    // Top three rows of the transform from the scene into the mesh's space
+    vec4 row0;
+    vec4 row1;
+    vec4 row2;
+    int mesh;
+    Material material;
+};
+
+// Meshes uploaded from CPU, two texels per mesh. Their hierarchies, the
+// triangles the leaves hold and the vertices the triangles index are
+// shared by all meshes, and indexed absolutely.
+uniform isamplerBuffer mesh_buffer;
+uniform isamplerBuffer mesh_node_buffer; // Two texels per node
+uniform isamplerBuffer mesh_triangle_buffer; // One texel per triangle
+uniform isamplerBuffer mesh_vertex_buffer; // One texel per vertex
+
+// Placements of the meshes in the scene, seven texels per instance
+uniform isamplerBuffer instance_buffer;
+
+/*
+ * fetch_mesh_root - Read where the BVH of a mesh starts
+ *
+ * @i: Index of the mesh
+ *
+ * Returns: Index of the mesh's root node
+ */
+int fetch_mesh_root(int i) {
+    return texelFetch(mesh_buffer, 2 * i).w;
+}
+
+/*
+ * fetch_instance - Read an instance from the instance buffer
+ *
+ * @i: Index of the instance
+ *
+ * Returns: A struct Instance
+ */
+Instance fetch_instance(int i) {
+    Material material = fetch_material(
+        texelFetch(instance_buffer, 7 * i + 5), texelFetch(instance_buffer, 7 * i + 6)
+    );
+    return Instance(
+        intBitsToFloat(texelFetch(instance_buffer, 7 * i)),
+        intBitsToFloat(texelFetch(instance_buffer, 7 * i + 1)),
+        intBitsToFloat(texelFetch(instance_buffer, 7 * i + 2)),
+        texelFetch(instance_buffer, 7 * i + 3).w,
+        material
+    );
+}
+
+/*
+ * fetch_mesh_node - Read a node from the mesh node buffer
+ *
+ * @i: Index of the node
+ *
+ * Returns: A struct BVHNode
+ */
+BVHNode fetch_mesh_node(int i) {
+    ivec4 a = texelFetch(mesh_node_buffer, 2 * i);
+    ivec4 b = texelFetch(mesh_node_buffer, 2 * i + 1);
+    return BVHNode(intBitsToFloat(a.xyz), a.w, intBitsToFloat(b.xyz), b.w);
+}
+
+/*
+ * fetch_triangle_vertex - Read a corner of a triangle
+ *
+ * @triangle: The vertex indices of the triangle
+ * @corner: Which corner
+ *
+ * Returns: vec3 position
+ */
+vec3 fetch_triangle_vertex(ivec4 triangle, int corner) {
+    return intBitsToFloat(texelFetch(mesh_vertex_buffer, triangle[corner]).xyz);
+}
+
+/*
+ * mesh_hit - Find the closest triangle of a mesh along a ray, walking its
+ *            BVH the same way as the scene's
+ *
+ * @root: The first node of the mesh's BVH
+ * @ray
+ * @shear: The shear of the ray
+ * @inv_dir: The inverse of the ray direction
+ * @dist: The distance of the closest hit so far
+ * @triangle: Set to the index of the hit triangle
+ *
+ * Returns: The distance to the triangle, -1.0 on a miss
+ */
+float mesh_hit(int root, Ray ray, RayShear shear, vec3 inv_dir, float dist, out int triangle) {
+    int stack[BVH_STACK_SIZE];
+    float stack_dist[BVH_STACK_SIZE];
+    BVHNode root_node = fetch_mesh_node(root);
+    stack[0] = root;
+    stack_dist[0] = aabb_hit(root_node.min, root_node.max, ray, inv_dir, dist);
+    int sp = 1;
+    float closest = -1.0;
+    triangle = -1;
+
+    while (sp > 0) {
+        sp--;
+        int index = stack[sp];
+        if (stack_dist[sp] >= dist) {
+            continue;
+        }
+
+        BVHNode node = fetch_mesh_node(index);
+
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                ivec4 tri = texelFetch(mesh_triangle_buffer, i);
+                float t = triangle_hit(fetch_triangle_vertex(tri, 0), fetch_triangle_vertex(tri, 1),
+                                       fetch_triangle_vertex(tri, 2), ray, shear);
+                if (MIN_DIST <= t && t < dist) {
+                    dist = t;
+                    closest = t;
+                    triangle = i;
+                }
+            }
+        } else {
+            int left = index + 1;
+            int right = node.offset;
+            BVHNode left_node = fetch_mesh_node(left);
+            BVHNode right_node = fetch_mesh_node(right);
+            float t_left = aabb_hit(left_node.min, left_node.max, ray, inv_dir, dist);
+            float t_right = aabb_hit(right_node.min, right_node.max, ray, inv_dir, dist);
+
+            if (t_left > t_right) {
+                int tmp_index = left;
+                left = right;
+                right = tmp_index;
+                float tmp_t = t_left;
+                t_left = t_right;
+                t_right = tmp_t;
+            }
+            if (t_right < FAR) {
+                stack[sp] = right;
+                stack_dist[sp] = t_right;
+                sp++;
+            }
+            if (t_left < FAR) {
+                stack[sp] = left;
+                stack_dist[sp] = t_left;
+                sp++;
+            }
+        }
+    }
+    return closest;
+}
+
+/*
+ * instance_hit - Find the closest triangle of an instance along a ray, by
+ *                moving the ray into the space of its mesh. The direction
+ *                is not normalized, so distances stay those of the scene.
+ *
+ * @instance
+ * @ray
+ * @dist: The distance of the closest hit so far
+ * @triangle: Set to the index of the hit triangle
+ *
+ * Returns: The distance to the triangle, -1.0 on a miss
+ */
+float instance_hit(Instance instance, Ray ray, float dist, out int triangle) {
+    Ray local = Ray(
+        vec3(dot(instance.row0.xyz, ray.origin), dot(instance.row1.xyz, ray.origin),
+             dot(instance.row2.xyz, ray.origin)) +
+            vec3(instance.row0.w, instance.row1.w, instance.row2.w),
+        vec3(dot(instance.row0.xyz, ray.dir), dot(instance.row1.xyz, ray.dir),
+             dot(instance.row2.xyz, ray.dir))
+    );
+    return mesh_hit(fetch_mesh_root(instance.mesh), local, ray_shear(local), 1.0 / local.dir,
+                    dist, triangle);
+}
+
+/*
+ * instance_hit_data - Get the hit related information from an intersecting
+ *                     triangle of an instance and ray
+ *
+ * @instance: The instance the triangle was hit through
+ * @triangle: Index of the triangle
+ * @ray
+ * @t: The intersection distance
+ *
+ * Returns: A struct HitInfo
+ */
+HitInfo instance_hit_data(Instance instance, int triangle, Ray ray, float t) {
+    ivec4 tri = texelFetch(mesh_triangle_buffer, triangle);
+    vec3 v0 = fetch_triangle_vertex(tri, 0);
+    vec3 n = cross(fetch_triangle_vertex(tri, 1) - v0, fetch_triangle_vertex(tri, 2) - v0);
+    // Normals go back to the scene through the transpose of the inverse
+    vec3 outward_normal = normalize(instance.row0.xyz * n.x + instance.row1.xyz * n.y +
+                                    instance.row2.xyz * n.z);
+    bool front_face = dot(ray.dir, outward_normal) < 0;
+    vec3 normal = front_face ? outward_normal : -outward_normal;
+
+    return HitInfo(ray_at(ray, t), normal, t, front_face, instance.material);
 }
+#endif
 
 /* ================================================================ *
  *                      TRACING FUNCTIONS                           *
@@ -360,64 +918,370 @@ HitInfo quad_hit_data(Quad quad, Ray ray, float t) {
  *
  * @ray
  * @hit_info: Information about what the ray hit
+ * @hit_ref: The BVH reference of the hit primitive, -1 for the plane or a miss
  *
  * Return: struct HitInfo (returned through argument)
  */
-void trace_scene(Ray ray, inout HitInfo hit_info) {
+void trace_scene(Ray ray, inout HitInfo hit_info, out int hit_ref) {
     float dist = MAX_DIST;
+    hit_ref = -1;
 
+#ifdef HAS_PLANE
     // Check if the ray intersects the plane
     float t = plane_hit(plane, ray);
     if (MIN_DIST <= t && t < dist) {
         hit_info = plane_hit_data(plane, ray, t);
         dist = hit_info.t;
     }
+#endif
+
+#if defined(HAS_SPHERES) || defined(HAS_QUADS) || defined(HAS_MESHES)
+    // Walk the BVH front to back, keeping the entry distance of each
+    // pending node so the ones behind the closest hit can be skipped
+    vec3 inv_dir = 1.0 / ray.dir;
+#ifdef HAS_MESHES
+    int hit_triangle = -1;
+#endif
+    int stack[BVH_STACK_SIZE];
+    float stack_dist[BVH_STACK_SIZE];
+    int sp = 0;
+
+    if (BVH_NODES_NUM > 0) {
+        BVHNode root = fetch_bvh_node(0);
+        stack[0] = 0;
+        stack_dist[0] = aabb_hit(root.min, root.max, ray, inv_dir, dist);
+        sp = 1;
+    }
 
-    // Check if the ray intersects any sphere
-    for (int i = 0; i < SPHERES_NUM; i++) {
-        Sphere sphere = spheres[i];
-        float t = sphere_hit(sphere, ray);
+    while (sp > 0) {
+        sp--;
+        int index = stack[sp];
+        if (stack_dist[sp] >= dist) {
+            continue;
+        }
 
-        // Keep the closest hit sphere
-        if (MIN_DIST <= t && t < dist) {
-            hit_info = sphere_hit_data(sphere, ray, t);
-            dist = hit_info.t;
+        BVHNode node = fetch_bvh_node(index);
+
+        if (node.count > 0) {
+            // Keep the closest hit primitive of the leaf
+            for (int i = 0; i < node.count; i++) {
+                int ref = bvh_ref(node.offset + i);
+                int type = ref & REF_TYPE_MASK;
+                int prim = ref >> REF_TYPE_BITS;
+                float t = -1.0;
+#ifdef HAS_SPHERES
+                if (type == SPHERE_REF) {
+                    t = sphere_hit(fetch_sphere(prim), ray);
+                }
+#endif
+#ifdef HAS_QUADS
+                if (type == QUAD_REF) {
+                    t = quad_hit(fetch_quad(prim), ray);
+                }
+#endif
+#ifdef HAS_MESHES
+                int triangle = -1;
+                if (type == INSTANCE_REF) {
+                    t = instance_hit(fetch_instance(prim), ray, dist, triangle);
+                }
+#endif
+
+                if (MIN_DIST <= t && t < dist) {
+                    dist = t;
+                    hit_ref = ref;
+#ifdef HAS_MESHES
+                    hit_triangle = triangle;
+#endif
+                }
+            }
+        } else {
+            int left = index + 1;
+            int right = node.offset;
+            BVHNode left_node = fetch_bvh_node(left);
+            BVHNode right_node = fetch_bvh_node(right);
+            float t_left = aabb_hit(left_node.min, left_node.max, ray, inv_dir, dist);
+            float t_right = aabb_hit(right_node.min, right_node.max, ray, inv_dir, dist);
+
+            // Push the far child first so the near one is visited next
+            if (t_left > t_right) {
+                int tmp_index = left;
+                left = right;
+                right = tmp_index;
+                float tmp_t = t_left;
+                t_left = t_right;
+                t_right = tmp_t;
+            }
+            if (t_right < FAR) {
+                stack[sp] = right;
+                stack_dist[sp] = t_right;
+                sp++;
+            }
+            if (t_left < FAR) {
+                stack[sp] = left;
+                stack_dist[sp] = t_left;
+                sp++;
+            }
         }
     }
 
-    // Check if the ray intersects any quad
-    for (int i = 0; i < QUADS_NUM; i++) {
-        Quad quad = quads[i];
-        float t = quad_hit(quad, ray);
-
-        // Keep the closest hit quad
-        if (MIN_DIST <= t && t < dist) {
-            hit_info = quad_hit_data(quad, ray, t);
-            dist = hit_info.t;
+    if (hit_ref >= 0) {
+        int type = hit_ref & REF_TYPE_MASK;
+        int prim = hit_ref >> REF_TYPE_BITS;
+#ifdef HAS_SPHERES
+        if (type == SPHERE_REF) {
+            hit_info = sphere_hit_data(fetch_sphere(prim), ray, dist);
         }
+#endif
+#ifdef HAS_QUADS
+        if (type == QUAD_REF) {
+            hit_info = quad_hit_data(fetch_quad(prim), ray, dist);
+        }
+#endif
+#ifdef HAS_MESHES
+        if (type == INSTANCE_REF) {
+            hit_info = instance_hit_data(fetch_instance(prim), hit_triangle, ray, dist);
+        }
+#endif
     }
+#endif
 }
 
 /*
  * get_hit - Get the hit where a ray intersects an object
  *
  * @ray
+ * @hit_ref: The BVH reference of the hit primitive, -1 for the plane or a miss
  *
  * Returns: A struct HitInfo
  */
-HitInfo get_hit(Ray ray) {
+HitInfo get_hit(Ray ray, out int hit_ref) {
     HitInfo hit_info;
     hit_info.t = MAX_DIST;
-    trace_scene(ray, hit_info);
+    trace_scene(ray, hit_info, hit_ref);
     return hit_info;
 }
 
-vec3 lambertian_reflectance(HitInfo hit_info) {
-    return normalize(hit_info.normal + random_on_hemisphere(hit_info.normal));
+/* ================================================================ *
+ *                         LIGHT FUNCTIONS                          *
+ * ================================================================ */
+
+#ifdef HAS_EMISSIVE
+// Emissive spheres and quads uploaded from CPU, one texel per light holding
+// its primitive type and index and the cumulative share of the total power
+uniform int LIGHTS_NUM;
+uniform isamplerBuffer light_buffer;
+uniform float light_power_total;
+
+/*
+ * power_heuristic - Weight one of two sampling strategies of multiple
+ *                   importance sampling, after Veach
+ *
+ * @pdf: Density of the strategy the sample came from
+ * @other_pdf: Density of the other strategy for the same direction
+ *
+ * Returns: float weight
+ */
+float power_heuristic(float pdf, float other_pdf) {
+    float a = pdf * pdf;
+    float b = other_pdf * other_pdf;
+    return a + b > 0.0 ? a / (a + b) : 0.0;
+}
+
+/*
+ * light_select_pdf - Get the probability of picking an emissive primitive,
+ *                    in proportion to its power as the light list does
+ *
+ * @material: The primitive's material
+ * @area: The primitive's surface area
+ *
+ * Returns: float probability
+ */
+float light_select_pdf(Material material, float area) {
+    return luminance(material.albedo) * area / light_power_total;
+}
+
+/*
+ * sphere_light_pdf - Get the density of sampling a direction towards a
+ *                    sphere light, uniform over the cone it subtends
+ *
+ * @sphere
+ * @origin: Where the direction starts
+ *
+ * Returns: The solid angle density, 0.0 from inside the sphere
+ */
+float sphere_light_pdf(Sphere sphere, vec3 origin) {
+    vec3 to_center = sphere.center - origin;
+    float dist_sq = dot(to_center, to_center);
+    float radius_sq = sphere.radius * sphere.radius;
+    if (dist_sq <= radius_sq) {
+        return 0.0;
+    }
+    float cos_max = sqrt(1.0 - radius_sq / dist_sq);
+    return 1.0 / (2.0 * PI * (1.0 - cos_max));
+}
+
+/*
+ * quad_light_pdf - Get the density of sampling a direction towards a point
+ *                  on a quad light, uniform over its area
+ *
+ * @quad
+ * @dir: The unit direction towards the point
+ * @dist: The distance to the point
+ *
+ * Returns: The solid angle density, 0.0 seen edge on
+ */
+float quad_light_pdf(Quad quad, vec3 dir, float dist) {
+    vec3 n = cross(quad.u, quad.v);
+    float area = length(n);
+    float cos_light = abs(dot(dir, n)) / area;
+    return cos_light > 0.0 ? dist * dist / (cos_light * area) : 0.0;
+}
+
+/*
+ * emitter_pdf - Get the density with which light sampling would have chosen
+ *               a direction that hit an emissive primitive
+ *
+ * @hit_ref: The BVH reference of the primitive
+ * @ray: The ray that hit it
+ * @t: The hit distance
+ *
+ * Returns: The solid angle density, 0.0 for primitives not in the lights
+ */
+float emitter_pdf(int hit_ref, Ray ray, float t) {
+    if (light_power_total <= 0.0) {
+        return 0.0;
+    }
+    int type = hit_ref & REF_TYPE_MASK;
+    int prim = hit_ref >> REF_TYPE_BITS;
+#ifdef HAS_SPHERES
+    if (hit_ref >= 0 && type == SPHERE_REF) {
+        Sphere sphere = fetch_sphere(prim);
+        float area = 4.0 * PI * sphere.radius * sphere.radius;
+        return light_select_pdf(sphere.material, area) * sphere_light_pdf(sphere, ray.origin);
+    }
+#endif
+#ifdef HAS_QUADS
+    if (hit_ref >= 0 && type == QUAD_REF) {
+        Quad quad = fetch_quad(prim);
+        float area = length(cross(quad.u, quad.v));
+        return light_select_pdf(quad.material, area) * quad_light_pdf(quad, ray.dir, t);
+    }
+#endif
+    return 0.0;
+}
+
+/*
+ * sample_lights - Estimate the light arriving directly from the lights at a
+ *                 diffuse hit, by picking a light, sampling a direction
+ *                 towards it and casting a shadow ray, weighted against
+ *                 sampling the same direction by the surface
+ *
+ * @hit_info: The diffuse hit
+ * @u_pick: The sample picking the light
+ * @u: The sample of the direction
+ *
+ * Returns: The reflected radiance, to be multiplied by the albedo
+ */
+vec3 sample_lights(HitInfo hit_info, float u_pick, vec2 u) {
+    if (LIGHTS_NUM == 0) {
+        return vec3(0.0);
+    }
+
+    // Binary search of the cumulative power
+    int lo = 0;
+    int hi = LIGHTS_NUM - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (u_pick < intBitsToFloat(texelFetch(light_buffer, mid).z)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    ivec4 light = texelFetch(light_buffer, lo);
+
+    vec3 dir = vec3(0.0);
+    float pdf = 0.0;
+    float select_pdf = 0.0;
+#ifdef HAS_SPHERES
+    if (light.x == SPHERE_REF) {
+        // Uniform over the cone of directions the sphere subtends
+        Sphere sphere = fetch_sphere(light.y);
+        pdf = sphere_light_pdf(sphere, hit_info.p);
+        if (pdf > 0.0) {
+            vec3 to_center = sphere.center - hit_info.p;
+            float dist_sq = dot(to_center, to_center);
+            float cos_max = sqrt(1.0 - sphere.radius * sphere.radius / dist_sq);
+            float cos_theta = 1.0 - u.x * (1.0 - cos_max);
+            float sin_theta = sqrt(max(1.0 - cos_theta * cos_theta, 0.0));
+            float phi = 2.0 * PI * u.y;
+            dir = normalize(local_to_world(
+                to_center / sqrt(dist_sq),
+                vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta)
+            ));
+        }
+        select_pdf = light_select_pdf(sphere.material, 4.0 * PI * sphere.radius * sphere.radius);
+    }
+#endif
+#ifdef HAS_QUADS
+    if (light.x == QUAD_REF) {
+        // Uniform over the area of the quad
+        Quad quad = fetch_quad(light.y);
+        vec3 to_point = quad.Q + u.x * quad.u + u.y * quad.v - hit_info.p;
+        float dist = length(to_point);
+        dir = to_point / dist;
+        pdf = quad_light_pdf(quad, dir, dist);
+        select_pdf = light_select_pdf(quad.material, length(cross(quad.u, quad.v)));
+    }
+#endif
+
+    float cos_surface = dot(hit_info.normal, dir);
+    if (pdf <= 0.0 || cos_surface <= 0.0) {
+        return vec3(0.0);
+    }
+
+    // The light is only seen if it is the first thing along the shadow ray,
+    // and from its emitting side
+    int shadow_ref;
+    HitInfo shadow = get_hit(Ray(hit_info.p, dir), shadow_ref);
+    if (shadow_ref != (light.y << REF_TYPE_BITS | light.x) || !shadow.front_face) {
+        return vec3(0.0);
+    }
+
+    float light_pdf = select_pdf * pdf;
+    float bsdf_pdf = cos_surface / PI;
+    return shadow.material.albedo * bsdf_pdf * power_heuristic(light_pdf, bsdf_pdf) / light_pdf;
+}
+
+/*
+ * emitted - Get the light a path receives from the emitter it hit, sharing
+ *           it with the light sampling of the previous bounce
+ *
+ * @hit_info: The hit on the emitter
+ * @hit_ref: The BVH reference of the emitter
+ * @ray: The ray that hit it
+ * @bsdf_pdf: Density the previous surface sampled the ray with, 0.0 where
+ *            the lights could not have been sampled
+ *
+ * Returns: The weighted radiance, to be multiplied by the path throughput
+ */
+vec3 emitted(HitInfo hit_info, int hit_ref, Ray ray, float bsdf_pdf) {
+    if (!hit_info.front_face) {
+        return vec3(0.0);
+    }
+    float weight = bsdf_pdf > 0.0
+        ? power_heuristic(bsdf_pdf, emitter_pdf(hit_ref, ray, hit_info.t))
+        : 1.0;
+    return hit_info.material.albedo * weight;
+}
+#endif
+
+vec3 lambertian_reflectance(HitInfo hit_info, vec2 u) {
+    return sample_cosine_hemisphere(hit_info.normal, u);
 }
 
-vec3 metal_reflectance(HitInfo hit_info, Ray ray) {
-    return reflect(ray.dir, hit_info.normal) + hit_info.material.fuzz * vec3_random();
+vec3 metal_reflectance(HitInfo hit_info, Ray ray, vec2 u) {
+    return reflect(ray.dir, hit_info.normal) + hit_info.material.fuzz * sample_sphere(u);
 }
 
 float reflectance(float angle, float ri) {
@@ -426,7 +1290,7 @@ float reflectance(float angle, float ri) {
     return r0 + (1.0 - r0) * pow(1.0 - angle, 5);
 }
 
-vec3 dielectric_reflectance(HitInfo hit_info, Ray ray) {
+vec3 dielectric_reflectance(HitInfo hit_info, Ray ray, float u) {
     float cos_theta = min(dot(-ray.dir, hit_info.normal), 1.0);
     float sin_theta = sqrt(1.0 - cos_theta*cos_theta);
 
@@ -436,13 +1300,157 @@ vec3 dielectric_reflectance(HitInfo hit_info, Ray ray) {
 
     bool can_refract = ri * sin_theta <= 1.0;
 
-    if (can_refract && reflectance(cos_theta, ri) < random()) {
+    if (can_refract && reflectance(cos_theta, ri) < u) {
         return refract(ray.dir, hit_info.normal, ri);
     } else {
         return reflect(ray.dir, hit_info.normal);
     }
 }
 
+/*
+ * sky_color - Get the light of the sky a ray escapes into
+ *
+ * @ray
+ *
+ * Returns: vec3 radiance
+ */
+vec3 sky_color(Ray ray) {
+    float a = 0.5 * (ray.dir.y + 1.0);
+    return (1.0 - a) * vec3(1.0, 1.0, 1.0) + a * vec3(0.4, 0.6, 1.0);
+}
+
+/*
+ * scatter_path - Continue a path from the surface it hit, drawing the same
+ *                sample dimensions at every bounce
+ *
+ * @hit_info: The hit, on anything but an emitter
+ * @ray: The ray that hit, replaced by the scattered ray
+ * @throughput: What the path carries, scaled by the surface
+ * @radiance: Light reaching the camera, gaining the direct light at
+ *            diffuse hits
+ * @bsdf_pdf: Set to the density of the scattered direction, 0.0 where the
+ *            lights could not have been sampled
+ * @bounce: Bounces taken before this one
+ *
+ * Returns: false if Russian roulette ended the path
+ */
+bool scatter_path(HitInfo hit_info, inout Ray ray, inout vec3 throughput, inout vec3 radiance,
+                  out float bsdf_pdf, int bounce) {
+    int mat_type = hit_info.material.material;
+    vec3 scatter;
+    bsdf_pdf = 0.0;
+
+    // Every bounce draws the same dimensions, one pair for the direction
+    // and one for the choices, so they line up across the samples of the
+    // sequence
+    vec2 u_scatter = sample_2d();
+    vec2 u_choice = sample_2d();
+#ifdef HAS_EMISSIVE
+    vec2 u_light = sample_2d();
+#endif
+
+#ifdef HAS_LAMBERTIAN
+    if (mat_type == LAMBERTIAN) {
+        scatter = lambertian_reflectance(hit_info, u_scatter);
+#ifdef HAS_EMISSIVE
+        // The light choice is free here, diffuse hits do not use it
+        radiance += throughput * hit_info.material.albedo *
+                    sample_lights(hit_info, u_choice.x, u_light);
+        bsdf_pdf = max(dot(hit_info.normal, scatter), 0.0) / PI;
+#endif
+    }
+#endif
+#ifdef HAS_METAL
+    if (mat_type == METAL)
+        scatter = metal_reflectance(hit_info, ray, u_scatter);
+#endif
+#ifdef HAS_DIELECTRIC
+    if (mat_type == DIELECTRIC)
+        scatter = dielectric_reflectance(hit_info, ray, u_choice.x);
+#endif
+
+    ray = Ray(hit_info.p, scatter);
+    throughput *= hit_info.material.albedo;
+
+    // Russian roulette, paths carrying little light are likely to end and
+    // the survivors are weighted up to keep the mean
+    if (bounce >= roulette_depth) {
+        float survival = min(max(throughput.r, max(throughput.g, throughput.b)), 0.95);
+        if (u_choice.y >= survival) {
+            return false;
+        }
+        throughput /= survival;
+    }
+    return true;
+}
+
+/* ================================================================ *
+ *                          FEATURES                                *
+ * ================================================================ */
+
+// What the denoiser tells edges apart by. Albedo and normal are taken
+// where a path first meets a surface other than a mirror or glass, as
+// seen through those, and the depth at the first hit whatever it is.
+vec3 feature_albedo;
+vec3 feature_normal;
+float feature_depth;
+bool features_found;
+
+/*
+ * start_features - Forget the features of the previous sample
+ */
+void start_features() {
+    feature_albedo = vec3(0.0);
+    feature_normal = vec3(0.0);
+    feature_depth = MAX_DIST;
+    features_found = false;
+}
+
+/*
+ * record_features - Take the features of a path at a vertex, unless an
+ *                   earlier vertex had them taken already
+ *
+ * @albedo: Albedo at the vertex, as seen through the surfaces before it
+ * @normal: Its normal, zero where the path escaped
+ */
+void record_features(vec3 albedo, vec3 normal) {
+    if (!features_found) {
+        // Emitters keep their radiance in the albedo
+        feature_albedo = min(albedo, 1.0);
+        feature_normal = normal;
+        features_found = true;
+    }
+}
+
+/*
+ * record_hit_features - Take the features at a hit, passing through
+ *                       mirrors and glass
+ *
+ * @hit_info: The hit
+ * @throughput: What the path carries up to the hit
+ * @bounce: Bounces taken before the hit
+ */
+void record_hit_features(HitInfo hit_info, vec3 throughput, int bounce) {
+    if (bounce == 0) {
+        feature_depth = hit_info.t;
+    }
+    int mat_type = hit_info.material.material;
+    if (mat_type != METAL && mat_type != DIELECTRIC) {
+        record_features(throughput * hit_info.material.albedo, hit_info.normal);
+    }
+}
+
+/*
+ * pixel_converged - Check whether adaptive sampling has stopped a pixel
+ *
+ * @pixel: The pixel's position in the image
+ *
+ * Returns: Whether the tile of the pixel needs no more samples
+ */
+bool pixel_converged(ivec2 pixel) {
+    return adaptive && texelFetch(sample_mask, pixel / mask_tile_size, 0).r < 0.5;
+}
+
 /*
  * get_ray_color - Get the color of an intersecting ray
  *
@@ -452,48 +1460,75 @@ vec3 dielectric_reflectance(HitInfo hit_info, Ray ray) {
  */
 vec4 get_ray_color(Ray ray) {
     vec3 new_color = vec3(1.0);
+    vec3 radiance = vec3(0.0); // Light reaching the camera from the emitters
+    float bsdf_pdf = 0.0; // Density of the direction sampled by the surface
 
     // Iterate for each bounce of light
-    for (int i = 0; i < MAX_BOUNCE; i++) {
-        HitInfo hit_info = get_hit(ray);
+    for (int i = 0; i < max_bounce; i++) {
+        int hit_ref;
+        HitInfo hit_info = get_hit(ray, hit_ref);
 
         // Check if the ray hit
         if (hit_info.t < MAX_DIST) {
-            int mat_type = hit_info.material.material;
-            vec3 scatter;
-
-            if (mat_type== 0)
-                scatter = lambertian_reflectance(hit_info);
-            if (mat_type == 1)
-                scatter = metal_reflectance(hit_info, ray);
-            if (mat_type == 2)
-                scatter = dielectric_reflectance(hit_info, ray);
-
-            ray = Ray(hit_info.p, scatter);
-            new_color *= hit_info.material.albedo;
-
+            record_hit_features(hit_info, new_color, i);
+#ifdef HAS_EMISSIVE
+            // Emitters end the path
+            if (hit_info.material.material == EMISSIVE) {
+                return vec4(radiance + new_color * emitted(hit_info, hit_ref, ray, bsdf_pdf), 1.0);
+            }
+#endif
+            if (!scatter_path(hit_info, ray, new_color, radiance, bsdf_pdf, i)) {
+                return vec4(radiance, 1.0);
+            }
         } else {
-            float a = 0.5 * (ray.dir.y + 1.0);
-            vec3 color = (1.0 - a) * vec3(1.0, 1.0, 1.0) + a * vec3(0.4, 0.6, 1.0);
-            new_color *= color;
-            return vec4(new_color, 1.0);
+            record_features(new_color * sky_color(ray), vec3(0.0));
+            return vec4(radiance + new_color * sky_color(ray), 1.0);
         }
     }
 
-    return vec4(new_color, 1.0);
+    record_features(new_color, vec3(0.0));
+    return vec4(radiance + new_color, 1.0);
 }
 
+#ifndef WAVEFRONT
 void main() {
-    plane = get_plane(vec3(0.0, 1.0, 0.0), vec3(0.0, -0.000, 0.0), Material(vec3(0.86, 0.95, 0.99) * 0.8, 1, 0.05, 0));
+    // Converged tiles keep what they have accumulated
+    if (pixel_converged(ivec2(gl_FragCoord.xy))) {
+        discard;
+    }
+
+#ifdef HAS_PLANE
+    init_plane();
+#endif
+
+    // Seeded by pixel and frame only, so a render can be repeated
+    uint pixel = uint(gl_FragCoord.y) * uint(resolution.x) + uint(gl_FragCoord.x);
+    pixel_seed = pcg_hash(pixel);
+    rng_state = pcg_hash(pixel_seed ^ uint(frame));
 
     vec3 color = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < SAMPLES_PER_PIXEL; i++) {
-        Ray ray = ray_create();
-        color += get_ray_color(ray).xyz;
+    float luminance_sq = 0.0;
+    vec4 albedo_sum = vec4(0.0);
+    vec3 normal_sum = vec3(0.0);
+    for (int i = 0; i < samples_per_pixel; i++) {
+        start_sample(first_sample + uint(i));
+        start_features();
+        Ray ray = ray_create(frag_coord);
+        vec3 sample_color = get_ray_color(ray).xyz;
+        color += sample_color;
+        luminance_sq += luminance(sample_color) * luminance(sample_color);
+        albedo_sum += vec4(feature_albedo, feature_depth);
+        normal_sum += feature_normal;
     }
 
-    float weight = 1.0 / (frame + 1);
-    vec4 tex_color = texture(prev_frame_tex, tex_coord);
-    vec4 ray_color = to_gamma(vec4(color / SAMPLES_PER_PIXEL, 1.0));
-    out_color = mix(tex_color, ray_color, weight);
+    // Added onto the accumulation buffer, the sample count goes in alpha so
+    // the display pass can take the average
+    out_color = vec4(color, samples_per_pixel);
+    out_moments = vec4(luminance_sq, 0.0, 0.0, 0.0);
+#ifdef FEATURE_BUFFERS
+    out_albedo = albedo_sum;
+    // Features keep a count of their own, reprojected samples bring none
+    out_normal = vec4(normal_sum, samples_per_pixel);
+#endif
 }
+#endif
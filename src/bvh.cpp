@@ -0,0 +1,152 @@
+#include "bvh.h"
+#include <algorithm>
+#include <limits>
+
+// Number of buckets the centroids are sorted into when looking for a split
+static size_t const BIN_COUNT {12};
+// Cost of visiting a node, relative to intersecting one primitive
+static GLfloat const TRAVERSAL_COST {1.0};
+
+GLint BVH::make_ref(GLint type, GLint index) {
+    return (index << TYPE_BITS) | type;
+}
+
+GLint BVH::ref_type(GLint ref) {
+    return ref & ((1 << TYPE_BITS) - 1);
+}
+
+GLint BVH::ref_index(GLint ref) {
+    return ref >> TYPE_BITS;
+}
+
+void BVH::build(std::vector<Primitive> primitives, size_t max_leaf_size) {
+    nodes.clear();
+    refs.clear();
+
+    if (primitives.empty()) {
+        return;
+    }
+
+    nodes.reserve(2 * primitives.size());
+    refs.reserve(primitives.size());
+    build_node(primitives, 0, primitives.size(), max_leaf_size, 0);
+}
+
+/* Returns: The primitive references in fours, as the shader reads them */
+std::vector<BVHRefs> BVH::packed_refs() const {
+    std::vector<BVHRefs> packed((refs.size() + 3) / 4, BVHRefs{});
+    for (size_t i = 0; i < refs.size(); i++) {
+        packed[i / 4].refs[i % 4] = refs[i];
+    }
+    return packed;
+}
+
+/*
+ * build_node - Recursively build the subtree over a range of primitives using
+ *              the binned surface area heuristic
+ *
+ * Returns: The index of the created node
+ */
+size_t BVH::build_node(std::vector<Primitive>& primitives, size_t begin, size_t end,
+                       size_t max_leaf_size, size_t depth) {
+    AABB bounds {};
+    AABB centroid_bounds {};
+    for (size_t i = begin; i < end; i++) {
+        bounds.grow(primitives[i].bounds);
+        centroid_bounds.grow(primitives[i].bounds.centroid());
+    }
+
+    size_t const index {nodes.size()};
+    size_t const count {end - begin};
+    nodes.push_back({bounds.min, 0, bounds.max, 0});
+
+    auto const make_leaf = [&]() {
+        nodes[index].count = count;
+        nodes[index].offset = refs.size();
+        for (size_t i = begin; i < end; i++) {
+            refs.push_back(primitives[i].ref);
+        }
+        return index;
+    };
+
+    if (count == 1 || depth >= MAX_DEPTH) {
+        return make_leaf();
+    }
+
+    // Find the cheapest split between bins along any axis
+    GLfloat best_cost {std::numeric_limits<GLfloat>::max()};
+    size_t best_axis {};
+    size_t best_bin {};
+
+    auto const bin_of = [&](Primitive const& p, size_t axis) {
+        GLfloat const lo {centroid_bounds.min[axis]};
+        GLfloat const extent {centroid_bounds.max[axis] - lo};
+        size_t const bin = (p.bounds.centroid()[axis] - lo) / extent * BIN_COUNT;
+        return std::min(bin, BIN_COUNT - 1);
+    };
+
+    for (size_t axis = 0; axis < 3; axis++) {
+        if (centroid_bounds.max[axis] - centroid_bounds.min[axis] <= 0.0) {
+            continue;
+        }
+
+        AABB bin_bounds[BIN_COUNT] {};
+        size_t bin_counts[BIN_COUNT] {};
+        for (size_t i = begin; i < end; i++) {
+            size_t const bin {bin_of(primitives[i], axis)};
+            bin_bounds[bin].grow(primitives[i].bounds);
+            bin_counts[bin]++;
+        }
+
+        // Sweep from the right to get the cost of everything after each split
+        GLfloat right_costs[BIN_COUNT] {};
+        AABB right_bounds {};
+        size_t right_count {};
+        for (size_t bin = BIN_COUNT - 1; bin > 0; bin--) {
+            right_bounds.grow(bin_bounds[bin]);
+            right_count += bin_counts[bin];
+            right_costs[bin - 1] = right_count ? right_bounds.area() * right_count : 0.0;
+        }
+
+        AABB left_bounds {};
+        size_t left_count {};
+        for (size_t bin = 0; bin < BIN_COUNT - 1; bin++) {
+            left_bounds.grow(bin_bounds[bin]);
+            left_count += bin_counts[bin];
+            if (left_count == 0 || left_count == count) {
+                continue;
+            }
+
+            GLfloat const cost {
+                TRAVERSAL_COST +
+                (left_bounds.area() * left_count + right_costs[bin]) / bounds.area()
+            };
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = bin;
+            }
+        }
+    }
+
+    bool const found_split {best_cost < std::numeric_limits<GLfloat>::max()};
+    if (count <= max_leaf_size && (!found_split || best_cost >= count)) {
+        return make_leaf();
+    }
+
+    size_t mid {};
+    if (found_split) {
+        mid = std::partition(
+            primitives.begin() + begin, primitives.begin() + end,
+            [&](Primitive const& p) { return bin_of(p, best_axis) <= best_bin; }
+        ) - primitives.begin();
+    } else {
+        // All centroids coincide, so any split is as good as another
+        mid = begin + count / 2;
+    }
+
+    build_node(primitives, begin, mid, max_leaf_size, depth + 1);
+    size_t const right {build_node(primitives, mid, end, max_leaf_size, depth + 1)};
+    nodes[index].offset = right;
+    return index;
+}
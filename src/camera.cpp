@@ -2,7 +2,7 @@
 #include <algorithm>
 #include <cmath>
 
-Camera::Camera(vec3 const& pos, GLint fov) : pos{pos}, fov{fov} {};
+Camera::Camera(vec3 const& pos, GLint fov) : pos{pos}, pitch{}, yaw{}, fov{fov} {};
 
 Matrix4 Camera::to_matrix() const {
     vec3 const up{0.0, 1.0, 0.0};
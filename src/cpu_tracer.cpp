@@ -0,0 +1,722 @@
+#include "cpu_tracer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+// These mirror the constants of frag_trace.glsl
+static GLfloat const FAR {std::numeric_limits<GLfloat>::max()};
+static size_t const BVH_STACK_SIZE {64};
+
+/* PCG32, small and fast enough to keep one per pixel */
+class CPUTracer::RNG {
+public:
+    explicit RNG(uint64_t seed) : state{seed * MULTIPLIER + INCREMENT} {
+        next_uint();
+    }
+
+    /* Returns: A floating point value within [0.0, 1.0) */
+    GLfloat next() {
+        return (next_uint() >> 8) * (1.0f / (1u << 24));
+    }
+
+private:
+    uint64_t static constexpr MULTIPLIER {6364136223846793005ull};
+    uint64_t static constexpr INCREMENT {1442695040888963407ull};
+
+    uint32_t next_uint() {
+        uint64_t const old {state};
+        state = old * MULTIPLIER + INCREMENT;
+        uint32_t const xorshifted = ((old >> 18u) ^ old) >> 27u;
+        uint32_t const rot = old >> 59u;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    uint64_t state;
+};
+
+/* ================================================================ *
+ *                        UTILITY FUNCTIONS                         *
+ * ================================================================ */
+
+// The ground plane hardcoded in frag_trace.glsl
+static vec3 const PLANE_NORMAL {0.0, 1.0, 0.0};
+static vec3 const PLANE_POINT {0.0, 0.0, 0.0};
+static Material const PLANE_MATERIAL {Material().metal(vec3(0.86, 0.95, 0.99) * 0.8, 0.05)};
+
+static vec3 ray_at(vec3 const& origin, vec3 const& dir, GLfloat t) {
+    return origin + dir * t;
+}
+
+static vec3 reflect(vec3 const& dir, vec3 const& normal) {
+    return dir - normal * (2.0f * dir.dot(normal));
+}
+
+static vec3 refract(vec3 const& dir, vec3 const& normal, GLfloat eta) {
+    GLfloat const d {normal.dot(dir)};
+    GLfloat const k {1.0f - eta * eta * (1.0f - d * d)};
+    if (k < 0.0) {
+        return {0.0, 0.0, 0.0};
+    }
+    return dir * eta - normal * (eta * d + std::sqrt(k));
+}
+
+/* Map a sample to a direction, uniformly over the sphere */
+static vec3 sample_sphere(GLfloat u, GLfloat v) {
+    GLfloat const z {1.0f - 2.0f * u};
+    GLfloat const r {std::sqrt(std::max(1.0f - z * z, 0.0f))};
+    GLfloat const phi {2.0f * static_cast<GLfloat>(M_PI) * v};
+    return {r * std::cos(phi), r * std::sin(phi), z};
+}
+
+/* Turn a direction given around the z axis into one around a normal, in
+ * the same basis as local_to_world in the shader */
+static vec3 local_to_world(vec3 const& normal, vec3 const& dir) {
+    GLfloat const s {normal.z >= 0.0f ? 1.0f : -1.0f};
+    GLfloat const a {-1.0f / (s + normal.z)};
+    GLfloat const b {normal.x * normal.y * a};
+    vec3 const tangent {1.0f + s * normal.x * normal.x * a, s * b, -s * normal.x};
+    vec3 const bitangent {b, s + normal.y * normal.y * a, -normal.y};
+    return tangent * dir.x + bitangent * dir.y + normal * dir.z;
+}
+
+/* Map a sample to a direction around a normal with density following the
+ * cosine to it */
+static vec3 sample_cosine_hemisphere(vec3 const& normal, GLfloat u, GLfloat v) {
+    GLfloat const r {std::sqrt(u)};
+    GLfloat const phi {2.0f * static_cast<GLfloat>(M_PI) * v};
+    vec3 const dir {local_to_world(normal, {r * std::cos(phi), r * std::sin(phi),
+                                            std::sqrt(std::max(1.0f - u, 0.0f))})};
+    return dir / dir.length();
+}
+
+static GLfloat luminance(vec3 const& color) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+/* Weight of one of two sampling strategies, by the power heuristic */
+static GLfloat power_heuristic(GLfloat pdf, GLfloat other_pdf) {
+    GLfloat const a {pdf * pdf};
+    GLfloat const b {other_pdf * other_pdf};
+    return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+/* Returns: The solid angle density of sampling the cone a sphere subtends
+ *          from a point, 0 from inside it */
+static GLfloat sphere_light_pdf(Sphere const& sphere, vec3 const& origin) {
+    vec3 const to_center {sphere.center - origin};
+    GLfloat const dist_sq {to_center.dot(to_center)};
+    GLfloat const radius_sq {sphere.radius * sphere.radius};
+    if (dist_sq <= radius_sq) {
+        return 0.0;
+    }
+    GLfloat const cos_max {std::sqrt(1.0f - radius_sq / dist_sq)};
+    return 1.0f / (2.0f * static_cast<GLfloat>(M_PI) * (1.0f - cos_max));
+}
+
+/* Returns: The solid angle density of sampling a point on a quad uniformly
+ *          by area, seen along a unit direction from a distance */
+static GLfloat quad_light_pdf(Quad const& quad, vec3 const& dir, GLfloat dist) {
+    vec3 const n {quad.u.cross(quad.v)};
+    GLfloat const area {n.length()};
+    GLfloat const cos_light {std::abs(dir.dot(n)) / area};
+    return cos_light > 0.0f ? dist * dist / (cos_light * area) : 0.0f;
+}
+
+static GLfloat reflectance(GLfloat angle, GLfloat ri) {
+    GLfloat r0 {(1.0f - ri) / (1.0f + ri)};
+    r0 = r0 * r0;
+    return r0 + (1.0f - r0) * std::pow(1.0f - angle, 5.0f);
+}
+
+static GLfloat aabb_hit(BVHNode const& node, vec3 const& origin, vec3 const& inv_dir,
+                        GLfloat dist) {
+    GLfloat enter {0.0};
+    GLfloat exit {dist};
+    for (size_t axis = 0; axis < 3; axis++) {
+        GLfloat t0 {(node.min[axis] - origin[axis]) * inv_dir[axis]};
+        GLfloat t1 {(node.max[axis] - origin[axis]) * inv_dir[axis]};
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        enter = std::max(enter, t0);
+        exit = std::min(exit, t1);
+    }
+    return enter <= exit ? enter : FAR;
+}
+
+/* ================================================================ *
+ *                           CPU TRACER                             *
+ * ================================================================ */
+
+CPUTracer::CPUTracer(size_t width, size_t height, size_t thread_count)
+    : width{width}, height{height}, view_width{width}, view_height{height},
+      accum(width * height * 4), moments(width * height), pool{thread_count} {
+    reset();
+};
+
+void CPUTracer::set_scene(GLArray<Sphere> const& spheres, GLArray<Quad> const& quads,
+                          MeshSet meshes, bool ground_plane) {
+    this->ground_plane = ground_plane;
+    this->spheres.assign(spheres.data(), spheres.data() + spheres.size());
+    this->quads.assign(quads.data(), quads.data() + quads.size());
+    this->meshes = std::move(meshes);
+
+    std::vector<BVH::Primitive> primitives {};
+    for (size_t i = 0; i < this->spheres.size(); i++) {
+        primitives.push_back({this->spheres[i].bounds(), BVH::make_ref(BVH::SPHERE, i)});
+    }
+    for (size_t i = 0; i < this->quads.size(); i++) {
+        primitives.push_back({this->quads[i].bounds(), BVH::make_ref(BVH::QUAD, i)});
+    }
+    for (size_t i = 0; i < this->meshes.instances.size(); i++) {
+        primitives.push_back({this->meshes.instances[i].bounds(),
+                              BVH::make_ref(BVH::INSTANCE, i)});
+    }
+    bvh.build(primitives, BVH::CPU_LEAF_SIZE);
+    soa.build(this->spheres, this->quads, bvh.refs);
+
+    lights.build(this->spheres.data(), this->spheres.size(), this->quads.data(),
+                 this->quads.size());
+    auto const emits = [](Material const& material) {
+        return material.material == static_cast<GLint>(Material::EMISSIVE);
+    };
+    emissive = std::any_of(this->spheres.begin(), this->spheres.end(),
+                           [&](Sphere const& s) { return emits(s.material); }) ||
+               std::any_of(this->quads.begin(), this->quads.end(),
+                           [&](Quad const& q) { return emits(q.material); }) ||
+               std::any_of(this->meshes.instances.begin(), this->meshes.instances.end(),
+                           [&](Instance const& i) { return emits(i.material); });
+}
+
+/* Trace only the bottom left corner of the image, taking effect on the
+ * next reset */
+void CPUTracer::set_viewport(size_t width, size_t height) {
+    view_width = std::min(width, this->width);
+    view_height = std::min(height, this->height);
+}
+
+/* Trace only the tiles overlapping a rectangle of the image, taking effect
+ * on the next reset */
+void CPUTracer::set_region(size_t x, size_t y, size_t width, size_t height) {
+    region_x0 = x;
+    region_y0 = y;
+    region_x1 = x + width;
+    region_y1 = y + height;
+}
+
+void CPUTracer::reset() {
+    std::fill(accum.begin(), accum.end(), 0.0f);
+    std::fill(moments.begin(), moments.end(), 0.0f);
+
+    size_t const tiles_x {(view_width + TILE_SIZE - 1) / TILE_SIZE};
+    size_t const tiles_y {(view_height + TILE_SIZE - 1) / TILE_SIZE};
+    active_tiles.clear();
+    for (size_t i = 0; i < tiles_x * tiles_y; i++) {
+        size_t const x {i % tiles_x * TILE_SIZE};
+        size_t const y {i / tiles_x * TILE_SIZE};
+        if (x < region_x1 && x + TILE_SIZE > region_x0 && y < region_y1 &&
+            y + TILE_SIZE > region_y0) {
+            active_tiles.push_back(i);
+        }
+    }
+    sample_boost = 1;
+}
+
+/* Trace one frame, split into tiles across all the workers, and add its
+ * samples to the accumulated image */
+void CPUTracer::trace(Camera const& camera, GLuint frame, SampleBudget const& budget) {
+    Matrix4 const view {camera.to_matrix()};
+
+    if (budget.error_threshold > 0.0f && frame > 0 &&
+        frame % SampleBudget::ADAPTIVE_INTERVAL == 0) {
+        update_active_tiles(budget.error_threshold);
+    }
+
+    SampleBudget boosted {budget};
+    boosted.samples *= sample_boost;
+    pool.run(active_tiles.size(), [&](size_t i) {
+        trace_tile(active_tiles[i], view, camera.fov, frame, boosted);
+    });
+}
+
+std::vector<GLfloat> const& CPUTracer::pixels() const {
+    return accum;
+}
+
+size_t CPUTracer::threads() const {
+    return pool.size();
+}
+
+/* Returns: The rays cast into the scene so far, counting every bounce */
+uint64_t CPUTracer::rays() const {
+    return rays_cast.load();
+}
+
+void CPUTracer::trace_tile(size_t tile, Matrix4 const& view, GLint fov, GLuint frame,
+                           SampleBudget const& budget) {
+    size_t const tiles_x {(view_width + TILE_SIZE - 1) / TILE_SIZE};
+    size_t const x0 {tile % tiles_x * TILE_SIZE};
+    size_t const y0 {tile / tiles_x * TILE_SIZE};
+    size_t const x1 {std::min(x0 + TILE_SIZE, view_width)};
+    size_t const y1 {std::min(y0 + TILE_SIZE, view_height)};
+
+    GLfloat const aspect_ratio {static_cast<GLfloat>(view_width) / view_height};
+    GLfloat const dist {1.0f / std::tan(fov * static_cast<GLfloat>(M_PI) / 360.0f)};
+    vec3 const ray_pos {view.transform_point({0.0, 0.0, 0.0})};
+    uint64_t rays {};
+
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t x = x0; x < x1; x++) {
+            size_t const pixel {y * width + x};
+            RNG rng {(static_cast<uint64_t>(frame) << 32) ^ pixel};
+
+            // Pixel center in normalized device coordinates, like frag_coord
+            GLfloat const frag_x {(x + 0.5f) / view_width * 2.0f - 1.0f};
+            GLfloat const frag_y {(y + 0.5f) / view_height * 2.0f - 1.0f};
+
+            vec3 color {0.0, 0.0, 0.0};
+            GLfloat luminance_sq {0.0};
+            for (GLint i = 0; i < budget.samples; i++) {
+                GLfloat const offset_x {(rng.next() - 0.5f) / view_width};
+                GLfloat const offset_y {(rng.next() - 0.5f) / view_width};
+                vec3 const target {view.transform_point(
+                    {frag_x * aspect_ratio + offset_x, frag_y + offset_y, -dist})};
+                vec3 const dir {target - ray_pos};
+                vec3 const sample {ray_color({ray_pos, dir / dir.length()}, rng, budget, rays)};
+                color += sample;
+                luminance_sq += luminance(sample) * luminance(sample);
+            }
+
+            GLfloat* const out {&accum[pixel * 4]};
+            out[0] += color.x;
+            out[1] += color.y;
+            out[2] += color.z;
+            out[3] += budget.samples;
+            moments[pixel] += luminance_sq;
+        }
+    }
+    rays_cast += rays;
+}
+
+/* Drop the tiles whose pixels have all converged from the ones traced, and
+ * spread the samples they leave over the rest, like the GPU mask pass */
+void CPUTracer::update_active_tiles(GLfloat threshold) {
+    std::vector<char> converged(active_tiles.size());
+    pool.run(active_tiles.size(), [&](size_t i) {
+        converged[i] = tile_converged(active_tiles[i], threshold);
+    });
+
+    size_t const tiles_x {(view_width + TILE_SIZE - 1) / TILE_SIZE};
+    size_t const tiles_y {(view_height + TILE_SIZE - 1) / TILE_SIZE};
+    std::vector<size_t> remaining {};
+    for (size_t i = 0; i < active_tiles.size(); i++) {
+        if (!converged[i]) {
+            remaining.push_back(active_tiles[i]);
+        }
+    }
+    active_tiles = std::move(remaining);
+
+    sample_boost = active_tiles.empty() ? 1
+        : std::clamp<GLint>(tiles_x * tiles_y / active_tiles.size(), 1,
+                            SampleBudget::ADAPTIVE_MAX_BOOST);
+}
+
+/*
+ * tile_converged - Check whether the standard error of every pixel mean in
+ *                  a tile is below the threshold, as frag_mask.glsl does
+ *
+ * Returns: Whether the tile needs no more samples
+ */
+bool CPUTracer::tile_converged(size_t tile, GLfloat threshold) const {
+    size_t const tiles_x {(view_width + TILE_SIZE - 1) / TILE_SIZE};
+    size_t const x0 {tile % tiles_x * TILE_SIZE};
+    size_t const y0 {tile / tiles_x * TILE_SIZE};
+
+    for (size_t y = y0; y < std::min(y0 + TILE_SIZE, view_height); y++) {
+        for (size_t x = x0; x < std::min(x0 + TILE_SIZE, view_width); x++) {
+            size_t const pixel {y * width + x};
+            GLfloat const* const sum {&accum[pixel * 4]};
+            GLfloat const n {sum[3]};
+            if (n < SampleBudget::ADAPTIVE_MIN_SAMPLES) {
+                return false;
+            }
+
+            GLfloat const mean {luminance({sum[0], sum[1], sum[2]}) / n};
+            GLfloat const variance {std::max(moments[pixel] / n - mean * mean, 0.0f)};
+            GLfloat const error {std::sqrt(variance / n) / (mean + SampleBudget::ERROR_FLOOR)};
+            if (!(error <= threshold)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+vec3 CPUTracer::ray_color(Ray ray, RNG& rng, SampleBudget const& budget,
+                          uint64_t& rays) const {
+    vec3 color {1.0, 1.0, 1.0};
+    vec3 radiance {0.0, 0.0, 0.0};
+    // Density of the direction sampled by the surface, 0 where the lights
+    // could not have been sampled
+    GLfloat bsdf_pdf {0.0};
+
+    for (GLint i = 0; i < budget.max_bounce; i++) {
+        Hit hit {};
+        rays++;
+        if (!trace_scene(ray, hit)) {
+            GLfloat const a {0.5f * (ray.dir.y + 1.0f)};
+            vec3 const sky {vec3(1.0, 1.0, 1.0) * (1.0f - a) + vec3(0.4, 0.6, 1.0) * a};
+            return radiance + color * sky;
+        }
+
+        Material const& material {hit.material};
+        if (material.material == static_cast<GLint>(Material::EMISSIVE)) {
+            if (hit.front_face) {
+                GLfloat const weight {bsdf_pdf > 0.0f
+                    ? power_heuristic(bsdf_pdf, emitter_pdf(hit, ray)) : 1.0f};
+                radiance += color * material.albedo * weight;
+            }
+            return radiance;
+        }
+
+        // The same draws every bounce as the shader, a pair for the
+        // direction, a pair for the choices and with emitters a pair for
+        // the light sample
+        GLfloat const u_scatter[2] {rng.next(), rng.next()};
+        GLfloat const u_choice[2] {rng.next(), rng.next()};
+        GLfloat u_light[2] {};
+        if (emissive) {
+            u_light[0] = rng.next();
+            u_light[1] = rng.next();
+        }
+        bsdf_pdf = 0.0;
+
+        vec3 scatter {};
+        if (material.material == Material::LAMBERTIAN) {
+            scatter = sample_cosine_hemisphere(hit.normal, u_scatter[0], u_scatter[1]);
+            if (emissive) {
+                radiance += color * material.albedo * sample_lights(hit, u_choice[0], u_light, rays);
+                bsdf_pdf = std::max(hit.normal.dot(scatter), 0.0f) / static_cast<GLfloat>(M_PI);
+            }
+        } else if (material.material == Material::METAL) {
+            scatter = reflect(ray.dir, hit.normal) +
+                      sample_sphere(u_scatter[0], u_scatter[1]) * material.fuzz;
+        } else if (material.material == Material::DIELECTRIC) {
+            GLfloat const cos_theta {std::min((-ray.dir).dot(hit.normal), 1.0f)};
+            GLfloat const sin_theta {std::sqrt(1.0f - cos_theta * cos_theta)};
+            GLfloat const ri {hit.front_face ? (1.0f / material.ri) : material.ri};
+            bool const can_refract {ri * sin_theta <= 1.0};
+
+            scatter = can_refract && reflectance(cos_theta, ri) < u_choice[0]
+                ? refract(ray.dir, hit.normal, ri)
+                : reflect(ray.dir, hit.normal);
+        }
+
+        ray = {hit.p, scatter};
+        color = color * material.albedo;
+
+        // Russian roulette, as in the shader
+        if (i >= budget.roulette_depth) {
+            GLfloat const survival {std::min(std::max({color.x, color.y, color.z}), 0.95f)};
+            if (u_choice[1] >= survival) {
+                return radiance;
+            }
+            color = color / survival;
+        }
+    }
+
+    return radiance + color;
+}
+
+/*
+ * sample_lights - Estimate the light arriving directly from the lights at a
+ *                 diffuse hit with a shadow ray, weighted against sampling
+ *                 the same direction by the surface, as the shader does
+ *
+ * Returns: The reflected radiance, to be multiplied by the albedo
+ */
+vec3 CPUTracer::sample_lights(Hit const& hit, GLfloat u_pick, GLfloat const u[2],
+                              uint64_t& rays) const {
+    if (lights.lights.empty()) {
+        return {0.0, 0.0, 0.0};
+    }
+
+    auto found = std::upper_bound(lights.lights.begin(), lights.lights.end(), u_pick,
+                                  [](GLfloat value, Light const& light) {
+                                      return value < light.cdf;
+                                  });
+    Light const& light {found == lights.lights.end() ? lights.lights.back() : *found};
+
+    vec3 dir {};
+    GLfloat pdf {0.0};
+    GLfloat power {0.0};
+    if (light.type == Light::SPHERE) {
+        // Uniform over the cone of directions the sphere subtends
+        Sphere const& sphere {spheres[light.index]};
+        pdf = sphere_light_pdf(sphere, hit.p);
+        if (pdf > 0.0f) {
+            vec3 const to_center {sphere.center - hit.p};
+            GLfloat const dist {to_center.length()};
+            GLfloat const cos_max {std::sqrt(1.0f - sphere.radius * sphere.radius /
+                                                        (dist * dist))};
+            GLfloat const cos_theta {1.0f - u[0] * (1.0f - cos_max)};
+            GLfloat const sin_theta {std::sqrt(std::max(1.0f - cos_theta * cos_theta, 0.0f))};
+            GLfloat const phi {2.0f * static_cast<GLfloat>(M_PI) * u[1]};
+            dir = local_to_world(to_center / dist, {sin_theta * std::cos(phi),
+                                                    sin_theta * std::sin(phi), cos_theta});
+            dir = dir / dir.length();
+        }
+        power = Light::power(sphere.material, sphere.area());
+    } else {
+        // Uniform over the area of the quad
+        Quad const& quad {quads[light.index]};
+        vec3 const to_point {quad.Q + quad.u * u[0] + quad.v * u[1] - hit.p};
+        GLfloat const dist {to_point.length()};
+        dir = to_point / dist;
+        pdf = quad_light_pdf(quad, dir, dist);
+        power = Light::power(quad.material, quad.area());
+    }
+
+    GLfloat const cos_surface {hit.normal.dot(dir)};
+    if (pdf <= 0.0f || cos_surface <= 0.0f) {
+        return {0.0, 0.0, 0.0};
+    }
+
+    // The light is only seen if it is the first thing along the shadow ray,
+    // and from its emitting side
+    Hit shadow {};
+    rays++;
+    if (!trace_scene({hit.p, dir}, shadow) || shadow.type != light.type ||
+        shadow.index != light.index || !shadow.front_face) {
+        return {0.0, 0.0, 0.0};
+    }
+
+    GLfloat const light_pdf {power / lights.total_power * pdf};
+    GLfloat const bsdf_pdf {cos_surface / static_cast<GLfloat>(M_PI)};
+    return shadow.material.albedo * (bsdf_pdf * power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+}
+
+/* Returns: The solid angle density with which light sampling would have
+ *          chosen the direction of a ray that hit an emitter, 0 for
+ *          emitters not in the lights */
+GLfloat CPUTracer::emitter_pdf(Hit const& hit, Ray const& ray) const {
+    if (lights.total_power <= 0.0f) {
+        return 0.0;
+    }
+    if (hit.type == BVH::SPHERE) {
+        Sphere const& sphere {spheres[hit.index]};
+        return Light::power(sphere.material, sphere.area()) / lights.total_power *
+               sphere_light_pdf(sphere, ray.origin);
+    }
+    if (hit.type == BVH::QUAD) {
+        Quad const& quad {quads[hit.index]};
+        return Light::power(quad.material, quad.area()) / lights.total_power *
+               quad_light_pdf(quad, ray.dir, hit.t);
+    }
+    return 0.0;
+}
+
+/*
+ * trace_scene - Find the closest hit along a ray, walking the BVH front to
+ *               back like the shader does
+ *
+ * Returns: Whether anything was hit, with the details in @hit
+ */
+bool CPUTracer::trace_scene(Ray const& ray, Hit& hit) const {
+    GLfloat dist {RAY_MAX_DIST};
+    bool found {false};
+
+    // The ground plane
+    GLfloat const denom {PLANE_NORMAL.dot(ray.dir)};
+    if (ground_plane && std::abs(denom) >= 1e-6) {
+        GLfloat const t {(PLANE_POINT - ray.origin).dot(PLANE_NORMAL) / denom};
+        if (RAY_MIN_DIST <= t && t < dist) {
+            dist = t;
+            found = true;
+            hit = {ray_at(ray.origin, ray.dir, t), PLANE_NORMAL, t,
+                   ray.dir.dot(PLANE_NORMAL) < 0, PLANE_MATERIAL};
+        }
+    }
+
+    if (bvh.nodes.empty()) {
+        return found;
+    }
+
+    vec3 const inv_dir {1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z};
+    size_t stack[BVH_STACK_SIZE];
+    GLfloat stack_dist[BVH_STACK_SIZE];
+    size_t sp {1};
+    stack[0] = 0;
+    stack_dist[0] = aabb_hit(bvh.nodes[0], ray.origin, inv_dir, dist);
+    // Type and SoA slot of the closest primitive found so far
+    GLint hit_type {-1};
+    GLint hit_slot {-1};
+    GLint hit_triangle {-1};
+
+    while (sp > 0) {
+        sp--;
+        size_t const index {stack[sp]};
+        if (stack_dist[sp] >= dist) {
+            continue;
+        }
+
+        BVHNode const& node {bvh.nodes[index]};
+        if (node.count > 0) {
+            // The leaf's spheres and quads are each one run of SoA slots
+            size_t const first {static_cast<size_t>(node.offset)};
+            size_t const last {first + node.count};
+            GLint slot {-1};
+            soa.intersect_spheres(soa.sphere_slot(first), soa.sphere_slot(last),
+                                  ray.origin, ray.dir, dist, slot);
+            if (slot >= 0) {
+                hit_type = BVH::SPHERE;
+                hit_slot = slot;
+                slot = -1;
+            }
+            soa.intersect_quads(soa.quad_slot(first), soa.quad_slot(last),
+                                ray.origin, ray.dir, dist, slot);
+            if (slot >= 0) {
+                hit_type = BVH::QUAD;
+                hit_slot = slot;
+            }
+
+            // Instances move the ray into the space of their mesh and walk
+            // its own hierarchy
+            for (size_t i = first; i < last && !meshes.instances.empty(); i++) {
+                if (BVH::ref_type(bvh.refs[i]) != BVH::INSTANCE) {
+                    continue;
+                }
+                GLint const instance_index {BVH::ref_index(bvh.refs[i])};
+                Instance const& instance {meshes.instances[instance_index]};
+                Ray const local {instance.to_object_point(ray.origin),
+                                 instance.to_object_vector(ray.dir)};
+                vec3 const local_inv_dir {1.0f / local.dir.x, 1.0f / local.dir.y,
+                                          1.0f / local.dir.z};
+
+                GLint triangle {-1};
+                GLfloat const t {mesh_hit(meshes.meshes[instance.mesh], local,
+                                          RayShear(local.dir), local_inv_dir, dist, triangle)};
+                if (triangle >= 0) {
+                    dist = t;
+                    hit_type = BVH::INSTANCE;
+                    hit_slot = instance_index;
+                    hit_triangle = triangle;
+                }
+            }
+            continue;
+        }
+
+        size_t left {index + 1};
+        size_t right {static_cast<size_t>(node.offset)};
+        GLfloat t_left {aabb_hit(bvh.nodes[left], ray.origin, inv_dir, dist)};
+        GLfloat t_right {aabb_hit(bvh.nodes[right], ray.origin, inv_dir, dist)};
+
+        // Push the far child first so the near one is visited next
+        if (t_left > t_right) {
+            std::swap(left, right);
+            std::swap(t_left, t_right);
+        }
+        if (t_right < FAR) {
+            stack[sp] = right;
+            stack_dist[sp++] = t_right;
+        }
+        if (t_left < FAR) {
+            stack[sp] = left;
+            stack_dist[sp++] = t_left;
+        }
+    }
+
+    if (hit_slot < 0) {
+        return found;
+    }
+
+    vec3 const p {ray_at(ray.origin, ray.dir, dist)};
+    if (hit_type == BVH::SPHERE) {
+        GLint const index {soa.sphere_index[hit_slot]};
+        Sphere const& sphere {spheres[index]};
+        vec3 const outward {(p - sphere.center) / (p - sphere.center).length()};
+        bool const front_face {ray.dir.dot(outward) < 0};
+        hit = {p, front_face ? outward : -outward, dist, front_face, sphere.material,
+               BVH::SPHERE, index};
+    } else if (hit_type == BVH::QUAD) {
+        // The front of a quad faces along u x v
+        GLint const index {soa.quad_index[hit_slot]};
+        Quad const& quad {quads[index]};
+        vec3 const n {quad.u.cross(quad.v)};
+        vec3 const outward {n / n.length()};
+        bool const front_face {ray.dir.dot(outward) < 0};
+        hit = {p, front_face ? outward : -outward, dist, front_face, quad.material,
+               BVH::QUAD, index};
+    } else {
+        Instance const& instance {meshes.instances[hit_slot]};
+        MeshTriangle const& triangle {meshes.triangles[hit_triangle]};
+        vec3 const v0 {meshes.vertices[triangle.v[0]].p};
+        vec3 const n {(meshes.vertices[triangle.v[1]].p - v0).cross(
+            meshes.vertices[triangle.v[2]].p - v0)};
+        vec3 const outward {instance.normal_to_world(n)};
+        bool const front_face {ray.dir.dot(outward) < 0};
+        hit = {p, front_face ? outward : -outward, dist, front_face, instance.material,
+               BVH::INSTANCE, hit_slot};
+    }
+    return true;
+}
+
+/*
+ * mesh_hit - Find the closest triangle of a mesh along a ray in the mesh's
+ *            space, walking its BVH the same way as the scene's
+ *
+ * Returns: The distance to the triangle, with its index in @triangle, or
+ *          @dist with @triangle untouched on a miss
+ */
+GLfloat CPUTracer::mesh_hit(Mesh const& mesh, Ray const& ray, RayShear const& shear,
+                            vec3 const& inv_dir, GLfloat dist, GLint& triangle) const {
+    size_t stack[BVH_STACK_SIZE];
+    GLfloat stack_dist[BVH_STACK_SIZE];
+    size_t sp {1};
+    stack[0] = mesh.root;
+    stack_dist[0] = aabb_hit(meshes.nodes[mesh.root], ray.origin, inv_dir, dist);
+
+    while (sp > 0) {
+        sp--;
+        size_t const index {stack[sp]};
+        if (stack_dist[sp] >= dist) {
+            continue;
+        }
+
+        BVHNode const& node {meshes.nodes[index]};
+        if (node.count > 0) {
+            for (GLint i = node.offset; i < node.offset + node.count; i++) {
+                MeshTriangle const& tri {meshes.triangles[i]};
+                GLfloat const t {shear.triangle_hit(ray.origin, meshes.vertices[tri.v[0]].p,
+                                                    meshes.vertices[tri.v[1]].p,
+                                                    meshes.vertices[tri.v[2]].p)};
+                if (RAY_MIN_DIST <= t && t < dist) {
+                    dist = t;
+                    triangle = i;
+                }
+            }
+            continue;
+        }
+
+        size_t left {index + 1};
+        size_t right {static_cast<size_t>(node.offset)};
+        GLfloat t_left {aabb_hit(meshes.nodes[left], ray.origin, inv_dir, dist)};
+        GLfloat t_right {aabb_hit(meshes.nodes[right], ray.origin, inv_dir, dist)};
+
+        if (t_left > t_right) {
+            std::swap(left, right);
+            std::swap(t_left, t_right);
+        }
+        if (t_right < FAR) {
+            stack[sp] = right;
+            stack_dist[sp++] = t_right;
+        }
+        if (t_left < FAR) {
+            stack[sp] = left;
+            stack_dist[sp++] = t_left;
+        }
+    }
+    return dist;
+}
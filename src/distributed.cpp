@@ -0,0 +1,556 @@
+#include "distributed.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Distributed {
+    using Clock = std::chrono::steady_clock;
+
+    // Rows of the image in each job, a multiple of the tiles the tracers
+    // work in. Jobs span whole rows, which the waves of the wavefront backend
+    // run along.
+    static GLint const JOB_ROWS {128};
+    // Sample ranges the frames of every band of rows are split into, so
+    // there is work for more workers than there are bands
+    static GLuint const JOB_RANGES {4};
+    // A job running this many times longer than the median finished job is
+    // handed to an idle worker as well, and counts once either finishes
+    static double const SLOW_FACTOR {3.0};
+    // Seconds to wait with jobs left but no worker connected
+    static double const WORKER_TIMEOUT {30.0};
+    // Milliseconds between checks for slow jobs while nothing arrives
+    static int const POLL_INTERVAL {100};
+
+    static uint32_t const MAGIC {0x31575452}; // "RTW1"
+
+    /* Sent by a worker once it is ready, describing what it renders */
+    struct Hello {
+        uint32_t magic;
+        int32_t width, height;
+        int32_t samples, max_bounce, roulette_depth;
+        uint32_t sampler, backend;
+        uint64_t scene_hash;
+    };
+
+    /* A tile and range of frames to accumulate */
+    struct Job {
+        uint32_t id;
+        int32_t x, y, width, height;
+        uint32_t first_frame, frames;
+    };
+
+    /* Precedes the accumulated tile a worker sends back */
+    struct Result {
+        uint32_t id;
+        uint32_t floats; // RGBA floats of the tile that follow
+    };
+
+    /* A connection to a worker, as seen by the coordinator */
+    struct Worker {
+        int socket;
+        bool ready; // Said hello and renders the same image
+        std::vector<char> received; // Bytes not yet making up a message
+        GLint job; // Running, -1 for none
+    };
+
+    /* How far along a job is */
+    struct Progress {
+        bool done;
+        GLint runners; // Workers tracing it
+        Clock::time_point started; // By the first of them
+    };
+
+    /*
+     * send_all - Send the whole of a buffer
+     *
+     * Returns: false if the connection is gone
+     */
+    static bool send_all(int socket, void const* data, size_t size) {
+        char const* bytes {static_cast<char const*>(data)};
+        while (size > 0) {
+            ssize_t const sent {send(socket, bytes, size, MSG_NOSIGNAL)};
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    /*
+     * receive_all - Fill the whole of a buffer
+     *
+     * Returns: false if the connection closed first
+     */
+    static bool receive_all(int socket, void* data, size_t size) {
+        char* bytes {static_cast<char*>(data)};
+        while (size > 0) {
+            ssize_t const received {recv(socket, bytes, size, 0)};
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    /* Returns: A hash of the scene file, 0 for the built in scene */
+    static uint64_t scene_hash(std::string const& path) {
+        if (path.empty()) {
+            return 0;
+        }
+        std::ifstream file {path, std::ios::binary};
+        if (!file) {
+            throw std::runtime_error("Failed to open scene " + path);
+        }
+
+        // FNV-1a
+        uint64_t hash {0xcbf29ce484222325};
+        for (auto it = std::istreambuf_iterator<char> {file};
+             it != std::istreambuf_iterator<char> {}; ++it) {
+            hash = (hash ^ static_cast<unsigned char>(*it)) * 0x100000001b3;
+        }
+        return hash;
+    }
+
+    /* Returns: What this process renders, for a worker to send or the
+     * coordinator to compare against */
+    static Hello describe(Renderer::Settings const& settings) {
+        return {MAGIC, GL::WIDTH, GL::HEIGHT, settings.budget.samples,
+                settings.budget.max_bounce, settings.budget.roulette_depth,
+                static_cast<uint32_t>(settings.sampler),
+                static_cast<uint32_t>(settings.backend), scene_hash(settings.scene)};
+    }
+
+    /* Returns: The settings with what a tile of a distributed render cannot
+     * do switched off */
+    static Renderer::Settings distributable(Renderer::Settings settings) {
+        // The sample mask and the denoiser look at the whole image
+        if (settings.budget.error_threshold > 0.0f) {
+            std::cerr << "Adaptive sampling is off in distributed renders" << std::endl;
+            settings.budget.error_threshold = 0.0f;
+        }
+        if (settings.denoise) {
+            std::cerr << "Denoising is off in distributed renders" << std::endl;
+            settings.denoise = false;
+        }
+        settings.headless = true;
+        return settings;
+    }
+
+    /* Returns: The jobs of a render, every band of every sample range */
+    static std::vector<Job> split_jobs(GLuint frames) {
+        GLuint const ranges {std::min(frames, JOB_RANGES)};
+        std::vector<Job> jobs {};
+        for (GLuint range = 0; range < ranges; range++) {
+            GLuint const first {frames * range / ranges};
+            GLuint const last {frames * (range + 1) / ranges};
+            for (GLint y = 0; y < GL::HEIGHT; y += JOB_ROWS) {
+                jobs.push_back({static_cast<uint32_t>(jobs.size()), 0, y, GL::WIDTH,
+                                std::min(JOB_ROWS, GL::HEIGHT - y), first, last - first});
+            }
+        }
+        return jobs;
+    }
+
+    /*
+     * listen_on - Open a socket for workers to connect to
+     *
+     * @port: Port to listen on, 0 for any free one. Set to the one taken.
+     *
+     * Returns: The listening socket
+     */
+    static int listen_on(GLint& port) {
+        // Kept from the workers this process starts
+        int const listener {socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        int const reuse {1};
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        socklen_t length {sizeof(address)};
+        if (listener < 0 ||
+            bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            listen(listener, SOMAXCONN) < 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+            throw std::runtime_error("Failed to listen on port " + std::to_string(port) +
+                                     ": " + std::strerror(errno));
+        }
+        port = ntohs(address.sin_port);
+        return listener;
+    }
+
+    /* Returns: A socket connected to host:port */
+    static int connect_to(std::string const& address) {
+        size_t const colon {address.rfind(':')};
+        if (colon == std::string::npos) {
+            throw std::runtime_error("Expected a coordinator as host:port, got " + address);
+        }
+
+        addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found {};
+        if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(),
+                        &hints, &found) != 0) {
+            throw std::runtime_error("Failed to look up coordinator " + address);
+        }
+
+        int connected {-1};
+        for (addrinfo* info = found; info && connected < 0; info = info->ai_next) {
+            connected = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (connected >= 0 && connect(connected, info->ai_addr, info->ai_addrlen) < 0) {
+                close(connected);
+                connected = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (connected < 0) {
+            throw std::runtime_error("Failed to connect to coordinator " + address);
+        }
+        return connected;
+    }
+
+    /* Start workers on this machine, the same program with the same render
+     * options pointed at the coordinator
+     *
+     * Returns: Their process ids */
+    static std::vector<pid_t> spawn_workers(std::vector<std::string> command, GLint port,
+                                            size_t count) {
+        command.push_back("--worker");
+        command.push_back("127.0.0.1:" + std::to_string(port));
+        std::vector<char*> argv {};
+        for (std::string& argument : command) {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+
+        std::vector<pid_t> children {};
+        for (size_t i = 0; i < count; i++) {
+            pid_t const child {fork()};
+            if (child < 0) {
+                throw std::runtime_error(std::string {"Failed to start a worker: "} +
+                                         std::strerror(errno));
+            }
+            if (child == 0) {
+                execvp(argv[0], argv.data());
+                std::cerr << "Failed to start worker " << argv[0] << std::endl;
+                _exit(EXIT_FAILURE);
+            }
+            children.push_back(child);
+        }
+        return children;
+    }
+
+    /* Add a tile onto the accumulation of the whole image. The tiles hold
+     * sums with the sample count in alpha, so adding them weighs every
+     * sample range by its samples. */
+    static void merge(std::vector<GLfloat>& accum, Job const& job, GLfloat const* tile) {
+        for (GLint row = 0; row < job.height; row++) {
+            GLfloat* const out {&accum[((job.y + row) * GL::WIDTH + job.x) * 4]};
+            GLfloat const* const in {&tile[row * job.width * 4]};
+            for (GLint i = 0; i < job.width * 4; i++) {
+                out[i] += in[i];
+            }
+        }
+    }
+
+    /* Render by handing out jobs to workers as they become idle. A worker
+     * that disconnects has its job handed to another, and once no jobs are
+     * left idle workers take on the jobs running much longer than the
+     * rest, in case their worker is stuck or slow. */
+    int coordinate(Renderer::Settings const& settings,
+                   std::vector<std::string> const& worker_command) {
+        Renderer::Settings const render {distributable(settings)};
+        Hello const expected {describe(render)};
+        std::vector<Job> const jobs {split_jobs(render.frames)};
+
+        GLint port {render.coordinate_port};
+        int const listener {listen_on(port)};
+        std::cout << "Waiting for workers on port " << port << std::endl;
+        std::vector<pid_t> const children {
+            spawn_workers(worker_command, port, render.local_workers)};
+
+        // Only presents the image at the end
+        if (!Renderer::setup_headless(render)) {
+            close(listener);
+            for (pid_t const child : children) {
+                kill(child, SIGTERM);
+                waitpid(child, nullptr, 0);
+            }
+            return EXIT_FAILURE;
+        }
+
+        auto const start {Clock::now()};
+        std::vector<GLfloat> accum(static_cast<size_t>(GL::WIDTH) * GL::HEIGHT * 4);
+        std::deque<GLint> pending {};
+        for (Job const& job : jobs) {
+            pending.push_back(job.id);
+        }
+        std::vector<Progress> progress(jobs.size());
+        std::vector<double> durations {};
+        std::vector<Worker> workers {};
+        size_t connected {};
+        auto idle_since {start};
+
+        // Hand a job back to the queue when the worker tracing it is gone
+        auto const drop = [&](Worker& worker) {
+            close(worker.socket);
+            worker.socket = -1;
+            if (worker.job >= 0) {
+                Progress& job {progress[worker.job]};
+                job.runners--;
+                if (!job.done && job.runners == 0) {
+                    std::cerr << "Lost a worker, handing its job to another" << std::endl;
+                    pending.push_front(worker.job);
+                }
+            }
+        };
+
+        // Take in what a worker sent, returning false if it broke off
+        auto const receive = [&](Worker& worker) {
+            char buffer[1 << 16];
+            ssize_t const received {recv(worker.socket, buffer, sizeof(buffer), 0)};
+            if (received < 0 && errno == EINTR) {
+                return true;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            worker.received.insert(worker.received.end(), buffer, buffer + received);
+
+            if (!worker.ready && worker.received.size() >= sizeof(Hello)) {
+                Hello hello {};
+                std::memcpy(&hello, worker.received.data(), sizeof(hello));
+                worker.received.erase(worker.received.begin(),
+                                      worker.received.begin() + sizeof(hello));
+                if (hello.magic != expected.magic || hello.width != expected.width ||
+                    hello.height != expected.height || hello.samples != expected.samples ||
+                    hello.max_bounce != expected.max_bounce ||
+                    hello.roulette_depth != expected.roulette_depth ||
+                    hello.sampler != expected.sampler || hello.backend != expected.backend ||
+                    hello.scene_hash != expected.scene_hash) {
+                    std::cerr << "Turned away a worker rendering another scene, sample budget, "
+                                 "sampler or backend" << std::endl;
+                    return false;
+                }
+                worker.ready = true;
+                connected++;
+            }
+
+            if (worker.job < 0 || worker.received.size() < sizeof(Result)) {
+                return true;
+            }
+            Result result {};
+            std::memcpy(&result, worker.received.data(), sizeof(result));
+            Job const& job {jobs[worker.job]};
+            size_t const floats {static_cast<size_t>(job.width) * job.height * 4};
+            if (result.id != job.id || result.floats != floats) {
+                std::cerr << "Turned away a worker sending another job than it was given"
+                          << std::endl;
+                return false;
+            }
+            size_t const size {sizeof(result) + floats * sizeof(GLfloat)};
+            if (worker.received.size() < size) {
+                return true;
+            }
+
+            // The first of the workers running a job to finish it counts
+            Progress& job_progress {progress[worker.job]};
+            job_progress.runners--;
+            if (!job_progress.done) {
+                std::vector<GLfloat> tile(floats);
+                std::memcpy(tile.data(), worker.received.data() + sizeof(result),
+                            floats * sizeof(GLfloat));
+                merge(accum, job, tile.data());
+                job_progress.done = true;
+                durations.push_back(
+                    std::chrono::duration<double>(Clock::now() - job_progress.started).count());
+            }
+            worker.received.erase(worker.received.begin(), worker.received.begin() + size);
+            worker.job = -1;
+            return true;
+        };
+
+        /* Hang up on the workers and wait for the local ones to exit, which
+         * they do on their own once the coordinator is gone. When giving up
+         * the local ones are stopped rather than waited on mid job. */
+        auto const hang_up = [&](bool stop) {
+            for (Worker const& worker : workers) {
+                close(worker.socket);
+            }
+            workers.clear();
+            close(listener);
+            for (pid_t const child : children) {
+                if (stop) {
+                    kill(child, SIGTERM);
+                }
+                waitpid(child, nullptr, 0);
+            }
+        };
+
+        // Returns: A job that ought to have finished by now, -1 if none
+        auto const straggler = [&](Clock::time_point now) {
+            if (durations.empty()) {
+                return -1;
+            }
+            std::vector<double> sorted {durations};
+            std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+            double const limit {SLOW_FACTOR * sorted[sorted.size() / 2]};
+
+            GLint slowest {-1};
+            for (Job const& job : jobs) {
+                Progress const& job_progress {progress[job.id]};
+                if (!job_progress.done && job_progress.runners == 1 &&
+                    std::chrono::duration<double>(now - job_progress.started).count() > limit &&
+                    (slowest < 0 || job_progress.started < progress[slowest].started)) {
+                    slowest = job.id;
+                }
+            }
+            return slowest;
+        };
+
+        while (durations.size() < jobs.size()) {
+            std::vector<pollfd> polled {{listener, POLLIN, 0}};
+            for (Worker const& worker : workers) {
+                polled.push_back({worker.socket, POLLIN, 0});
+            }
+            if (poll(polled.data(), polled.size(), POLL_INTERVAL) < 0 && errno != EINTR) {
+                std::string const error {std::strerror(errno)};
+                hang_up(true);
+                GL::terminate_headless();
+                throw std::runtime_error("Failed to wait for workers: " + error);
+            }
+
+            for (size_t i = 1; i < polled.size(); i++) {
+                if (polled[i].revents && !receive(workers[i - 1])) {
+                    drop(workers[i - 1]);
+                }
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                         [](Worker const& worker) { return worker.socket < 0; }),
+                          workers.end());
+
+            if (polled[0].revents & POLLIN) {
+                int const socket {accept(listener, nullptr, nullptr)};
+                if (socket >= 0) {
+                    int const no_delay {1};
+                    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+                    workers.push_back({socket, false, {}, -1});
+                }
+            }
+
+            auto const now {Clock::now()};
+            for (Worker& worker : workers) {
+                if (!worker.ready || worker.job >= 0) {
+                    continue;
+                }
+                GLint next {-1};
+                if (!pending.empty()) {
+                    next = pending.front();
+                    pending.pop_front();
+                } else {
+                    next = straggler(now);
+                }
+                if (next < 0) {
+                    break;
+                }
+
+                Progress& job_progress {progress[next]};
+                if (job_progress.runners == 0) {
+                    job_progress.started = now;
+                }
+                job_progress.runners++;
+                worker.job = next;
+                if (!send_all(worker.socket, &jobs[next], sizeof(Job))) {
+                    drop(worker);
+                }
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                         [](Worker const& worker) { return worker.socket < 0; }),
+                          workers.end());
+
+            if (std::any_of(workers.begin(), workers.end(),
+                            [](Worker const& worker) { return worker.ready; })) {
+                idle_since = now;
+            } else if (std::chrono::duration<double>(now - idle_since).count() > WORKER_TIMEOUT) {
+                hang_up(true);
+                GL::terminate_headless();
+                throw std::runtime_error("No workers to render with");
+            }
+        }
+
+        hang_up(false);
+
+        double const elapsed {std::chrono::duration<double>(Clock::now() - start).count()};
+        int status {EXIT_SUCCESS};
+        try {
+            Renderer::save_accumulation(accum);
+            std::cout << "Rendered " << render.frames << " frames in " << elapsed << " s ("
+                      << render.frames / elapsed << " frames/s) with " << connected
+                      << " workers to " << render.output << std::endl;
+            if (!render.stats.empty()) {
+                Renderer::write_stats(render.stats, elapsed);
+            }
+        } catch (std::runtime_error const& e) {
+            std::cerr << e.what() << std::endl;
+            status = EXIT_FAILURE;
+        }
+
+        GL::terminate_headless();
+        return status;
+    }
+
+    /* Trace the jobs a coordinator hands out until it hangs up */
+    int work(Renderer::Settings const& settings) {
+        Renderer::Settings const render {distributable(settings)};
+        Hello const hello {describe(render)};
+        if (!Renderer::setup_headless(render)) {
+            return EXIT_FAILURE;
+        }
+
+        int const socket {connect_to(render.coordinator)};
+        int const no_delay {1};
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        size_t traced {};
+        Job job {};
+        bool connected {send_all(socket, &hello, sizeof(hello))};
+        while (connected && receive_all(socket, &job, sizeof(job))) {
+            std::vector<GLfloat> const pixels {Renderer::trace_region(
+                {job.x, job.y, job.width, job.height}, job.first_frame, job.frames)};
+            Result const result {job.id, static_cast<uint32_t>(pixels.size())};
+            connected = send_all(socket, &result, sizeof(result)) &&
+                        send_all(socket, pixels.data(), pixels.size() * sizeof(GLfloat));
+            traced++;
+        }
+        close(socket);
+
+        std::cout << "Traced " << traced << " jobs for " << render.coordinator << std::endl;
+        GL::terminate_headless();
+        return EXIT_SUCCESS;
+    }
+};
@@ -1,17 +1,40 @@
 #include "gl.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <unistd.h>
 
 namespace GL {
 
-GLFWwindow* init() {
+// The offscreen context used when running without a window
+static EGLDisplay egl_display {EGL_NO_DISPLAY};
+static EGLContext egl_context {EGL_NO_CONTEXT};
+
+// Where linked program binaries are kept between runs, empty to not keep them
+static std::string program_cache_dir {};
+// Marks the start of a cached program binary, followed by its format
+static uint32_t const PROGRAM_CACHE_MAGIC {0x42505452}; // "RTPB"
+
+/* Open the window and its context, a core profile context of at least the
+ * given version unless the major version is 0 */
+GLFWwindow* init(int major, int minor) {
     // Initialize GLFW
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
         return nullptr;
     }
 
+    if (major > 0) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, major);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    }
+
     // Create a windowed mode window and its OpenGL context
     GLFWwindow* const window {glfwCreateWindow(WIDTH, HEIGHT, "Raytracer", nullptr, nullptr)};
     if (!window) {
@@ -25,6 +48,8 @@ GLFWwindow* init() {
     // Set the swap interval (VSync)
     glfwSwapInterval(1);
 
+    // Core profile contexts need this for GLEW to load all entry points
+    glewExperimental = GL_TRUE;
     GLenum err = glewInit();
     if (err != GLEW_OK) {
         std::cerr << "GLEW initialization failed: " << glewGetErrorString(err) << std::endl;
@@ -34,6 +59,110 @@ GLFWwindow* init() {
     return window;
 }
 
+/* Make a context sharing textures, buffers, programs and fences with the
+ * one of a window, for another thread to render with. It comes with a
+ * hidden window of its own, since GLFW has no contexts without one.
+ *
+ * Returns: The hidden window, nullptr on failure */
+GLFWwindow* create_shared_context(GLFWwindow* const window) {
+    // The version hints of init still apply
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* const context {glfwCreateWindow(1, 1, "", nullptr, window)};
+    glfwDefaultWindowHints();
+    if (!context) {
+        std::cerr << "Failed to create a shared context" << std::endl;
+    }
+    return context;
+}
+
+/* Create an offscreen core profile context of at least the given version */
+bool init_headless(int major, int minor) {
+    // Prefer the surfaceless platform so no display server is needed at all
+    auto const get_platform_display {reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"))};
+    egl_display = get_platform_display
+        ? get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr)
+        : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, nullptr, nullptr)) {
+        std::cerr << "Failed to initialize EGL" << std::endl;
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "EGL does not support desktop OpenGL" << std::endl;
+        terminate_headless();
+        return false;
+    }
+
+    EGLint const config_attribs[] {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config {};
+    EGLint num_configs {};
+    eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs);
+
+    EGLint const context_attribs[] {
+        EGL_CONTEXT_MAJOR_VERSION, major,
+        EGL_CONTEXT_MINOR_VERSION, minor,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    // Surfaceless platforms may not expose any config, which is fine since
+    // we never create a surface
+    egl_context = eglCreateContext(
+        egl_display, num_configs > 0 ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs
+    );
+
+    if (egl_context == EGL_NO_CONTEXT) {
+        std::cerr << "Failed to create EGL context" << std::endl;
+        terminate_headless();
+        return false;
+    }
+
+    // Everything is rendered into FBOs, so the context needs no surface
+    if (!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+        std::cerr << "Failed to make EGL context current" << std::endl;
+        terminate_headless();
+        return false;
+    }
+
+    // Core profile contexts need this for GLEW to load all entry points
+    glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLEW built for GLX complains about the missing X display, but the
+    // entry points are still loaded
+    if (err == GLEW_ERROR_NO_GLX_DISPLAY) {
+        err = GLEW_OK;
+    }
+#endif
+    if (err != GLEW_OK) {
+        std::cerr << "GLEW initialization failed: " << glewGetErrorString(err) << std::endl;
+        terminate_headless();
+        return false;
+    }
+
+    return true;
+}
+
+void terminate_headless() {
+    if (egl_display == EGL_NO_DISPLAY) {
+        return;
+    }
+
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (egl_context != EGL_NO_CONTEXT) {
+        eglDestroyContext(egl_display, egl_context);
+    }
+    eglTerminate(egl_display);
+
+    egl_display = EGL_NO_DISPLAY;
+    egl_context = EGL_NO_CONTEXT;
+}
+
 void run_loop(GLFWwindow* const window, std::function<void()> const& callback) {
     while (!glfwWindowShouldClose(window)) {
         callback();
@@ -73,7 +202,132 @@ GLuint compile_shader(std::string const& source, GLenum const type) {
     return shader;
 }
 
+/* 64-bit FNV-1a hash, good enough to tell shader sources apart */
+static uint64_t hash_string(std::string const& data, uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char const c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Returns: The file caching the program built from the sources with the
+ * current driver, or an empty path if programs are not cached */
+static std::string program_cache_path(std::string const& vertex_code,
+                                      std::string const& fragment_code) {
+    if (program_cache_dir.empty() || !GLEW_ARB_get_program_binary) {
+        return "";
+    }
+    GLint formats {};
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0) {
+        return "";
+    }
+
+    // A binary is only valid for the driver that produced it
+    std::string key {vertex_code + '\0' + fragment_code};
+    for (GLenum const name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+        char const* const value {reinterpret_cast<char const*>(glGetString(name))};
+        key += '\0' + std::string(value ? value : "");
+    }
+
+    std::ostringstream path {};
+    path << program_cache_dir << "/" << std::hex << hash_string(key) << ".bin";
+    return path.str();
+}
+
+/* Create a program from a cached binary
+ * Returns: The program, or 0 if there is no usable binary */
+static GLuint load_program_binary(std::string const& path) {
+    std::ifstream file {path, std::ios::binary};
+    if (!file.is_open()) {
+        return 0;
+    }
+
+    uint32_t magic {};
+    GLenum format {};
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&format), sizeof(format));
+    if (!file || magic != PROGRAM_CACHE_MAGIC) {
+        return 0;
+    }
+    std::vector<char> const binary {std::istreambuf_iterator<char>(file), {}};
+    if (binary.empty()) {
+        return 0;
+    }
+
+    GLuint const program {glCreateProgram()};
+    glProgramBinary(program, format, binary.data(), binary.size());
+
+    // Drivers reject binaries from other versions of themselves. The entry
+    // is left in place and overwritten once the program is compiled again.
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        while (glGetError() != GL_NO_ERROR) {}
+        glDeleteProgram(program);
+        std::cerr << "Cached program " << path << " was rejected, recompiling to overwrite it"
+                  << std::endl;
+        return 0;
+    }
+    return program;
+}
+
+/* Write the binary of a linked program to the cache. Other processes may
+ * be reading the same entry, so it is written aside and moved in place. */
+static void save_program_binary(GLuint program, std::string const& path) {
+    GLint length {};
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    GLenum format {};
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+    std::error_code error {};
+    std::filesystem::create_directories(program_cache_dir, error);
+    std::string const temp_path {path + "." + std::to_string(getpid()) + ".tmp"};
+    {
+        std::ofstream file {temp_path, std::ios::binary};
+        file.write(reinterpret_cast<char const*>(&PROGRAM_CACHE_MAGIC), sizeof(PROGRAM_CACHE_MAGIC));
+        file.write(reinterpret_cast<char const*>(&format), sizeof(format));
+        file.write(binary.data(), binary.size());
+        if (!file) {
+            std::cerr << "Failed to write program cache " << temp_path << std::endl;
+            std::filesystem::remove(temp_path, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temp_path, path, error);
+}
+
+/* Keep linked programs in a directory, so later runs with the same shaders
+ * and driver can skip compiling them. An empty path disables the cache. */
+void set_program_cache(std::string const& directory) {
+    program_cache_dir = directory;
+}
+
+/* Returns: The per user cache directory, or an empty path if the
+ * environment names none */
+std::string default_program_cache() {
+    if (char const* const xdg {std::getenv("XDG_CACHE_HOME")}; xdg && *xdg) {
+        return std::string(xdg) + "/raytracer";
+    }
+    if (char const* const home {std::getenv("HOME")}; home && *home) {
+        return std::string(home) + "/.cache/raytracer";
+    }
+    return "";
+}
+
 GLuint create_program(std::string const& vertex_code, std::string const& fragment_code) {
+    std::string const cache_path {program_cache_path(vertex_code, fragment_code)};
+    if (!cache_path.empty()) {
+        if (GLuint const program {load_program_binary(cache_path)}) {
+            return program;
+        }
+    }
+
     // Compile Shaders
     GLuint vertex_shader {compile_shader(vertex_code, GL_VERTEX_SHADER)};
     GLuint fragment_shader {compile_shader(fragment_code, GL_FRAGMENT_SHADER)};
@@ -82,6 +336,9 @@ GLuint create_program(std::string const& vertex_code, std::string const& fragmen
     GLuint const program {glCreateProgram()};
     glAttachShader(program, vertex_shader);
     glAttachShader(program, fragment_shader);
+    if (!cache_path.empty()) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
     glLinkProgram(program);
 
     // Check linking status
@@ -98,9 +355,179 @@ GLuint create_program(std::string const& vertex_code, std::string const& fragmen
     glDeleteShader(vertex_shader);
     glDeleteShader(fragment_shader);
 
+    if (!cache_path.empty()) {
+        save_program_binary(program, cache_path);
+    }
+    return program;
+}
+
+/* Compile and link a compute program, through the program cache like the
+ * others */
+GLuint create_compute_program(std::string const& compute_code) {
+    std::string const cache_path {program_cache_path("", compute_code)};
+    if (!cache_path.empty()) {
+        if (GLuint const program {load_program_binary(cache_path)}) {
+            return program;
+        }
+    }
+
+    GLuint const compute_shader {compile_shader(compute_code, GL_COMPUTE_SHADER)};
+
+    GLuint const program {glCreateProgram()};
+    glAttachShader(program, compute_shader);
+    if (!cache_path.empty()) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(program);
+
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetProgramInfoLog(program, 512, nullptr, infoLog);
+        std::cerr << "Program linking error: " << infoLog << std::endl;
+        throw std::runtime_error("Program linking failed");
+    }
+    glDeleteShader(compute_shader);
+
+    if (!cache_path.empty()) {
+        save_program_binary(program, cache_path);
+    }
     return program;
 }
 
+/* Insert #defines right after the #version line of a shader, keeping the
+ * line numbers of errors pointing into the original source.
+ *
+ * Returns: The source with the defines */
+std::string add_defines(std::string const& source, std::vector<std::string> const& defines) {
+    if (defines.empty()) {
+        return source;
+    }
+
+    size_t const version_end {source.find('\n') + 1};
+    std::string header {};
+    for (std::string const& define : defines) {
+        header += "#define " + define + "\n";
+    }
+    header += "#line 2\n";
+    return source.substr(0, version_end) + header + source.substr(version_end);
+}
+
+ProgramCache::ProgramCache(std::string const& vertex_code, std::string const& fragment_code)
+    : vertex_code{vertex_code}, fragment_code{fragment_code} {};
+
+ProgramCache::ProgramCache(std::string const& compute_code)
+    : compute_code{compute_code} {};
+
+/* Get the variant for a set of defines, compiling it the first time.
+ * Returns: The linked program */
+GLuint ProgramCache::get(std::vector<std::string> const& defines) {
+    std::string key {};
+    for (std::string const& define : defines) {
+        key += define + "\n";
+    }
+
+    auto const it {programs.find(key)};
+    if (it != programs.end()) {
+        return it->second;
+    }
+
+    GLuint const program {compute_code.empty()
+        ? create_program(add_defines(vertex_code, defines), add_defines(fragment_code, defines))
+        : create_compute_program(add_defines(compute_code, defines))};
+    programs.emplace(key, program);
+    return program;
+}
+
+size_t ProgramCache::size() const {
+    return programs.size();
+}
+
+void TimingHistory::add(double seconds) {
+    times.push_back(seconds);
+    if (times.size() > SIZE) {
+        times.pop_front();
+    }
+}
+
+/* Returns: The average and percentiles of the kept durations, all zero
+ * when there are none */
+TimingStats TimingHistory::stats() const {
+    if (times.empty()) {
+        return {0, 0.0, 0.0, 0.0, 0.0};
+    }
+
+    std::vector<double> sorted {times.begin(), times.end()};
+    std::sort(sorted.begin(), sorted.end());
+    auto const percentile = [&](double p) {
+        return sorted[std::min(static_cast<size_t>(p * sorted.size()), sorted.size() - 1)];
+    };
+
+    double sum {0.0};
+    for (double const time : sorted) {
+        sum += time;
+    }
+    return {sorted.size(), sum / sorted.size(), percentile(0.5), percentile(0.95),
+            percentile(0.99)};
+}
+
+/* Start timing the commands issued until end, unless every query of the
+ * ring is still waiting for its result */
+void GPUTimer::begin() {
+    if (queries.empty()) {
+        queries.resize(RING_SIZE);
+        work.resize(RING_SIZE);
+        glGenQueries(RING_SIZE, queries.data());
+    }
+
+    collect();
+    active = pending < RING_SIZE;
+    if (active) {
+        glBeginQuery(GL_TIME_ELAPSED, queries[(first + pending) % RING_SIZE]);
+    }
+}
+
+void GPUTimer::end(double work) {
+    if (active) {
+        this->work[(first + pending) % RING_SIZE] = work;
+        glEndQuery(GL_TIME_ELAPSED);
+        pending++;
+        active = false;
+    }
+}
+
+/* Read the results the GPU has finished, oldest first, without waiting on
+ * the ones it has not */
+void GPUTimer::collect() {
+    while (pending > 0) {
+        GLint available {};
+        glGetQueryObjectiv(queries[first], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            break;
+        }
+
+        GLuint64 nanoseconds {};
+        glGetQueryObjectui64v(queries[first], GL_QUERY_RESULT, &nanoseconds);
+        history.add(nanoseconds * 1e-9);
+        if (work[first] > 0.0) {
+            latest_rate = nanoseconds * 1e-9 / work[first];
+        }
+        first = (first + 1) % RING_SIZE;
+        pending--;
+    }
+}
+
+TimingStats GPUTimer::stats() const {
+    return history.stats();
+}
+
+/* Returns: Seconds per unit of work of the latest measured pass that did
+ * any, 0.0 until one is measured */
+double GPUTimer::rate() const {
+    return latest_rate;
+}
+
 GLuint create_program_from_file(std::string const& vertex_path, std::string const& fragment_path) {
     // Read shader files
     std::string const vertex_code {read_file(vertex_path)};
@@ -108,32 +535,75 @@ GLuint create_program_from_file(std::string const& vertex_path, std::string cons
     return create_program(vertex_code, fragment_code);
 }
 
-FBO create_fbo() {
+FBO create_fbo(GLint internal_format, GLsizei width, GLsizei height) {
     GLuint fbo;
-    GLuint texture;
 
     // Generate the frame buffer
     glGenFramebuffers(1, &fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    GLuint const texture {attach_texture({fbo, 0}, GL_COLOR_ATTACHMENT0, internal_format,
+                                         width, height)};
+
+    // NOTE: No depth/stencil since I don't need it
+
+    return {fbo, texture};
+}
+
+/* Render into one more texture from a frame buffer, for shaders with
+ * several outputs. Returns: The new texture */
+GLuint attach_texture(FBO const& fbo, GLenum attachment, GLint internal_format,
+                      GLsizei width, GLsizei height) {
+    GLuint texture;
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo.fbo);
 
     // Generate the texture
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, WIDTH, HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
-
-    // NOTE: No depth/stencil since I don't need it
+    glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture, 0);
 
     if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        std::cerr << "Framebuffer " << fbo << " is not complete!" << std::endl;
+        std::cerr << "Framebuffer " << fbo.fbo << " is not complete!" << std::endl;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return texture;
+}
+
+void save_fbo(FBO const& fbo, std::string const& file_path) {
+    std::vector<unsigned char> pixels(WIDTH * HEIGHT * 3);
+
+    fbo.use();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    std::ofstream ofs {file_path, std::ios::binary};
+    if (!ofs.is_open()) {
+        throw std::runtime_error("Failed to open image file: " + file_path);
     }
 
+    // Binary PPM, with the rows flipped since OpenGL starts at the bottom
+    ofs << "P6\n" << WIDTH << " " << HEIGHT << "\n255\n";
+    for (int y = HEIGHT - 1; y >= 0; y--) {
+        ofs.write(reinterpret_cast<char const*>(&pixels[y * WIDTH * 3]), WIDTH * 3);
+    }
+}
+
+/* Frame buffers are not shared between contexts, so a context drawing from
+ * a texture another one rendered wraps it in one of its own
+ *
+ * Returns: A frame buffer with the texture as its color attachment */
+FBO wrap_texture(GLuint texture) {
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     return {fbo, texture};
 }
@@ -147,4 +617,10 @@ GLuint get_binding_point() {
     return next_binding_point++;
 }
 
+GLuint get_texture_unit() {
+    // Unit 0 is left for the frame textures
+    GLuint static next_texture_unit {1};
+    return next_texture_unit++;
+}
+
 };
@@ -1,6 +1,174 @@
+#include "distributed.h"
 #include "renderer.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
 
-int main() {
-    Renderer::init();
+static void print_usage(char const* name) {
+    std::cerr << "Usage: " << name << " [--headless] [--frames N] [--output FILE]\n"
+              << "       [--stream-scene] [--backend gpu|cpu|wavefront] [--threads N]\n"
+              << "       [--samples N] [--max-bounce N] [--roulette-depth N]\n"
+              << "       [--adaptive ERROR] [--motion-fps N]\n"
+              << "       [--program-cache DIR] [--no-program-cache] [--scene FILE]\n"
+              << "       [--stats FILE] [--timings] [--sampler random|sobol] [--denoise]\n"
+              << "       [--no-reproject] [--trace-budget MS]\n"
+              << "       [--coordinate PORT] [--local-workers N] [--worker HOST:PORT]\n"
+              << "  --headless     Render offscreen without a window\n"
+              << "  --frames N     Frames to accumulate in headless mode\n"
+              << "  --output FILE  Image to write in headless mode (PPM)\n"
+              << "  --stream-scene Upload the scene through persistently mapped buffers\n"
+              << "  --backend NAME Trace on the gpu (default), the cpu, or the gpu in compute\n"
+              << "                 shader stages that keep paths of a material together\n"
+              << "  --threads N    Worker threads of the cpu backend\n"
+              << "  --samples N    Samples per pixel and frame (default 10)\n"
+              << "  --max-bounce N Bounces before a path is cut off (default 100)\n"
+              << "  --roulette-depth N\n"
+              << "                 Bounces before Russian roulette may end a path (default 3)\n"
+              << "  --adaptive ERROR\n"
+              << "                 Stop sampling tiles once their relative error is below ERROR\n"
+              << "  --motion-fps N Lower the resolution to hold N frames/s while moving,\n"
+              << "                 0 keeps the full resolution (default 30)\n"
+              << "  --program-cache DIR\n"
+              << "                 Keep compiled shaders in DIR between runs\n"
+              << "  --no-program-cache\n"
+              << "                 Compile the shaders on every run\n"
+              << "  --scene FILE   Render a binary scene file made by scene_convert\n"
+              << "  --stats FILE   Write the time taken in headless mode as JSON\n"
+              << "  --timings      Report the GPU time of the trace and display passes\n"
+              << "  --sampler NAME Draw the GPU samples from independent random numbers or\n"
+              << "                 from a scrambled Sobol sequence (default sobol)\n"
+              << "  --denoise      Filter the noise out of the displayed image, less as\n"
+              << "                 samples accumulate (gpu and wavefront backends)\n"
+              << "  --no-reproject Start accumulating over whenever the camera moves, rather\n"
+              << "                 than carrying the samples into the new view\n"
+              << "  --trace-budget MS\n"
+              << "                 GPU time to trace for per frame, spreading the image over\n"
+              << "                 several frames in tiles when it takes longer (gpu backend)\n"
+              << "  --coordinate PORT\n"
+              << "                 Render headless by handing tiles and sample ranges to\n"
+              << "                 workers connecting on PORT, 0 for any free port\n"
+              << "  --local-workers N\n"
+              << "                 Start N workers on this machine for the coordinator\n"
+              << "  --worker HOST:PORT\n"
+              << "                 Trace for the coordinator at HOST:PORT, with the same scene\n"
+              << "                 and sample options as the coordinator\n";
+}
+
+int main(int argc, char** argv) {
+    Renderer::Settings settings {};
+
+    // Numbers that do not parse are usage errors like unknown options
+    try {
+        for (int i = 1; i < argc; i++) {
+            bool const has_value {i + 1 < argc};
+
+            if (!std::strcmp(argv[i], "--headless")) {
+                settings.headless = true;
+            } else if (!std::strcmp(argv[i], "--frames") && has_value) {
+                settings.frames = std::stoul(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--output") && has_value) {
+                settings.output = argv[++i];
+            } else if (!std::strcmp(argv[i], "--stream-scene")) {
+                settings.stream_scene = true;
+            } else if (!std::strcmp(argv[i], "--backend") && has_value) {
+                std::string const backend {argv[++i]};
+                if (backend == "gpu") {
+                    settings.backend = Renderer::Backend::GPU;
+                } else if (backend == "cpu") {
+                    settings.backend = Renderer::Backend::CPU;
+                } else if (backend == "wavefront") {
+                    settings.backend = Renderer::Backend::WAVEFRONT;
+                } else {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+            } else if (!std::strcmp(argv[i], "--threads") && has_value) {
+                settings.threads = std::stoul(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--samples") && has_value) {
+                settings.budget.samples = std::stoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--max-bounce") && has_value) {
+                settings.budget.max_bounce = std::stoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--roulette-depth") && has_value) {
+                settings.budget.roulette_depth = std::stoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--adaptive") && has_value) {
+                settings.budget.error_threshold = std::stof(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--program-cache") && has_value) {
+                settings.program_cache = argv[++i];
+            } else if (!std::strcmp(argv[i], "--no-program-cache")) {
+                settings.program_cache.clear();
+            } else if (!std::strcmp(argv[i], "--scene") && has_value) {
+                settings.scene = argv[++i];
+            } else if (!std::strcmp(argv[i], "--stats") && has_value) {
+                settings.stats = argv[++i];
+            } else if (!std::strcmp(argv[i], "--sampler") && has_value) {
+                std::string const sampler {argv[++i]};
+                if (sampler != "random" && sampler != "sobol") {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                settings.sampler = sampler == "random" ? Renderer::Sampler::RANDOM
+                                                       : Renderer::Sampler::SOBOL;
+            } else if (!std::strcmp(argv[i], "--denoise")) {
+                settings.denoise = true;
+            } else if (!std::strcmp(argv[i], "--no-reproject")) {
+                settings.reproject = false;
+            } else if (!std::strcmp(argv[i], "--trace-budget") && has_value) {
+                settings.trace_budget = std::stod(argv[++i]) * 1e-3;
+            } else if (!std::strcmp(argv[i], "--coordinate") && has_value) {
+                settings.coordinate_port = std::stoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--local-workers") && has_value) {
+                settings.local_workers = std::stoul(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--worker") && has_value) {
+                settings.coordinator = argv[++i];
+            } else if (!std::strcmp(argv[i], "--timings")) {
+                settings.timings = true;
+            } else if (!std::strcmp(argv[i], "--motion-fps") && has_value) {
+                double const fps {std::stod(argv[++i])};
+                settings.target_frame_time = fps > 0.0 ? 1.0 / fps : 0.0;
+            } else {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+    } catch (std::logic_error const&) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (settings.budget.samples < 1 || settings.budget.max_bounce < 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Local workers need someone to coordinate them
+    if (settings.local_workers > 0 && settings.coordinate_port < 0) {
+        settings.coordinate_port = 0;
+    }
+
+    try {
+        if (!settings.coordinator.empty()) {
+            return Distributed::work(settings);
+        }
+        if (settings.coordinate_port >= 0) {
+            // Workers started here render with the same options
+            std::vector<std::string> worker_command {argv[0]};
+            for (int i = 1; i < argc; i++) {
+                if (!std::strcmp(argv[i], "--coordinate") ||
+                    !std::strcmp(argv[i], "--local-workers")) {
+                    i++;
+                } else {
+                    worker_command.push_back(argv[i]);
+                }
+            }
+            return Distributed::coordinate(settings, worker_command);
+        }
+        if (settings.headless) {
+            return Renderer::render_headless(settings);
+        }
+        Renderer::init(settings);
+    } catch (std::runtime_error const& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
     return 0;
 }
@@ -49,6 +49,14 @@ Matrix4& Matrix4::rotz(GLfloat angle) {
     return *this;
 }
 
+Matrix4& Matrix4::scale(GLfloat x, GLfloat y, GLfloat z) {
+    m[0] = x;
+    m[N + 1] = y;
+    m[2*N + 2] = z;
+    m[3*N + 3] = 1;
+    return *this;
+}
+
 Matrix4& Matrix4::look_at(vec3 const& pos, vec3 const& look, vec3 const& up) {
     vec3 const f {look - pos}; 
     vec3 const r {up.cross(f) / up.cross(f).length()};
@@ -96,6 +104,52 @@ Matrix4 Matrix4::operator*(Matrix4 const& other) const {
     return res;
 }
 
+vec3 Matrix4::transform_point(vec3 const& p) const {
+    return {
+        m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3],
+        m[N] * p.x + m[N + 1] * p.y + m[N + 2] * p.z + m[N + 3],
+        m[2*N] * p.x + m[2*N + 1] * p.y + m[2*N + 2] * p.z + m[2*N + 3]
+    };
+}
+
+/* Transform a direction, which leaves out the translation */
+vec3 Matrix4::transform_vector(vec3 const& v) const {
+    return {
+        m[0] * v.x + m[1] * v.y + m[2] * v.z,
+        m[N] * v.x + m[N + 1] * v.y + m[N + 2] * v.z,
+        m[2*N] * v.x + m[2*N + 1] * v.y + m[2*N + 2] * v.z
+    };
+}
+
+/* Invert a matrix whose bottom row is (0, 0, 0, 1), like any combination
+ * of translations, rotations and scales. The upper 3x3 part is inverted
+ * through its cofactors and the translation is undone after it.
+ *
+ * Returns: The inverse, or a zero matrix if the matrix is singular */
+Matrix4 Matrix4::inverse_affine() const {
+    GLfloat const a {m[0]}, b {m[1]}, c {m[2]};
+    GLfloat const d {m[N]}, e {m[N + 1]}, f {m[N + 2]};
+    GLfloat const g {m[2*N]}, h {m[2*N + 1]}, i {m[2*N + 2]};
+
+    GLfloat const det {a * (e*i - f*h) - b * (d*i - f*g) + c * (d*h - e*g)};
+    if (det == 0.0f) {
+        return Matrix4();
+    }
+    GLfloat const s {1.0f / det};
+
+    Matrix4 inv {
+        (e*i - f*h) * s, (c*h - b*i) * s, (b*f - c*e) * s, 0.0,
+        (f*g - d*i) * s, (a*i - c*g) * s, (c*d - a*f) * s, 0.0,
+        (d*h - e*g) * s, (b*g - a*h) * s, (a*e - b*d) * s, 0.0,
+        0.0, 0.0, 0.0, 1.0,
+    };
+    vec3 const t {inv.transform_vector({m[3], m[N + 3], m[2*N + 3]})};
+    inv.m[3] = -t.x;
+    inv.m[N + 3] = -t.y;
+    inv.m[2*N + 3] = -t.z;
+    return inv;
+}
+
 void Matrix4::upload(GLuint program, std::string const& var) const {
     glUniformMatrix4fv(
         glGetUniformLocation(program, var.c_str()),
@@ -124,6 +178,10 @@ vec3 vec3::operator-(vec3 const& other) const {
     return {x - other.x, y - other.y, z - other.z};
 }
 
+vec3 vec3::operator-() const {
+    return {-x, -y, -z};
+}
+
 vec3 vec3::operator*(GLfloat f) const {
     return {x * f, y * f, z * f};
 }
@@ -166,6 +224,11 @@ vec3& vec3::operator-=(vec3 const& other) {
     return *this;
 }
 
+GLfloat vec3::operator[](size_t axis) const {
+    assert(axis < 3);
+    return axis == 0 ? x : (axis == 1 ? y : z);
+}
+
 bool vec3::is_zero() const {
     return length() < 1e-6;
 }
@@ -0,0 +1,222 @@
+#include "mesh.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+// Triangles in an axis plane get a bit of thickness so the box slabs never
+// collapse, as quads do
+static GLfloat const TRIANGLE_PADDING {1e-4};
+
+AABB Mesh::bounds() const {
+    return {min, max};
+}
+
+/* Read the vertices and faces of a Wavefront OBJ file. Faces with more than
+ * three corners are split into fans, everything but positions is ignored. */
+TriangleMesh TriangleMesh::load_obj(std::string const& path) {
+    std::ifstream file {path};
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open model " + path);
+    }
+
+    TriangleMesh mesh {};
+    std::string line {};
+    size_t line_number {};
+
+    while (std::getline(file, line)) {
+        line_number++;
+        std::istringstream in {line};
+        std::string statement {};
+        in >> statement;
+
+        auto const fail = [&](std::string const& message) {
+            return std::runtime_error(path + ":" + std::to_string(line_number) + ": " + message);
+        };
+
+        if (statement == "v") {
+            vec3 v {};
+            if (!(in >> v.x >> v.y >> v.z)) {
+                throw fail("malformed vertex");
+            }
+            mesh.vertices.push_back(v);
+        } else if (statement == "f") {
+            // Corners are v, v/vt, v//vn or v/vt/vn, negative indices count
+            // back from the latest vertex
+            std::vector<GLint> corners {};
+            std::string corner {};
+            while (in >> corner) {
+                GLint index {};
+                try {
+                    index = std::stoi(corner);
+                } catch (std::logic_error const&) {
+                    throw fail("malformed face");
+                }
+                index = index < 0 ? static_cast<GLint>(mesh.vertices.size()) + index : index - 1;
+                if (index < 0 || static_cast<size_t>(index) >= mesh.vertices.size()) {
+                    throw fail("face references a missing vertex");
+                }
+                corners.push_back(index);
+            }
+            if (corners.size() < 3) {
+                throw fail("face with fewer than three corners");
+            }
+            for (size_t i = 1; i + 1 < corners.size(); i++) {
+                mesh.triangles.push_back({{corners[0], corners[i], corners[i + 1]}, 0});
+            }
+        }
+    }
+
+    if (mesh.triangles.empty()) {
+        throw std::runtime_error("Model " + path + " has no faces");
+    }
+    return mesh;
+}
+
+/* Append a mesh with a BVH built over its triangles, to be placed in the
+ * scene through instances. The triangles are stored in the order the
+ * leaves reference them, so a leaf is one range of them and needs no
+ * reference list.
+ *
+ * Returns: The index of the mesh */
+GLint MeshSet::add(TriangleMesh const& mesh) {
+    std::vector<BVH::Primitive> primitives {};
+    primitives.reserve(mesh.triangles.size());
+    for (size_t i = 0; i < mesh.triangles.size(); i++) {
+        MeshTriangle const& triangle {mesh.triangles[i]};
+        vec3 const pad {TRIANGLE_PADDING, TRIANGLE_PADDING, TRIANGLE_PADDING};
+        AABB box {mesh.vertices[triangle.v[0]] - pad, mesh.vertices[triangle.v[0]] + pad};
+        box.grow(mesh.vertices[triangle.v[1]]);
+        box.grow(mesh.vertices[triangle.v[2]]);
+        primitives.push_back({box, static_cast<GLint>(i)});
+    }
+
+    BVH bvh {};
+    bvh.build(primitives, BVH::GPU_LEAF_SIZE);
+
+    GLint const node_base = nodes.size();
+    GLint const triangle_base = triangles.size();
+    GLint const vertex_base = vertices.size();
+
+    // Node offsets become indices into the arrays shared by all meshes
+    for (BVHNode node : bvh.nodes) {
+        node.offset += node.count > 0 ? triangle_base : node_base;
+        nodes.push_back(node);
+    }
+    for (GLint const ref : bvh.refs) {
+        MeshTriangle triangle {mesh.triangles[ref]};
+        for (GLint& v : triangle.v) {
+            v += vertex_base;
+        }
+        triangles.push_back(triangle);
+    }
+    for (vec3 const& v : mesh.vertices) {
+        vertices.push_back({v, 0.0});
+    }
+
+    BVHNode const& root {bvh.nodes[0]};
+    meshes.push_back({root.min, node_base, root.max, static_cast<GLint>(mesh.triangles.size())});
+    return meshes.size() - 1;
+}
+
+/* Place a copy of a mesh in the scene, transformed from its own space */
+void MeshSet::add_instance(GLint mesh, Matrix4 const& transform, Material const& material) {
+    instances.emplace_back(meshes[mesh], mesh, transform, material);
+}
+
+Instance::Instance(Mesh const& geometry, GLint mesh, Matrix4 const& transform,
+                   Material const& material)
+    : world_to_object{}, mesh{mesh}, pad{}, material{material} {
+    Matrix4 const inverse {transform.inverse_affine()};
+    std::copy(inverse.m, inverse.m + 12, world_to_object);
+
+    // The scene bounds hold every corner of the transformed mesh bounds
+    AABB box {};
+    for (GLint corner = 0; corner < 8; corner++) {
+        vec3 const p {corner & 1 ? geometry.max.x : geometry.min.x,
+                      corner & 2 ? geometry.max.y : geometry.min.y,
+                      corner & 4 ? geometry.max.z : geometry.min.z};
+        box.grow(transform.transform_point(p));
+    }
+    min = box.min;
+    max = box.max;
+}
+
+AABB Instance::bounds() const {
+    return {min, max};
+}
+
+vec3 Instance::to_object_point(vec3 const& p) const {
+    return to_object_vector(p) + vec3(world_to_object[3], world_to_object[7],
+                                      world_to_object[11]);
+}
+
+/* Directions keep their length in the mesh's space unnormalized, so hit
+ * distances along a moved ray are the same as along the original */
+vec3 Instance::to_object_vector(vec3 const& v) const {
+    GLfloat const* const m {world_to_object};
+    return {m[0] * v.x + m[1] * v.y + m[2] * v.z,
+            m[4] * v.x + m[5] * v.y + m[6] * v.z,
+            m[8] * v.x + m[9] * v.y + m[10] * v.z};
+}
+
+/* Normals go back to the scene through the transpose of the inverse */
+vec3 Instance::normal_to_world(vec3 const& normal) const {
+    GLfloat const* const m {world_to_object};
+    vec3 const n {m[0] * normal.x + m[4] * normal.y + m[8] * normal.z,
+                  m[1] * normal.x + m[5] * normal.y + m[9] * normal.z,
+                  m[2] * normal.x + m[6] * normal.y + m[10] * normal.z};
+    return n / n.length();
+}
+
+RayShear::RayShear(vec3 const& dir) {
+    // Shear along the largest component of the direction, swapping the
+    // other two axes when it is negative to keep the winding
+    vec3 const d {std::abs(dir.x), std::abs(dir.y), std::abs(dir.z)};
+    kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (dir[kz] < 0.0) {
+        std::swap(kx, ky);
+    }
+
+    sx = dir[kx] / dir[kz];
+    sy = dir[ky] / dir[kz];
+    sz = 1.0f / dir[kz];
+}
+
+/*
+ * triangle_hit - Intersect the sheared ray with a triangle, the same as
+ *                triangle_hit in frag_trace.glsl
+ *
+ * Returns: The distance along the ray, or -1.0 on a miss
+ */
+GLfloat RayShear::triangle_hit(vec3 const& origin, vec3 const& v0, vec3 const& v1,
+                               vec3 const& v2) const {
+    vec3 const a {v0 - origin};
+    vec3 const b {v1 - origin};
+    vec3 const c {v2 - origin};
+
+    GLfloat const ax {a[kx] - sx * a[kz]};
+    GLfloat const ay {a[ky] - sy * a[kz]};
+    GLfloat const bx {b[kx] - sx * b[kz]};
+    GLfloat const by {b[ky] - sy * b[kz]};
+    GLfloat const cx {c[kx] - sx * c[kz]};
+    GLfloat const cy {c[ky] - sy * c[kz]};
+
+    // Scaled barycentric coordinates, which agree in sign inside
+    GLfloat const u {cx * by - cy * bx};
+    GLfloat const v {ax * cy - ay * cx};
+    GLfloat const w {bx * ay - by * ax};
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) {
+        return -1.0;
+    }
+
+    GLfloat const det {u + v + w};
+    if (det == 0.0f) {
+        return -1.0;
+    }
+    return (u * sz * a[kz] + v * sz * b[kz] + w * sz * c[kz]) / det;
+}
@@ -1,31 +1,351 @@
 #include "renderer.h"
 #include "wasm_shaders.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
 
 namespace Renderer {
-    void init() {
-        // Initialize OpenGL
-        state.window = GL::init();
-        state.program = GL::create_program(Shaders::vert_pass, Shaders::frag_trace);
+    // Frames the motion frame time is averaged over
+    static size_t const FRAME_HISTORY {8};
+    // Smallest fraction of the window resolution traced while moving
+    static GLfloat const MIN_RENDER_SCALE {0.25};
+
+    // Layout of the wavefront buffers, as declared in comp_wavefront.glsl
+    static GLuint const WAVE_GROUP_SIZE {64};
+    static GLuint const WAVE_PATH_SIZE {128};
+    static GLuint const WAVE_HIT_SIZE {64};
+    static GLint const WAVE_MATERIAL_QUEUE {2};
+    static GLint const WAVE_QUEUE_COUNT {5};
+    // Bounces between checks of whether any path of the wave is left, each
+    // one waiting on the GPU
+    static GLint const WAVE_CHECK_INTERVAL {4};
+    // Denoiser passes at one sample per pixel, each reaching twice as far.
+    // Every fourfold increase of the samples drops one.
+    static GLint const DENOISE_PASSES {5};
+    // Samples of history a reprojected pixel carries at most, so the new
+    // view soon outweighs what reprojection got wrong
+    static GLfloat const MAX_HISTORY_SAMPLES {128.0f};
+    // Side of the tiles traced under a trace budget, in pixels
+    static GLsizei const TRACE_TILE {128};
+    // Seconds after the latest view from the window thread that the camera
+    // still counts as moving, bridging the frames traced between two views
+    static double const MOTION_SETTLE {0.1};
+    // Flags the finished display slot until the window thread takes it
+    static GLuint const DISPLAY_FRESH {4};
+    static GLuint const DISPLAY_SLOT {3};
+
+    void init(Settings const& settings) {
+        // Initialize OpenGL, compute shaders need 4.3
+        bool const wavefront {settings.backend == Backend::WAVEFRONT};
+        state.window = GL::init(wavefront ? 4 : 0, wavefront ? 3 : 0);
+        if (!state.window) {
+            return;
+        }
+        state.render_context = GL::create_shared_context(state.window);
+        if (!state.render_context) {
+            return;
+        }
+
+        // Slots 0 and 1 go to the render thread first, the window shows 2
+        state.display_back = 0;
+        state.display_ready = 1;
+        state.display_front = 2;
+        std::promise<void> ready {};
+        std::future<void> setup_done {ready.get_future()};
+        state.render_thread = std::thread {render_loop, settings, std::ref(ready)};
+        try {
+            setup_done.get();
+        } catch (...) {
+            state.render_thread.join();
+            throw;
+        }
+
+        // The render thread only reads the camera from here on
+        state.input_camera = state.camera;
+        state.camera_sent = true;
+        for (GLuint i = 0; i < 3; i++) {
+            state.window_display[i] = GL::wrap_texture(state.fbo_display[i].texture);
+        }
+        state.last_time = glfwGetTime();
+
+        GL::run_loop(state.window, update);
+
+        state.stopping = true;
+        state.render_thread.join();
+        glfwDestroyWindow(state.render_context);
+        if (state.render_error) {
+            std::rethrow_exception(state.render_error);
+        }
+    }
+
+    int render_headless(Settings const& settings) {
+        if (!setup_headless(settings)) {
+            return EXIT_FAILURE;
+        }
+
+        auto const start {std::chrono::steady_clock::now()};
+        double elapsed {};
+
+        // No window means no swap interval, so frames go as fast as the
+        // driver allows. Under a trace budget a frame may take several
+        // calls to trace.
+        for (GLuint i = 0; state.frame < settings.frames; i++) {
+            double const now {std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count()};
+            if (i > 0) {
+                state.frame_history.add(now - elapsed);
+            }
+            elapsed = now;
+
+            state.trace_timer.begin();
+            trace();
+            state.trace_timer.end(state.traced_pixels);
+        }
+
+        state.present_timer.begin();
+        present(state.fbo_output.fbo);
+        state.present_timer.end();
+        glFinish();
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (settings.timings) {
+            report_timings();
+        }
+
+        int status {EXIT_SUCCESS};
+        try {
+            GL::save_fbo(state.fbo_output, settings.output);
+            std::cout << "Rendered " << settings.frames << " frames in " << elapsed
+                      << " s (" << settings.frames / elapsed << " frames/s) to "
+                      << settings.output << std::endl;
+            if (!settings.stats.empty()) {
+                write_stats(settings.stats, elapsed);
+            }
+        } catch (std::runtime_error const& e) {
+            std::cerr << e.what() << std::endl;
+            status = EXIT_FAILURE;
+        }
+
+        GL::terminate_headless();
+        return status;
+    }
+
+    /* Set up rendering offscreen, with a target for the displayed image
+     *
+     * Returns: false if there is no context to render with */
+    bool setup_headless(Settings const& settings) {
+        bool const wavefront {settings.backend == Backend::WAVEFRONT};
+        if (!GL::init_headless(wavefront ? 4 : 3, 3)) {
+            return false;
+        }
+
+        setup(settings);
+        state.fbo_output = GL::create_fbo(GL_RGB8);
+        return true;
+    }
+
+    /* Accumulate some frames of one tile of the image from scratch, for a
+     * distributed render. The frames are those from first_frame on of a
+     * render traced in one go, so they carry on its sample sequence.
+     *
+     * Returns: The sums of the samples of the tile with their count in
+     * alpha, bottom row first */
+    std::vector<GLfloat> trace_region(Tile const& region, GLuint first_frame, GLuint frames) {
+        state.region = region;
+        state.first_frame = first_frame;
+        restart_accumulation();
+        while (state.frame < frames) {
+            trace();
+        }
+
+        std::vector<GLfloat> pixels(static_cast<size_t>(region.width) * region.height * 4);
+        state.fbo_accum.use();
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glReadPixels(region.x, region.y, region.width, region.height, GL_RGBA, GL_FLOAT,
+                     pixels.data());
+        return pixels;
+    }
+
+    /* Display an accumulation traced elsewhere and write it to the output
+     * file, as a headless render does with its own */
+    void save_accumulation(std::vector<GLfloat> const& pixels) {
+        state.trace_width = GL::WIDTH;
+        state.trace_height = GL::HEIGHT;
+        glBindTexture(GL_TEXTURE_2D, state.fbo_accum.texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GL::WIDTH, GL::HEIGHT, GL_RGBA, GL_FLOAT,
+                        pixels.data());
+        present(state.fbo_output.fbo);
+        GL::save_fbo(state.fbo_output, state.settings.output);
+    }
+
+    /* Write how long a headless render took and what it traced, for the
+     * benchmarks. Adaptive sampling makes the samples an upper bound. */
+    void write_stats(std::string const& path, double elapsed) {
+        std::ofstream file {path};
+        file << "{\"frames\": " << state.settings.frames
+             << ", \"seconds\": " << elapsed
+             << ", \"width\": " << GL::WIDTH
+             << ", \"height\": " << GL::HEIGHT
+             << ", \"samples_per_pixel\": " << state.settings.budget.samples
+             << ", \"max_bounce\": " << state.settings.budget.max_bounce << "}\n";
+        if (!file) {
+            throw std::runtime_error("Failed to write stats " + path);
+        }
+    }
+
+    void setup(Settings const& settings) {
+        state.settings = settings;
+        GL::set_program_cache(settings.program_cache);
+        state.trace_programs = GL::ProgramCache(Shaders::vert_pass, Shaders::frag_trace);
         state.tex_program = GL::create_program(Shaders::vert_pass, Shaders::frag_tex);
-        state.fbo_current = GL::create_fbo();
-        state.fbo_prev = GL::create_fbo();
+        state.mask_program = GL::create_program(Shaders::vert_pass, Shaders::frag_mask);
+        state.fbo_accum = GL::create_fbo(GL_RGBA32F);
+        state.accum_moments = GL::attach_texture(state.fbo_accum, GL_COLOR_ATTACHMENT1, GL_R32F);
+
+        // The CPU tracer only hands back colors
+        if (settings.denoise && settings.backend == Backend::CPU) {
+            std::cerr << "The cpu backend writes no feature buffers, denoising is off"
+                      << std::endl;
+            state.settings.denoise = false;
+        }
+
+        // Without a window the camera never moves
+        state.settings.reproject = settings.reproject && !settings.headless &&
+                                   settings.backend != Backend::CPU;
+        state.history_pending = false;
+
+        GLenum const accum_targets[] {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+                                      GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
+        bool const features {state.settings.denoise || state.settings.reproject};
+        if (features) {
+            state.accum_albedo = GL::attach_texture(state.fbo_accum, GL_COLOR_ATTACHMENT2,
+                                                    GL_RGBA32F);
+            state.accum_normal = GL::attach_texture(state.fbo_accum, GL_COLOR_ATTACHMENT3,
+                                                    GL_RGBA32F);
+            state.albedo_unit = GL::get_texture_unit();
+            state.normal_unit = GL::get_texture_unit();
+        }
+        if (state.settings.denoise) {
+            setup_denoiser();
+        }
+        if (state.settings.reproject) {
+            setup_reprojection();
+        }
+        state.fbo_accum.use();
+        glDrawBuffers(features ? 4 : 2, accum_targets);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        GLint const tile {SampleBudget::ADAPTIVE_TILE};
+        state.fbo_mask = GL::create_fbo(GL_R8, (GL::WIDTH + tile - 1) / tile,
+                                        (GL::HEIGHT + tile - 1) / tile);
+        state.mask_unit = GL::get_texture_unit();
+        state.moments_unit = GL::get_texture_unit();
+        state.sample_boost = 1;
+        state.trace_width = GL::WIDTH;
+        state.trace_height = GL::HEIGHT;
+        state.ground_plane = true;
 
         state.render_base = create_fullscreen_quad();
-        state.last_time = glfwGetTime();
 
-        state.uniforms.resolution = glGetUniformLocation(state.program, "resolution");
-        state.uniforms.time = glGetUniformLocation(state.program, "time");
-        state.uniforms.frame = glGetUniformLocation(state.program, "frame");
-        state.uniforms.view_matrix = glGetUniformLocation(state.program, "view_matrix");
-        state.uniforms.fov = glGetUniformLocation(state.program, "FOV");
+        if (settings.backend == Backend::CPU) {
+            state.cpu_tracer = std::make_unique<CPUTracer>(GL::WIDTH, GL::HEIGHT, settings.threads);
+            std::cout << "Tracing on the CPU with " << state.cpu_tracer->threads()
+                      << " threads using "
+                      << SceneSoA::isa_name(SceneSoA::current_isa()) << std::endl;
+        } else if (settings.backend == Backend::WAVEFRONT) {
+            setup_wavefront();
+        }
 
-        state.camera = Camera({0.0, 0.5, 0.0}, 70);
+        glUseProgram(state.mask_program);
+        glUniform1i(glGetUniformLocation(state.mask_program, "accum_tex"), 0);
+        glUniform1i(glGetUniformLocation(state.mask_program, "moments_tex"), state.moments_unit);
+        glUniform1i(glGetUniformLocation(state.mask_program, "tile_size"), tile);
+
+        state.bvh_loaded = false;
+        if (settings.scene.empty()) {
+            add_default_scene();
+        } else {
+            load_scene(settings.scene);
+        }
+
+        // Start with the variant of the trace shader made for the scene
+        state.scene_defines = scene_defines();
+        state.program = state.trace_programs.get(trace_defines());
 
         // Bind the GLArray to the correct buffers
-        state.spheres.bind(state.program, "sphere_buffer");
+        state.spheres.bind_texture(state.program, "sphere_buffer");
         state.spheres.bind_size(state.program, "SPHERES_NUM");
-        state.quads.bind(state.program, "quad_buffer");
+        state.quads.bind_texture(state.program, "quad_buffer");
         state.quads.bind_size(state.program, "QUADS_NUM");
+        state.bvh_nodes.bind_texture(state.program, "bvh_node_buffer");
+        state.bvh_nodes.bind_size(state.program, "BVH_NODES_NUM");
+        state.bvh_refs.bind_texture(state.program, "bvh_ref_buffer");
+        state.meshes.bind_texture(state.program, "mesh_buffer");
+        state.instances.bind_texture(state.program, "instance_buffer");
+        state.mesh_nodes.bind_texture(state.program, "mesh_node_buffer");
+        state.mesh_triangles.bind_texture(state.program, "mesh_triangle_buffer");
+        state.mesh_vertices.bind_texture(state.program, "mesh_vertex_buffer");
+        state.lights.bind_texture(state.program, "light_buffer");
+        state.lights.bind_size(state.program, "LIGHTS_NUM");
+
+        if (settings.stream_scene && !(state.spheres.enable_ring_buffer() &&
+                                       state.quads.enable_ring_buffer() &&
+                                       state.bvh_nodes.enable_ring_buffer() &&
+                                       state.bvh_refs.enable_ring_buffer())) {
+            std::cerr << "Persistent buffers are not supported, streaming the scene with "
+                         "regular uploads" << std::endl;
+        }
+
+        use_trace_program(state.program);
+    }
+
+    /* Replace the scene with the one in a binary scene file. Its sections
+     * are in the layout of the arrays, so each is copied over whole. */
+    void load_scene(std::string const& path) {
+        SceneFile::Mapping const file {path};
+
+        auto const [spheres, sphere_count] = file.section<Sphere>(SceneFile::Section::SPHERES);
+        auto const [quads, quad_count] = file.section<Quad>(SceneFile::Section::QUADS);
+        state.spheres.assign(spheres, sphere_count);
+        state.quads.assign(quads, quad_count);
+
+        auto const [meshes, mesh_count] = file.section<Mesh>(SceneFile::Section::MESHES);
+        auto const [instances, instance_count] =
+            file.section<Instance>(SceneFile::Section::INSTANCES);
+        auto const [mesh_nodes, mesh_node_count] =
+            file.section<BVHNode>(SceneFile::Section::MESH_NODES);
+        auto const [triangles, triangle_count] =
+            file.section<MeshTriangle>(SceneFile::Section::MESH_TRIANGLES);
+        auto const [vertices, vertex_count] =
+            file.section<MeshVertex>(SceneFile::Section::MESH_VERTICES);
+        state.meshes.assign(meshes, mesh_count);
+        state.instances.assign(instances, instance_count);
+        state.mesh_nodes.assign(mesh_nodes, mesh_node_count);
+        state.mesh_triangles.assign(triangles, triangle_count);
+        state.mesh_vertices.assign(vertices, vertex_count);
+
+        // Scenes without a hierarchy get one built on the first frame
+        if (file.has_section(SceneFile::Section::BVH_NODES) &&
+            file.has_section(SceneFile::Section::BVH_REFS)) {
+            auto const [nodes, node_count] = file.section<BVHNode>(SceneFile::Section::BVH_NODES);
+            auto const [refs, ref_count] = file.section<BVHRefs>(SceneFile::Section::BVH_REFS);
+            state.bvh_nodes.assign(nodes, node_count);
+            state.bvh_refs.assign(refs, ref_count);
+            state.bvh_loaded = true;
+        }
+
+        state.camera = file.camera();
+        state.ground_plane = file.header().flags & SceneFile::GROUND_PLANE;
+    }
+
+    /* The scene rendered when no scene file is given */
+    void add_default_scene() {
+        state.camera = Camera({0.0, 0.5, 0.0}, 70);
 
         state.spheres.push_back(
             Sphere(vec3(-1.0, 0.5, -2.0), 0.5,
@@ -85,60 +405,1052 @@ namespace Renderer {
             Quad(vec3(2.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0),
                  Material().lambertian(vec3(1.0, 0.4, 0.5)))
         );
+    }
 
-        GL::run_loop(state.window, update);
+    /* Set up the render context on the render thread and trace frames
+     * until the window closes. Errors end the thread and close the window,
+     * to be thrown again on the window thread. */
+    void render_loop(Settings settings, std::promise<void>& ready) {
+        glfwMakeContextCurrent(state.render_context);
+        try {
+            setup(settings);
+            // Until the first frame is done the window shows the background
+            for (GL::FBO& fbo : state.fbo_display) {
+                fbo = GL::create_fbo(GL_RGBA8);
+                fbo.use();
+                glClearColor(0.39f, 0.58f, 0.93f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
+            // The window's context only sees finished objects
+            glFinish();
+        } catch (...) {
+            glfwMakeContextCurrent(nullptr);
+            ready.set_exception(std::current_exception());
+            return;
+        }
+        state.last_trace = glfwGetTime();
+        state.last_report = state.last_trace;
+        ready.set_value();
+
+        try {
+            while (!state.stopping) {
+                render_frame();
+            }
+        } catch (...) {
+            state.render_error = std::current_exception();
+            state.stopping = true;
+        }
+        glfwMakeContextCurrent(nullptr);
     }
 
+    /* Trace a frame on the render thread, after taking in the views of the
+     * window thread, and hand it to the window */
+    void render_frame() {
+        double const now {glfwGetTime()};
+        double const delta {now - state.last_trace};
+        state.last_trace = now;
+        state.frame_history.add(delta);
+
+        // Of the views the window went through since the last frame, only
+        // the latest is traced
+        bool moved {false};
+        while (state.views.pop(state.camera)) {
+            moved = true;
+        }
+        if (moved) {
+            // Start the accumulation over to not get blurry frames
+            state.last_move = now;
+            restart_accumulation();
+        }
+
+        update_resolution(now - state.last_move < MOTION_SETTLE, delta);
+        state.trace_timer.begin();
+        trace();
+        state.trace_timer.end(state.traced_pixels);
+
+        // Draw into the slot the window is done showing. A slot coming back
+        // without being shown still has its fence from last time.
+        GLuint const slot {state.display_back};
+        if (state.shown_fences[slot]) {
+            glWaitSync(state.shown_fences[slot], 0, GL_TIMEOUT_IGNORED);
+            glDeleteSync(state.shown_fences[slot]);
+            state.shown_fences[slot] = nullptr;
+        }
+        if (state.drawn_fences[slot]) {
+            glDeleteSync(state.drawn_fences[slot]);
+        }
+        state.present_timer.begin();
+        present(state.fbo_display[slot].fbo);
+        state.present_timer.end();
+
+        // Fences only reach another context once flushed
+        state.drawn_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+        state.display_back = state.display_ready.exchange(slot | DISPLAY_FRESH) & DISPLAY_SLOT;
+
+        if (state.settings.timings && now - state.last_report >= 1.0) {
+            report_timings();
+            state.last_report = now;
+        }
+    }
+
+    /* Take in input on the window thread and show the latest frame the
+     * render thread finished, never waiting on it */
     void update() {
         double now{glfwGetTime()};
         double delta{now - state.last_time};
         state.last_time = now;
 
-        // Reset screen and viewport size
-        glClearColor(0.39f, 0.58f, 0.93f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-        glViewport(0, 0, GL::WIDTH, GL::HEIGHT);
+        // Update the camera on movement. A view the queue has no room for
+        // is sent on a later frame, unless a newer one replaces it.
+        if (state.input_camera.move(state.window, delta)) {
+            state.camera_sent = false;
+        }
+        if (!state.camera_sent) {
+            state.camera_sent = state.views.push(state.input_camera);
+        }
+
+        // Take the finished slot, letting the GPU wait for it to be drawn
+        if (state.display_ready.load() & DISPLAY_FRESH) {
+            state.display_front = state.display_ready.exchange(state.display_front) &
+                                  DISPLAY_SLOT;
+            GLsync& drawn {state.drawn_fences[state.display_front]};
+            glWaitSync(drawn, 0, GL_TIMEOUT_IGNORED);
+            glDeleteSync(drawn);
+            drawn = nullptr;
+        }
+
+        GLuint const slot {state.display_front};
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, state.window_display[slot].fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, GL::WIDTH, GL::HEIGHT, 0, 0, GL::WIDTH, GL::HEIGHT,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        if (state.shown_fences[slot]) {
+            glDeleteSync(state.shown_fences[slot]);
+        }
+        state.shown_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+
+        // Swap front and back buffers
+        glfwSwapBuffers(state.window);
+
+        if (state.title_pending.exchange(false)) {
+            char title[128] {};
+            std::snprintf(title, sizeof(title), "Raytracer - trace %.2f ms, display %.2f ms",
+                          state.title_trace.load(), state.title_present.load());
+            glfwSetWindowTitle(state.window, title);
+        }
+        if (state.stopping) {
+            glfwSetWindowShouldClose(state.window, GLFW_TRUE);
+        }
+
+        // Poll for and process events
+        glfwPollEvents();
+    }
+
+    /* Pick the resolution to trace at. While the camera moves it follows
+     * the recent frame times towards the target, once it stops the full
+     * resolution comes back and accumulation starts over. */
+    void update_resolution(bool moving, double delta) {
+        double const target {state.settings.target_frame_time};
+
+        if (!moving || target <= 0.0) {
+            if (state.trace_width != GL::WIDTH || state.trace_height != GL::HEIGHT) {
+                state.trace_width = GL::WIDTH;
+                state.trace_height = GL::HEIGHT;
+                restart_accumulation();
+            }
+            state.frame_times.clear();
+            return;
+        }
+
+        state.frame_times.push_back(delta);
+        if (state.frame_times.size() > FRAME_HISTORY) {
+            state.frame_times.pop_front();
+        }
+        double average {0.0};
+        for (double const time : state.frame_times) {
+            average += time;
+        }
+        average /= state.frame_times.size();
+
+        // Frame time follows the number of traced pixels, which goes with
+        // the square of the scale
+        GLfloat const scale {static_cast<GLfloat>(state.trace_width) / GL::WIDTH};
+        GLfloat const wanted {scale * static_cast<GLfloat>(std::sqrt(target / average))};
+        GLfloat const clamped {std::clamp(wanted, MIN_RENDER_SCALE, 1.0f)};
+
+        // The view may hold still for a few frames while still counting as
+        // moving, so a new size starts over on its own
+        GLsizei const width {std::max<GLsizei>(std::lround(GL::WIDTH * clamped), 1)};
+        GLsizei const height {std::max<GLsizei>(std::lround(GL::HEIGHT * clamped), 1)};
+        if (width != state.trace_width || height != state.trace_height) {
+            state.trace_width = width;
+            state.trace_height = height;
+            restart_accumulation();
+        }
+    }
+
+    /* Start accumulating over after the view changed. With reprojection the
+     * samples so far are kept, to carry into the new view where they still
+     * show the same surfaces. */
+    void restart_accumulation() {
+        if (state.settings.reproject && state.frame > 0) {
+            keep_history();
+        }
+        state.frame = 0;
+        state.tiles_done = 0;
+    }
+
+    /* Trace one frame and add its samples to the accumulated image */
+    void trace() {
+        SampleBudget const& budget {state.settings.budget};
+        bool const adaptive {budget.error_threshold > 0.0f && !state.cpu_tracer &&
+                             state.trace_width == GL::WIDTH};
+
+        // The sample counts and the adaptive sampling mask only change
+        // between passes over the image
+        if (state.tiles_done == 0 && state.frame == 0) {
+            state.samples = 0;
+            // Every tile starts out needing samples
+            state.fbo_mask.use();
+            glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            state.sample_boost = 1;
+        } else if (state.tiles_done == 0 && adaptive &&
+                   state.frame % SampleBudget::ADAPTIVE_INTERVAL == 0) {
+            update_sample_mask();
+        }
 
-        state.fbo_current.use();
+        glViewport(0, 0, state.trace_width, state.trace_height);
+        state.fbo_accum.use();
+
+        // Tiles the first pass has not reached keep showing the previous
+        // view, rather than going black
+        std::vector<Tile> const tiles {schedule_tiles()};
+        glEnable(GL_SCISSOR_TEST);
+        if (state.frame == 0) {
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+            // Texels outside the traced area are filtered and wrapped into
+            // its edges when presented, so old sums there must not outlast
+            // the start of a pass
+            if (state.tiles_done == 0) {
+                Tile const area {traced_area()};
+                GLint const right {area.x + area.width};
+                GLint const top {area.y + area.height};
+                Tile const outside[] {
+                    {0, 0, area.x, GL::HEIGHT},
+                    {right, 0, GL::WIDTH - right, GL::HEIGHT},
+                    {area.x, 0, area.width, area.y},
+                    {area.x, top, area.width, GL::HEIGHT - top},
+                };
+                for (Tile const& strip : outside) {
+                    if (strip.width > 0 && strip.height > 0) {
+                        glScissor(strip.x, strip.y, strip.width, strip.height);
+                        glClear(GL_COLOR_BUFFER_BIT);
+                    }
+                }
+            }
+            for (Tile const& tile : tiles) {
+                glScissor(tile.x, tile.y, tile.width, tile.height);
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
+        }
+        glDisable(GL_SCISSOR_TEST);
+
+        state.traced_pixels = 0;
+        for (Tile const& tile : tiles) {
+            state.traced_pixels += tile.width * tile.height;
+        }
+
+        // Edited geometry invalidates the acceleration structure, and may
+        // call for another variant of the shader
+        if (state.spheres.dirty() || state.quads.dirty() || state.meshes.dirty() ||
+            state.instances.dirty()) {
+            if (!state.bvh_loaded) {
+                build_bvh();
+            }
+            state.bvh_loaded = false;
+            build_lights();
+            state.scene_defines = scene_defines();
+            if (state.cpu_tracer) {
+                state.cpu_tracer->set_scene(state.spheres, state.quads, mesh_set(),
+                                            state.ground_plane);
+            }
+        }
+
+        GLuint const program {state.trace_programs.get(trace_defines())};
+        if (program != state.program) {
+            use_trace_program(program);
+        }
         glUseProgram(state.program);
 
+        // Only the modified parts of the scene are sent
         state.spheres.upload();
         state.quads.upload();
+        state.bvh_nodes.upload();
+        state.bvh_refs.upload();
+        state.meshes.upload();
+        state.instances.upload();
+        state.mesh_nodes.upload();
+        state.mesh_triangles.upload();
+        state.mesh_vertices.upload();
+        state.lights.upload();
 
-        // Update the camera on movement
-        if (state.camera.move(state.window, delta)) {
-            // Reset the fbo to not get blurry frames
-            state.frame = 0;
+        if (state.cpu_tracer) {
+            trace_cpu();
+            state.frame++;
+            return;
         }
+        if (state.settings.backend == Backend::WAVEFRONT) {
+            trace_wavefront(adaptive);
+        } else {
+            // Upload variables
+            glUniform2f(state.uniforms.resolution, static_cast<GLfloat>(state.trace_width),
+                        static_cast<GLfloat>(state.trace_height));
+            glUniform1ui(state.uniforms.first_sample,
+                         state.samples + state.first_frame * budget.samples);
+            glUniform1i(state.uniforms.frame, state.first_frame + state.frame);
+            state.camera.to_matrix().upload(state.program, "view_matrix");
+            glUniform1i(state.uniforms.fov, state.camera.fov);
+            glUniform1i(state.uniforms.samples_per_pixel, budget.samples * state.sample_boost);
+            glUniform1i(state.uniforms.max_bounce, budget.max_bounce);
+            glUniform1i(state.uniforms.roulette_depth, budget.roulette_depth);
+            glUniform1i(state.uniforms.adaptive, adaptive);
+            glUniform1f(state.uniforms.light_power, state.light_power);
 
-        // Upload the previous fbo texture to blend with
-        glBindTexture(GL_TEXTURE_2D, state.fbo_prev.texture);
+            glActiveTexture(GL_TEXTURE0 + state.mask_unit);
+            glBindTexture(GL_TEXTURE_2D, state.fbo_mask.texture);
+            glActiveTexture(GL_TEXTURE0);
 
-        // Upload variables
-        glUniform2f(state.uniforms.resolution, static_cast<GLfloat>(GL::WIDTH),
-                    static_cast<GLfloat>(GL::HEIGHT));
-        glUniform1f(state.uniforms.time, glfwGetTime());
-        glUniform1i(state.uniforms.frame, state.frame);
-        state.camera.to_matrix().upload(state.program, "view_matrix");
-        glUniform1i(state.uniforms.fov, state.camera.fov);
+            // Do the tracing of rays! The samples are summed into a float
+            // texture by additive blending, which keeps converging long
+            // after a running mix in 8 bits would stop changing. Each tile
+            // is a draw of its own, so no single draw runs long enough to
+            // stall the display or trip the driver's watchdog.
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            glEnable(GL_SCISSOR_TEST);
+            for (Tile const& tile : tiles) {
+                glScissor(tile.x, tile.y, tile.width, tile.height);
+                state.render_base.draw(state.program, "in_position", "", "");
+            }
+            glDisable(GL_SCISSOR_TEST);
+            glDisable(GL_BLEND);
+        }
+
+        // The first pass of a new view takes over what the last one had
+        // accumulated, where it still applies
+        if (state.history_pending) {
+            reproject_history(tiles);
+        }
+
+        state.tiles_done += static_cast<GLint>(tiles.size());
+        if (state.tiles_done < state.tile_count) {
+            return;
+        }
+        state.tiles_done = 0;
+        state.history_pending = false;
+        state.traced_view = {state.camera, state.trace_width, state.trace_height};
 
-        // Do the tracing of rays!
-        state.render_base.draw(state.program, "in_position", "", "in_tex_coord");
+        // Pixels that are still traced have taken part in every frame, so
+        // they all continue the sequence from the same sample
+        state.samples += budget.samples * state.sample_boost;
+        state.frame++;
+    }
 
-        // Render the fbo
+    /* Pick the tiles to trace this frame, carrying on with the current
+     * pass. Without a budget, or on the wavefront backend whose dispatches
+     * are short already, the whole image is one tile. Otherwise tiles are
+     * added while the GPU time measured per pixel says they fit the budget,
+     * at least one per frame.
+     *
+     * Returns: The tiles */
+    std::vector<Tile> schedule_tiles() {
+        double const budget {state.settings.trace_budget};
+        Tile const area {traced_area()};
+        if (budget <= 0.0 || state.settings.backend != Backend::GPU) {
+            state.tile_count = 1;
+            return {area};
+        }
+
+        GLint const columns {(area.width + TRACE_TILE - 1) / TRACE_TILE};
+        GLint const rows {(area.height + TRACE_TILE - 1) / TRACE_TILE};
+        state.tile_count = columns * rows;
+
+        double const rate {state.trace_timer.rate()};
+        double planned {0.0};
+        std::vector<Tile> tiles {};
+        while (state.tiles_done + static_cast<GLint>(tiles.size()) < state.tile_count) {
+            GLint const index {state.next_tile % state.tile_count};
+            GLint const x {index % columns * TRACE_TILE};
+            GLint const y {index / columns * TRACE_TILE};
+            Tile const tile {area.x + x, area.y + y, std::min(TRACE_TILE, area.width - x),
+                             std::min(TRACE_TILE, area.height - y)};
+
+            double const cost {rate * tile.width * tile.height};
+            if (!tiles.empty() && planned + cost > budget) {
+                break;
+            }
+            tiles.push_back(tile);
+            planned += cost;
+            state.next_tile = (index + 1) % state.tile_count;
+
+            // Until the first frame is measured, one tile is all that is
+            // known to be safe
+            if (rate <= 0.0) {
+                break;
+            }
+        }
+        return tiles;
+    }
+
+    /* Returns: The part of the traced image to trace */
+    Tile traced_area() {
+        if (state.region.width > 0) {
+            return state.region;
+        }
+        return {0, 0, state.trace_width, state.trace_height};
+    }
+
+    /* Trace one frame on the CPU and replace the accumulation buffer with
+     * the result */
+    void trace_cpu() {
+        if (state.frame == 0) {
+            Tile const area {traced_area()};
+            state.cpu_tracer->set_viewport(state.trace_width, state.trace_height);
+            state.cpu_tracer->set_region(area.x, area.y, area.width, area.height);
+            state.cpu_tracer->reset();
+        }
+        state.cpu_tracer->trace(state.camera, state.first_frame + state.frame,
+                                state.settings.budget);
+
+        // Only the traced corner is sent, its rows are still as long as the
+        // full image
+        glBindTexture(GL_TEXTURE_2D, state.fbo_accum.texture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, GL::WIDTH);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, state.trace_width, state.trace_height, GL_RGBA,
+                        GL_FLOAT, state.cpu_tracer->pixels().data());
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+
+    /* Allocate the buffers of the wavefront stages, a wave being as many
+     * paths as one storage block can hold. The stages compile on first use
+     * like the variants of the trace shader. */
+    void setup_wavefront() {
+        if (!GLEW_VERSION_4_3) {
+            throw std::runtime_error("The wavefront backend needs OpenGL 4.3");
+        }
+
+        // The stages share everything but main with the trace shader, which
+        // comes first with its version line swapped for one with compute
+        std::string const& trace {Shaders::frag_trace};
+        state.wavefront_programs = GL::ProgramCache(
+            "#version 430 core\n#define WAVEFRONT\n" + trace.substr(trace.find('\n') + 1) +
+            Shaders::comp_wavefront);
+
+        GLint max_block {};
+        glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_block);
+        GLuint const pixels {static_cast<GLuint>(GL::WIDTH * GL::HEIGHT)};
+        GLuint const fits {static_cast<GLuint>(max_block) / WAVE_PATH_SIZE};
+        state.wave_size = std::max(std::min(pixels, fits) / WAVE_GROUP_SIZE, 1u) * WAVE_GROUP_SIZE;
+
+        auto const create_buffer = [](GLsizeiptr size) {
+            GLuint buffer {};
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_DYNAMIC_COPY);
+            return buffer;
+        };
+        state.wave_paths = create_buffer(GLsizeiptr {state.wave_size} * WAVE_PATH_SIZE);
+        state.wave_hits = create_buffer(GLsizeiptr {state.wave_size} * WAVE_HIT_SIZE);
+        state.wave_queues = create_buffer(GLsizeiptr {state.wave_size} * WAVE_QUEUE_COUNT *
+                                          sizeof(GLuint));
+
+        // Dispatch arguments, sizes and counts of each queue, all starting
+        // out empty
+        std::vector<GLuint> const counters(WAVE_QUEUE_COUNT * 5, 0);
+        state.wave_counters = create_buffer(counters.size() * sizeof(GLuint));
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, counters.size() * sizeof(GLuint),
+                        counters.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        std::cout << "Tracing in waves of " << state.wave_size << " paths" << std::endl;
+    }
+
+    /* Trace one frame with the wavefront stages. Each wave generates a
+     * sample of its pixels, then alternates intersecting the queued rays
+     * with shading the hits of each material until no path is left, once
+     * per sample, before adding its samples to the accumulation buffer. */
+    void trace_wavefront(bool adaptive) {
+        SampleBudget const& budget {state.settings.budget};
+        GLint const samples {budget.samples * state.sample_boost};
+
+        std::vector<std::string> defines {trace_defines()};
+        auto const stage = [&](std::string const& name) {
+            defines.push_back("STAGE_" + name);
+            GLuint const program {state.wavefront_programs.get(defines)};
+            defines.pop_back();
+            return program;
+        };
+        GLuint const generate {stage("GENERATE")};
+        GLuint const intersect {stage("INTERSECT")};
+        GLuint const shade {stage("SHADE")};
+        GLuint const prepare {stage("PREPARE")};
+        GLuint const accumulate {stage("ACCUMULATE")};
+
+        // Only the materials in the scene get queues worth shading
+        std::vector<GLint> materials {};
+        char const* const material_defines[] {"HAS_LAMBERTIAN", "HAS_METAL", "HAS_DIELECTRIC"};
+        for (GLint material = 0; material < 3; material++) {
+            if (std::find(defines.begin(), defines.end(), material_defines[material]) !=
+                defines.end()) {
+                materials.push_back(material);
+            }
+        }
+
+        for (GLuint const program : {generate, intersect, shade, accumulate}) {
+            glUseProgram(program);
+            glUniform2f(glGetUniformLocation(program, "resolution"),
+                        static_cast<GLfloat>(state.trace_width),
+                        static_cast<GLfloat>(state.trace_height));
+            glUniform1ui(glGetUniformLocation(program, "first_sample"),
+                         state.samples + state.first_frame * budget.samples);
+            glUniform1i(glGetUniformLocation(program, "frame"), state.first_frame + state.frame);
+            state.camera.to_matrix().upload(program, "view_matrix");
+            glUniform1i(glGetUniformLocation(program, "FOV"), state.camera.fov);
+            glUniform1i(glGetUniformLocation(program, "samples_per_pixel"), samples);
+            glUniform1i(glGetUniformLocation(program, "max_bounce"), budget.max_bounce);
+            glUniform1i(glGetUniformLocation(program, "roulette_depth"), budget.roulette_depth);
+            glUniform1i(glGetUniformLocation(program, "adaptive"), adaptive);
+            glUniform1i(glGetUniformLocation(program, "sample_mask"), state.mask_unit);
+            glUniform1i(glGetUniformLocation(program, "mask_tile_size"),
+                        SampleBudget::ADAPTIVE_TILE);
+            glUniform1f(glGetUniformLocation(program, "light_power_total"), state.light_power);
+            glUniform1ui(glGetUniformLocation(program, "wave_size"), state.wave_size);
+        }
+
+        // The stages that trace rays read the scene the trace shader reads
+        for (GLuint const program : {intersect, shade}) {
+            state.spheres.share(program);
+            state.quads.share(program);
+            state.bvh_nodes.share(program);
+            state.bvh_refs.share(program);
+            state.meshes.share(program);
+            state.instances.share(program);
+            state.mesh_nodes.share(program);
+            state.mesh_triangles.share(program);
+            state.mesh_vertices.share(program);
+            state.lights.share(program);
+        }
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, state.wave_paths);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, state.wave_hits);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, state.wave_queues);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, state.wave_counters);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, state.wave_counters);
+        glBindImageTexture(0, state.fbo_accum.texture, 0, GL_FALSE, 0, GL_READ_WRITE,
+                           GL_RGBA32F);
+        glBindImageTexture(1, state.accum_moments, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+        if (state.settings.denoise || state.settings.reproject) {
+            glBindImageTexture(2, state.accum_albedo, 0, GL_FALSE, 0, GL_READ_WRITE,
+                               GL_RGBA32F);
+            glBindImageTexture(3, state.accum_normal, 0, GL_FALSE, 0, GL_READ_WRITE,
+                               GL_RGBA32F);
+        }
+        glActiveTexture(GL_TEXTURE0 + state.mask_unit);
+        glBindTexture(GL_TEXTURE_2D, state.fbo_mask.texture);
+        glActiveTexture(GL_TEXTURE0);
+
+        // Every stage reads what the one before wrote, and the indirect
+        // dispatches read the arguments PREPARE wrote
+        GLbitfield const barrier {GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT};
+        auto const prepare_queues = [&](GLuint mask) {
+            glMemoryBarrier(barrier);
+            glUseProgram(prepare);
+            glUniform1ui(glGetUniformLocation(prepare, "prepare_mask"), mask);
+            glDispatchCompute(1, 1, 1);
+            glMemoryBarrier(barrier);
+        };
+        auto const dispatch_queue = [](GLint queue) {
+            glDispatchComputeIndirect(queue * 3 * sizeof(GLuint));
+        };
+
+        GLuint material_mask {};
+        for (GLint const material : materials) {
+            material_mask |= 1u << (WAVE_MATERIAL_QUEUE + material);
+        }
+
+        // Waves run along whole rows, so a region is traced with the rest of
+        // its rows
+        Tile const area {traced_area()};
+        GLuint const first {static_cast<GLuint>(area.y * state.trace_width)};
+        GLuint const last {static_cast<GLuint>((area.y + area.height) * state.trace_width)};
+        GLuint const groups {state.wave_size / WAVE_GROUP_SIZE};
+        for (GLuint start = first; start < last; start += state.wave_size) {
+            for (GLuint const program : {generate, intersect, shade, accumulate}) {
+                glUseProgram(program);
+                glUniform1ui(glGetUniformLocation(program, "wave_start"), start);
+            }
+
+            for (GLint pass = 0; pass < samples; pass++) {
+                GLint queue {0};
+                glMemoryBarrier(barrier);
+                glUseProgram(generate);
+                glUniform1i(glGetUniformLocation(generate, "sample_pass"), pass);
+                glUniform1i(glGetUniformLocation(generate, "ray_queue"), queue);
+                glDispatchCompute(groups, 1, 1);
+
+                for (GLint bounce = 0; bounce < budget.max_bounce; bounce++) {
+                    prepare_queues(1u << queue);
+                    glUseProgram(intersect);
+                    glUniform1i(glGetUniformLocation(intersect, "ray_queue"), queue);
+                    dispatch_queue(queue);
+
+                    prepare_queues(material_mask);
+                    glUseProgram(shade);
+                    glUniform1i(glGetUniformLocation(shade, "ray_queue"), queue);
+                    for (GLint const material : materials) {
+                        glUniform1i(glGetUniformLocation(shade, "shade_material"), material);
+                        dispatch_queue(WAVE_MATERIAL_QUEUE + material);
+                    }
+                    queue = 1 - queue;
+
+                    // Most paths end within a few bounces, so the rest of
+                    // the bounces are skipped once the queue comes up empty
+                    if ((bounce + 1) % WAVE_CHECK_INTERVAL == 0) {
+                        GLuint left {};
+                        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+                        glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.wave_counters);
+                        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                                           (WAVE_QUEUE_COUNT * 4 + queue) * sizeof(GLuint),
+                                           sizeof(GLuint), &left);
+                        if (left == 0) {
+                            break;
+                        }
+                    }
+                }
+            }
+
+            glMemoryBarrier(barrier);
+            glUseProgram(accumulate);
+            glDispatchCompute(groups, 1, 1);
+        }
+
+        // The accumulation images are read as textures from here on
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT |
+                        GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+    }
+
+    /* Create the reprojection program, the copy of the accumulation buffer
+     * it reads and the target drawing onto the accumulation buffer */
+    void setup_reprojection() {
+        state.reproject_program = GL::create_program(Shaders::vert_pass, Shaders::frag_reproject);
+        state.fbo_history = GL::create_fbo(GL_RGBA32F);
+        state.history_moments = GL::attach_texture(state.fbo_history, GL_COLOR_ATTACHMENT1,
+                                                   GL_R32F);
+        state.history_albedo = GL::attach_texture(state.fbo_history, GL_COLOR_ATTACHMENT2,
+                                                  GL_RGBA32F);
+        state.history_normal = GL::attach_texture(state.fbo_history, GL_COLOR_ATTACHMENT3,
+                                                  GL_RGBA32F);
+        state.history_albedo_unit = GL::get_texture_unit();
+        state.history_normal_unit = GL::get_texture_unit();
+
+        // Only the radiance and moments take the history, the features of
+        // the new view are its own
+        GLenum const targets[] {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glGenFramebuffers(1, &state.fbo_reproject.fbo);
+        state.fbo_reproject.texture = state.fbo_accum.texture;
+        state.fbo_reproject.use();
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               state.fbo_accum.texture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                               state.accum_moments, 0);
+        glDrawBuffers(2, targets);
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        GLuint const program {state.reproject_program};
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "history_tex"), 0);
+        glUniform1i(glGetUniformLocation(program, "history_moments_tex"), state.moments_unit);
+        glUniform1i(glGetUniformLocation(program, "albedo_tex"), state.albedo_unit);
+        glUniform1i(glGetUniformLocation(program, "normal_tex"), state.normal_unit);
+        glUniform1i(glGetUniformLocation(program, "history_albedo_tex"),
+                    state.history_albedo_unit);
+        glUniform1i(glGetUniformLocation(program, "history_normal_tex"),
+                    state.history_normal_unit);
+        glUniform1f(glGetUniformLocation(program, "max_history"), MAX_HISTORY_SAMPLES);
+    }
+
+    /* Copy the traced part of the accumulation buffer aside, along with the
+     * view it was traced in */
+    void keep_history() {
+        GLsizei const width {state.traced_view.width};
+        GLsizei const height {state.traced_view.height};
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, state.fbo_accum.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.fbo_history.fbo);
+        for (GLenum attachment = GL_COLOR_ATTACHMENT0; attachment <= GL_COLOR_ATTACHMENT3;
+             attachment++) {
+            glReadBuffer(attachment);
+            glDrawBuffers(1, &attachment);
+            glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT,
+                              GL_NEAREST);
+        }
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        state.history_view = state.traced_view;
+        state.history_pending = true;
+    }
+
+    /* Add the kept history onto tiles of the first pass of the new view */
+    void reproject_history(std::vector<Tile> const& tiles) {
+        GLuint const program {state.reproject_program};
+        View const& history {state.history_view};
+
+        state.fbo_reproject.use();
+        glViewport(0, 0, state.trace_width, state.trace_height);
+        glUseProgram(program);
+        glUniform2f(glGetUniformLocation(program, "resolution"),
+                    static_cast<GLfloat>(state.trace_width),
+                    static_cast<GLfloat>(state.trace_height));
+        glUniform1i(glGetUniformLocation(program, "FOV"), state.camera.fov);
+        state.camera.to_matrix().upload(program, "view_matrix");
+        glUniform2f(glGetUniformLocation(program, "history_resolution"),
+                    static_cast<GLfloat>(history.width), static_cast<GLfloat>(history.height));
+        glUniform1i(glGetUniformLocation(program, "history_fov"), history.camera.fov);
+        history.camera.to_matrix().inverse_affine().upload(program, "history_view_inverse");
+
+        glBindTexture(GL_TEXTURE_2D, state.fbo_history.texture);
+        glActiveTexture(GL_TEXTURE0 + state.moments_unit);
+        glBindTexture(GL_TEXTURE_2D, state.history_moments);
+        glActiveTexture(GL_TEXTURE0 + state.albedo_unit);
+        glBindTexture(GL_TEXTURE_2D, state.accum_albedo);
+        glActiveTexture(GL_TEXTURE0 + state.normal_unit);
+        glBindTexture(GL_TEXTURE_2D, state.accum_normal);
+        glActiveTexture(GL_TEXTURE0 + state.history_albedo_unit);
+        glBindTexture(GL_TEXTURE_2D, state.history_albedo);
+        glActiveTexture(GL_TEXTURE0 + state.history_normal_unit);
+        glBindTexture(GL_TEXTURE_2D, state.history_normal);
+        glActiveTexture(GL_TEXTURE0);
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glEnable(GL_SCISSOR_TEST);
+        for (Tile const& tile : tiles) {
+            glScissor(tile.x, tile.y, tile.width, tile.height);
+            state.render_base.draw(program, "in_position", "", "");
+        }
+        glDisable(GL_SCISSOR_TEST);
+        glDisable(GL_BLEND);
+    }
+
+    /* Mark the tiles whose pixels have all converged so they stop being
+     * traced, and spread the samples they leave over the remaining ones */
+    void update_sample_mask() {
+        GLint const tile {SampleBudget::ADAPTIVE_TILE};
+        GLint const tiles_x {(GL::WIDTH + tile - 1) / tile};
+        GLint const tiles_y {(GL::HEIGHT + tile - 1) / tile};
+
+        state.fbo_mask.use();
+        glViewport(0, 0, tiles_x, tiles_y);
+        glUseProgram(state.mask_program);
+        glUniform1f(glGetUniformLocation(state.mask_program, "threshold"),
+                    state.settings.budget.error_threshold);
+        glUniform1f(glGetUniformLocation(state.mask_program, "min_samples"),
+                    SampleBudget::ADAPTIVE_MIN_SAMPLES);
+        glUniform1f(glGetUniformLocation(state.mask_program, "error_floor"),
+                    SampleBudget::ERROR_FLOOR);
+
+        glBindTexture(GL_TEXTURE_2D, state.fbo_accum.texture);
+        glActiveTexture(GL_TEXTURE0 + state.moments_unit);
+        glBindTexture(GL_TEXTURE_2D, state.accum_moments);
+        glActiveTexture(GL_TEXTURE0);
+        state.render_base.draw(state.mask_program, "in_position", "", "");
+
+        // The mask is a few thousand bytes and only read every few frames,
+        // which keeps the stall of reading it back small
+        std::vector<GLubyte> mask(tiles_x * tiles_y);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, tiles_x, tiles_y, GL_RED, GL_UNSIGNED_BYTE, mask.data());
+
+        GLint const active = std::count_if(mask.begin(), mask.end(),
+                                           [](GLubyte texel) { return texel != 0; });
+        state.sample_boost = active == 0 ? 1
+            : std::clamp<GLint>(tiles_x * tiles_y / active, 1, SampleBudget::ADAPTIVE_MAX_BOOST);
+    }
+
+    /* Resolve the accumulated samples into the given framebuffer */
+    void present(GLuint framebuffer) {
+        GLuint const image {state.settings.denoise ? denoise() : state.fbo_accum.texture};
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, GL::WIDTH, GL::HEIGHT);
         glUseProgram(state.tex_program);
-        glBindTexture(GL_TEXTURE_2D, state.fbo_current.texture);
+        glUniform2f(glGetUniformLocation(state.tex_program, "scale"),
+                    static_cast<GLfloat>(state.trace_width) / GL::WIDTH,
+                    static_cast<GLfloat>(state.trace_height) / GL::HEIGHT);
+        glBindTexture(GL_TEXTURE_2D, image);
         state.render_base.draw(state.tex_program, "in_position", "",
                                "in_tex_coord");
+    }
 
-        // Swap front and back buffers
-        glfwSwapBuffers(state.window);
-        std::swap(state.fbo_current, state.fbo_prev);
-        state.frame++;
+    /* Create the denoiser's program and the targets its passes alternate
+     * between */
+    void setup_denoiser() {
+        state.denoise_program = GL::create_program(Shaders::vert_pass, Shaders::frag_denoise);
+        state.fbo_denoise[0] = GL::create_fbo(GL_RGBA32F);
+        state.fbo_denoise[1] = GL::create_fbo(GL_RGBA32F);
+        state.filtered_unit = GL::get_texture_unit();
 
-        // Poll for and process events
-        glfwPollEvents();
+        GLuint const program {state.denoise_program};
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "accum_tex"), 0);
+        glUniform1i(glGetUniformLocation(program, "moments_tex"), state.moments_unit);
+        glUniform1i(glGetUniformLocation(program, "albedo_tex"), state.albedo_unit);
+        glUniform1i(glGetUniformLocation(program, "normal_tex"), state.normal_unit);
+        glUniform1i(glGetUniformLocation(program, "filtered_tex"), state.filtered_unit);
+        glUniform1i(glGetUniformLocation(program, "max_passes"), DENOISE_PASSES);
+    }
+
+    /* Filter the noise out of the accumulated image with passes of an edge
+     * avoiding a-trous wavelet. The more samples a pixel has, the fewer
+     * passes it gets, and the filter itself mixes less as the variance of
+     * the pixels falls, so detail comes back as the image converges. The
+     * passes run here are those of the pixels with only the samples since
+     * the last reset, pixels carrying reprojected history skip the rest.
+     *
+     * Returns: The texture to display, the accumulation buffer itself once
+     * it needs no filtering */
+    GLuint denoise() {
+        GLint passes {DENOISE_PASSES};
+        for (GLuint samples = state.samples; samples >= 4 && passes > 0; samples /= 4) {
+            passes--;
+        }
+        if (passes == 0 || state.samples == 0) {
+            return state.fbo_accum.texture;
+        }
+
+        GLuint const program {state.denoise_program};
+        glUseProgram(program);
+        glViewport(0, 0, state.trace_width, state.trace_height);
+        glUniform2i(glGetUniformLocation(program, "size"), state.trace_width,
+                    state.trace_height);
+
+        glBindTexture(GL_TEXTURE_2D, state.fbo_accum.texture);
+        glActiveTexture(GL_TEXTURE0 + state.moments_unit);
+        glBindTexture(GL_TEXTURE_2D, state.accum_moments);
+        glActiveTexture(GL_TEXTURE0 + state.albedo_unit);
+        glBindTexture(GL_TEXTURE_2D, state.accum_albedo);
+        glActiveTexture(GL_TEXTURE0 + state.normal_unit);
+        glBindTexture(GL_TEXTURE_2D, state.accum_normal);
+
+        // Each pass reads the target the one before wrote
+        for (GLint pass = 0; pass < passes; pass++) {
+            GL::FBO const& target {state.fbo_denoise[pass % 2]};
+            glActiveTexture(GL_TEXTURE0 + state.filtered_unit);
+            glBindTexture(GL_TEXTURE_2D, state.fbo_denoise[(pass + 1) % 2].texture);
+            target.use();
+
+            glUniform1i(glGetUniformLocation(program, "first_pass"), pass == 0);
+            glUniform1i(glGetUniformLocation(program, "final_pass"), pass == passes - 1);
+            glUniform1i(glGetUniformLocation(program, "step_size"), 1 << pass);
+            glUniform1i(glGetUniformLocation(program, "pass"), pass);
+            state.render_base.draw(program, "in_position", "", "");
+        }
+        glActiveTexture(GL_TEXTURE0);
+
+        return state.fbo_denoise[(passes - 1) % 2].texture;
+    }
+
+    /* Returns: The GPU times of the passes of the latest frames, read a few
+     * frames late so they never wait on the GPU, and the wall time of the
+     * frames */
+    Timings timings() {
+        state.trace_timer.collect();
+        state.present_timer.collect();
+        return {state.trace_timer.stats(), state.present_timer.stats(),
+                state.frame_history.stats()};
+    }
+
+    /* Print the latest timings, and show them in the title of the window */
+    void report_timings() {
+        Timings const latest {timings()};
+        auto const format = [](char const* name, GL::TimingStats const& stats) {
+            char line[128] {};
+            std::snprintf(line, sizeof(line),
+                          "%s %.2f ms (p50 %.2f, p95 %.2f, p99 %.2f, %zu frames)", name,
+                          stats.average * 1e3, stats.p50 * 1e3, stats.p95 * 1e3,
+                          stats.p99 * 1e3, stats.count);
+            return std::string(line);
+        };
+        std::cout << format("trace", latest.trace) << ", " << format("display", latest.present)
+                  << ", " << format("frame", latest.frame) << std::endl;
+
+        if (state.window) {
+            state.title_trace = latest.trace.average * 1e3;
+            state.title_present = latest.present.average * 1e3;
+            state.title_pending = true;
+        }
+    }
+
+    /* Make a variant of the trace shader the one in use, pointing its
+     * uniforms and samplers at the renderer state */
+    void use_trace_program(GLuint program) {
+        state.program = program;
+
+        state.uniforms.resolution = glGetUniformLocation(state.program, "resolution");
+        state.uniforms.first_sample = glGetUniformLocation(state.program, "first_sample");
+        state.uniforms.frame = glGetUniformLocation(state.program, "frame");
+        state.uniforms.view_matrix = glGetUniformLocation(state.program, "view_matrix");
+        state.uniforms.fov = glGetUniformLocation(state.program, "FOV");
+        state.uniforms.samples_per_pixel = glGetUniformLocation(state.program, "samples_per_pixel");
+        state.uniforms.max_bounce = glGetUniformLocation(state.program, "max_bounce");
+        state.uniforms.roulette_depth = glGetUniformLocation(state.program, "roulette_depth");
+        state.uniforms.adaptive = glGetUniformLocation(state.program, "adaptive");
+        state.uniforms.light_power = glGetUniformLocation(state.program, "light_power_total");
+
+        glUseProgram(state.program);
+        glUniform1i(glGetUniformLocation(state.program, "sample_mask"), state.mask_unit);
+        glUniform1i(glGetUniformLocation(state.program, "mask_tile_size"),
+                    SampleBudget::ADAPTIVE_TILE);
+
+        state.spheres.rebind(state.program);
+        state.quads.rebind(state.program);
+        state.bvh_nodes.rebind(state.program);
+        state.bvh_refs.rebind(state.program);
+        state.meshes.rebind(state.program);
+        state.instances.rebind(state.program);
+        state.mesh_nodes.rebind(state.program);
+        state.mesh_triangles.rebind(state.program);
+        state.mesh_vertices.rebind(state.program);
+        state.lights.rebind(state.program);
+    }
+
+    /* Defines naming what the scene holds, so variants of the trace shader
+     * can leave out the rest */
+    std::vector<std::string> scene_defines() {
+        // Read through const references to not mark the arrays as modified
+        GLArray<Sphere> const& spheres {state.spheres};
+        GLArray<Quad> const& quads {state.quads};
+        GLArray<Instance> const& instances {state.instances};
+
+        bool materials[4] {};
+        if (state.ground_plane) {
+            materials[Material::METAL] = true;
+        }
+        for (size_t i = 0; i < spheres.size(); i++) {
+            materials[spheres[i].material.material] = true;
+        }
+        for (size_t i = 0; i < quads.size(); i++) {
+            materials[quads[i].material.material] = true;
+        }
+        for (size_t i = 0; i < instances.size(); i++) {
+            materials[instances[i].material.material] = true;
+        }
+
+        std::vector<std::string> defines {"SCENE_FEATURES"};
+        if (state.ground_plane) {
+            defines.push_back("HAS_PLANE");
+        }
+        if (!spheres.empty()) {
+            defines.push_back("HAS_SPHERES");
+        }
+        if (!quads.empty()) {
+            defines.push_back("HAS_QUADS");
+        }
+        if (!instances.empty()) {
+            defines.push_back("HAS_MESHES");
+        }
+        if (materials[Material::LAMBERTIAN]) {
+            defines.push_back("HAS_LAMBERTIAN");
+        }
+        if (materials[Material::METAL]) {
+            defines.push_back("HAS_METAL");
+        }
+        if (materials[Material::DIELECTRIC]) {
+            defines.push_back("HAS_DIELECTRIC");
+        }
+        if (materials[Material::EMISSIVE]) {
+            defines.push_back("HAS_EMISSIVE");
+        }
+        return defines;
+    }
+
+    /* Returns: The defines of the trace shader variant for the current
+     * scene and sample budget */
+    std::vector<std::string> trace_defines() {
+        std::vector<std::string> defines {state.scene_defines};
+        defines.push_back("MAX_BOUNCE " + std::to_string(state.settings.budget.max_bounce));
+        defines.push_back("ROULETTE_DEPTH " + std::to_string(state.settings.budget.roulette_depth));
+        if (state.settings.sampler == Sampler::SOBOL) {
+            defines.push_back("SOBOL_SAMPLER");
+        }
+        if (state.settings.denoise || state.settings.reproject) {
+            defines.push_back("FEATURE_BUFFERS");
+        }
+        return defines;
+    }
+
+    /* Rebuild the acceleration structure, needed whenever the scene changes */
+    void build_bvh() {
+        // Read through const references to not mark the arrays as modified
+        GLArray<Sphere> const& spheres {state.spheres};
+        GLArray<Quad> const& quads {state.quads};
+        GLArray<Instance> const& instances {state.instances};
+
+        std::vector<BVH::Primitive> primitives {};
+        for (size_t i = 0; i < spheres.size(); i++) {
+            primitives.push_back({spheres[i].bounds(), BVH::make_ref(BVH::SPHERE, i)});
+        }
+        for (size_t i = 0; i < quads.size(); i++) {
+            primitives.push_back({quads[i].bounds(), BVH::make_ref(BVH::QUAD, i)});
+        }
+        for (size_t i = 0; i < instances.size(); i++) {
+            primitives.push_back({instances[i].bounds(), BVH::make_ref(BVH::INSTANCE, i)});
+        }
+
+        BVH bvh {};
+        bvh.build(primitives, BVH::GPU_LEAF_SIZE);
+
+        std::vector<BVHRefs> const refs {bvh.packed_refs()};
+        state.bvh_nodes.assign(bvh.nodes.data(), bvh.nodes.size());
+        state.bvh_refs.assign(refs.data(), refs.size());
+    }
+
+    /* Gather the emissive spheres and quads into the lights sampled at each
+     * diffuse bounce */
+    void build_lights() {
+        // Read through const references to not mark the arrays as modified
+        GLArray<Sphere> const& spheres {state.spheres};
+        GLArray<Quad> const& quads {state.quads};
+
+        LightList list {};
+        list.build(spheres.data(), spheres.size(), quads.data(), quads.size());
+        state.lights.assign(list.lights.data(), list.lights.size());
+        state.light_power = list.total_power;
+    }
+
+    /* Returns: A copy of the meshes and instances in the scene, for the CPU
+     * tracer */
+    MeshSet mesh_set() {
+        // Read through const references to not mark the arrays as modified
+        GLArray<Mesh> const& meshes {state.meshes};
+        GLArray<Instance> const& instances {state.instances};
+        GLArray<BVHNode> const& nodes {state.mesh_nodes};
+        GLArray<MeshTriangle> const& triangles {state.mesh_triangles};
+        GLArray<MeshVertex> const& vertices {state.mesh_vertices};
+
+        MeshSet set {};
+        set.meshes.assign(meshes.data(), meshes.data() + meshes.size());
+        set.instances.assign(instances.data(), instances.data() + instances.size());
+        set.nodes.assign(nodes.data(), nodes.data() + nodes.size());
+        set.triangles.assign(triangles.data(), triangles.data() + triangles.size());
+        set.vertices.assign(vertices.data(), vertices.data() + vertices.size());
+        return set;
     }
 
     Model create_fullscreen_quad() {
@@ -0,0 +1,474 @@
+#include "scene_file.h"
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace SceneFile {
+
+Mapping::Mapping(std::string const& path) : path{path} {
+    int const fd {open(path.c_str(), O_RDONLY)};
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open scene file " + path);
+    }
+
+    struct stat info {};
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+        close(fd);
+        throw std::runtime_error("Scene file " + path + " is too small");
+    }
+    size = info.st_size;
+
+    // The mapping outlives the descriptor
+    void* const mapped {mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Failed to map scene file " + path);
+    }
+    data = static_cast<unsigned char const*>(mapped);
+    // Sections are read front to back once
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    // Validate everything up front so the sections can be used as they are
+    Header const& header {this->header()};
+    std::string error {};
+    if (header.magic != MAGIC) {
+        error = "is not a scene file";
+    } else if (header.version != VERSION) {
+        error = "has version " + std::to_string(header.version) + ", expected " +
+                std::to_string(VERSION);
+    } else if (sizeof(Header) + header.section_count * sizeof(SectionEntry) > size) {
+        error = "has a truncated section table";
+    } else {
+        auto const* const entries {reinterpret_cast<SectionEntry const*>(data + sizeof(Header))};
+        for (uint32_t i = 0; i < header.section_count && error.empty(); i++) {
+            SectionEntry const& entry {entries[i]};
+            if (entry.offset % SECTION_ALIGNMENT != 0) {
+                error = "has a misaligned section";
+            } else if (entry.offset > size || entry.element_size == 0 ||
+                       entry.count > (size - entry.offset) / entry.element_size) {
+                error = "has a truncated section";
+            }
+        }
+    }
+    if (error.empty()) {
+        error = check_indices();
+    }
+
+    if (!error.empty()) {
+        munmap(mapped, size);
+        throw std::runtime_error("Scene file " + path + " " + error);
+    }
+}
+
+Mapping::~Mapping() {
+    munmap(const_cast<unsigned char*>(data), size);
+}
+
+Header const& Mapping::header() const {
+    return *reinterpret_cast<Header const*>(data);
+}
+
+Camera Mapping::camera() const {
+    Camera camera {header().camera_pos, header().camera_fov};
+    camera.pitch = header().camera_pitch;
+    camera.yaw = header().camera_yaw;
+    return camera;
+}
+
+bool Mapping::has_section(Section type) const {
+    return find_section(type) != nullptr;
+}
+
+SectionEntry const* Mapping::find_section(Section type) const {
+    auto const* const entries {reinterpret_cast<SectionEntry const*>(data + sizeof(Header))};
+    for (uint32_t i = 0; i < header().section_count; i++) {
+        if (entries[i].type == type) {
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+/* Returns: How a hierarchy is broken, or nothing if its leaves stay below
+ * leaf_limit and its children follow their parents no deeper than the
+ * traversal stacks of the tracers reach */
+static std::string check_nodes(std::string const& name, BVHNode const* nodes, size_t count,
+                               size_t leaf_limit) {
+    // Children come after their parents, so one pass finds every depth
+    std::vector<size_t> depth(count, 0);
+    for (size_t i = 0; i < count; i++) {
+        BVHNode const& node {nodes[i]};
+        if (node.count < 0 || node.offset < 0) {
+            return "has a negative " + name + " node index";
+        }
+        size_t const offset {static_cast<size_t>(node.offset)};
+        if (node.count > 0) {
+            if (offset + node.count > leaf_limit) {
+                return "has a " + name + " leaf past the end of its primitives";
+            }
+            continue;
+        }
+        if (offset <= i + 1 || offset >= count) {
+            return "has a " + name + " node child out of bounds";
+        }
+        for (size_t const child : {i + 1, offset}) {
+            depth[child] = std::max(depth[child], depth[i] + 1);
+            if (depth[child] > BVH::MAX_DEPTH) {
+                return "has a " + name + " too deep to trace";
+            }
+        }
+    }
+    return "";
+}
+
+/* Check every index one section holds into another, so the tracers never
+ * read past a section of a corrupt file.
+ *
+ * Returns: What is out of bounds, or nothing if all of it is in bounds */
+std::string Mapping::check_indices() const {
+    // section() throws on a mismatch, which has to be caught here first
+    std::map<Section, size_t> const sizes {
+        {Section::SPHERES, sizeof(Sphere)},
+        {Section::QUADS, sizeof(Quad)},
+        {Section::BVH_NODES, sizeof(BVHNode)},
+        {Section::BVH_REFS, sizeof(BVHRefs)},
+        {Section::MESHES, sizeof(Mesh)},
+        {Section::MESH_NODES, sizeof(BVHNode)},
+        {Section::MESH_TRIANGLES, sizeof(MeshTriangle)},
+        {Section::MESH_VERTICES, sizeof(MeshVertex)},
+        {Section::INSTANCES, sizeof(Instance)},
+    };
+    auto const* const entries {reinterpret_cast<SectionEntry const*>(data + sizeof(Header))};
+    for (uint32_t i = 0; i < header().section_count; i++) {
+        auto const expected {sizes.find(entries[i].type)};
+        if (expected != sizes.end() && entries[i].element_size != expected->second) {
+            return "has elements of the wrong size";
+        }
+    }
+
+    size_t const sphere_count {section<Sphere>(Section::SPHERES).second};
+    size_t const quad_count {section<Quad>(Section::QUADS).second};
+    auto const [meshes, mesh_count] = section<Mesh>(Section::MESHES);
+    auto const [instances, instance_count] = section<Instance>(Section::INSTANCES);
+    auto const [mesh_nodes, mesh_node_count] = section<BVHNode>(Section::MESH_NODES);
+    auto const [triangles, triangle_count] = section<MeshTriangle>(Section::MESH_TRIANGLES);
+    size_t const vertex_count {section<MeshVertex>(Section::MESH_VERTICES).second};
+
+    for (size_t i = 0; i < mesh_count; i++) {
+        if (meshes[i].root < 0 || static_cast<size_t>(meshes[i].root) >= mesh_node_count) {
+            return "has a mesh root out of bounds";
+        }
+    }
+    for (size_t i = 0; i < instance_count; i++) {
+        if (instances[i].mesh < 0 || static_cast<size_t>(instances[i].mesh) >= mesh_count) {
+            return "has an instance of a mesh out of bounds";
+        }
+    }
+    for (size_t i = 0; i < triangle_count; i++) {
+        for (GLint const v : triangles[i].v) {
+            if (v < 0 || static_cast<size_t>(v) >= vertex_count) {
+                return "has a triangle corner out of bounds";
+            }
+        }
+    }
+    std::string error {check_nodes("mesh BVH", mesh_nodes, mesh_node_count, triangle_count)};
+    if (!error.empty()) {
+        return error;
+    }
+
+    // Only the references in leaves are read, the rest pads the last four
+    auto const [nodes, node_count] = section<BVHNode>(Section::BVH_NODES);
+    auto const [packed_refs, packed_count] = section<BVHRefs>(Section::BVH_REFS);
+    error = check_nodes("BVH", nodes, node_count, packed_count * 4);
+    if (!error.empty()) {
+        return error;
+    }
+    for (size_t i = 0; i < node_count; i++) {
+        for (GLint j = 0; j < nodes[i].count; j++) {
+            size_t const r {static_cast<size_t>(nodes[i].offset + j)};
+            GLint const ref {packed_refs[r / 4].refs[r % 4]};
+            GLint const index {BVH::ref_index(ref)};
+            size_t const limit {BVH::ref_type(ref) == BVH::SPHERE ? sphere_count
+                                : BVH::ref_type(ref) == BVH::QUAD ? quad_count
+                                : BVH::ref_type(ref) == BVH::INSTANCE ? instance_count
+                                                                      : 0};
+            if (index < 0 || static_cast<size_t>(index) >= limit) {
+                return "has a BVH reference out of bounds";
+            }
+        }
+    }
+    return "";
+}
+
+/* Parse a text scene. Each line holds one statement, and # starts a comment:
+ *
+ *   camera X Y Z FOV [PITCH YAW]
+ *   ground_plane on|off
+ *   material NAME lambertian R G B
+ *   material NAME metal R G B FUZZ
+ *   material NAME dielectric R G B RI
+ *   material NAME emissive R G B
+ *   sphere X Y Z RADIUS MATERIAL
+ *   quad QX QY QZ UX UY UZ VX VY VZ MATERIAL
+ *   mesh NAME FILE
+ *   instance MESH MATERIAL X Y Z [SCALE [RX RY RZ]]
+ *
+ * Materials and meshes have to be declared before they are used. Meshes are
+ * read from OBJ files relative to the scene and only appear through their
+ * instances, which scale them, rotate them by RX, RY and then RZ degrees
+ * and move them to X Y Z. Emissive materials give off R G B as radiance
+ * from the front of their surfaces, the outside of spheres and the side of
+ * quads that U x V points to.
+ */
+Scene read_text(std::string const& path) {
+    std::ifstream file {path};
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open scene " + path);
+    }
+
+    Scene scene {};
+    std::map<std::string, Material> materials {};
+    std::map<std::string, GLint> meshes {};
+    std::string line {};
+    size_t line_number {};
+
+    while (std::getline(file, line)) {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream in {line};
+        std::string statement {};
+        if (!(in >> statement)) {
+            continue;
+        }
+
+        auto const fail = [&](std::string const& message) {
+            return std::runtime_error(path + ":" + std::to_string(line_number) + ": " + message);
+        };
+        auto const read_vec3 = [&]() {
+            vec3 v {};
+            in >> v.x >> v.y >> v.z;
+            return v;
+        };
+        auto const read_material = [&]() {
+            std::string name {};
+            in >> name;
+            auto const found {materials.find(name)};
+            if (found == materials.end()) {
+                throw fail("unknown material " + name);
+            }
+            return found->second;
+        };
+
+        if (statement == "camera") {
+            vec3 const pos {read_vec3()};
+            GLint fov {};
+            if (!(in >> fov)) {
+                throw fail("malformed camera");
+            }
+            scene.camera = Camera(pos, fov);
+            if (in >> scene.camera.pitch) {
+                in >> scene.camera.yaw;
+            } else if (in.eof()) {
+                in.clear();
+            }
+        } else if (statement == "ground_plane") {
+            std::string value {};
+            in >> value;
+            if (value != "on" && value != "off") {
+                throw fail("ground_plane must be on or off");
+            }
+            scene.ground_plane = value == "on";
+        } else if (statement == "material") {
+            std::string name {};
+            std::string type {};
+            in >> name >> type;
+            vec3 const albedo {read_vec3()};
+
+            // Value initialized so the unused fields are written as zeros
+            Material material {};
+            if (type == "lambertian") {
+                material.lambertian(albedo);
+            } else if (type == "metal") {
+                GLfloat fuzz {};
+                in >> fuzz;
+                if (fuzz < 0.0 || fuzz > 1.0) {
+                    throw fail("fuzz must be within [0, 1]");
+                }
+                material.metal(albedo, fuzz);
+            } else if (type == "dielectric") {
+                GLfloat ri {};
+                in >> ri;
+                material.dielectric(albedo, ri);
+            } else if (type == "emissive") {
+                material.emissive(albedo);
+            } else {
+                throw fail("unknown material type " + type);
+            }
+            materials[name] = material;
+        } else if (statement == "sphere") {
+            vec3 const center {read_vec3()};
+            GLfloat radius {};
+            in >> radius;
+            scene.spheres.emplace_back(center, radius, read_material());
+        } else if (statement == "quad") {
+            vec3 const Q {read_vec3()};
+            vec3 const u {read_vec3()};
+            vec3 const v {read_vec3()};
+            // Set field by field so the padding is written as zeros
+            Quad quad {};
+            quad.Q = Q;
+            quad.u = u;
+            quad.v = v;
+            quad.material = read_material();
+            scene.quads.push_back(quad);
+        } else if (statement == "mesh") {
+            std::string name {};
+            std::string file_name {};
+            if (!(in >> name >> file_name)) {
+                throw fail("malformed mesh");
+            }
+            if (meshes.count(name)) {
+                throw fail("mesh " + name + " is already declared");
+            }
+
+            std::filesystem::path const model {
+                std::filesystem::path(path).parent_path() / file_name};
+            meshes[name] = scene.meshes.add(TriangleMesh::load_obj(model.string()));
+        } else if (statement == "instance") {
+            std::string name {};
+            in >> name;
+            auto const mesh {meshes.find(name)};
+            if (mesh == meshes.end()) {
+                throw fail("unknown mesh " + name);
+            }
+            Material const material {read_material()};
+            vec3 const offset {read_vec3()};
+            if (in.fail()) {
+                throw fail("malformed instance");
+            }
+
+            // The scale and rotation are optional, in that order
+            std::vector<GLfloat> extra {};
+            GLfloat value {};
+            while (in >> value) {
+                extra.push_back(value);
+            }
+            if (!in.eof() || (extra.size() != 0 && extra.size() != 1 && extra.size() != 4)) {
+                throw fail("malformed instance");
+            }
+            in.clear();
+            GLfloat const scale {extra.empty() ? 1.0f : extra[0]};
+            vec3 const rotation {extra.size() == 4 ? vec3(extra[1], extra[2], extra[3]) : vec3()};
+            if (scale == 0.0) {
+                throw fail("instance scale must not be zero");
+            }
+
+            GLfloat const to_radians {static_cast<GLfloat>(M_PI / 180.0)};
+            Matrix4 const transform {Matrix4().trans(offset.x, offset.y, offset.z) *
+                                     Matrix4().rotz(rotation.z * to_radians) *
+                                     Matrix4().roty(rotation.y * to_radians) *
+                                     Matrix4().rotx(rotation.x * to_radians) *
+                                     Matrix4().scale(scale, scale, scale)};
+            scene.meshes.add_instance(mesh->second, transform, material);
+        } else {
+            throw fail("unknown statement " + statement);
+        }
+
+        std::string rest {};
+        if (in.fail() || in >> rest) {
+            throw fail("malformed " + statement);
+        }
+    }
+    return scene;
+}
+
+/* Write a scene as a binary scene file, with a BVH built for the shader */
+void write(std::string const& path, Scene const& scene) {
+    std::vector<BVH::Primitive> primitives {};
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+        primitives.push_back({scene.spheres[i].bounds(), BVH::make_ref(BVH::SPHERE, i)});
+    }
+    for (size_t i = 0; i < scene.quads.size(); i++) {
+        primitives.push_back({scene.quads[i].bounds(), BVH::make_ref(BVH::QUAD, i)});
+    }
+    for (size_t i = 0; i < scene.meshes.instances.size(); i++) {
+        primitives.push_back({scene.meshes.instances[i].bounds(),
+                              BVH::make_ref(BVH::INSTANCE, i)});
+    }
+    BVH bvh {};
+    bvh.build(primitives, BVH::GPU_LEAF_SIZE);
+    std::vector<BVHRefs> const refs {bvh.packed_refs()};
+    MeshSet const& meshes {scene.meshes};
+
+    struct Block {
+        Section type;
+        uint32_t element_size;
+        uint64_t count;
+        void const* data;
+    };
+    Block const blocks[] {
+        {Section::SPHERES, sizeof(Sphere), scene.spheres.size(), scene.spheres.data()},
+        {Section::QUADS, sizeof(Quad), scene.quads.size(), scene.quads.data()},
+        {Section::BVH_NODES, sizeof(BVHNode), bvh.nodes.size(), bvh.nodes.data()},
+        {Section::BVH_REFS, sizeof(BVHRefs), refs.size(), refs.data()},
+        {Section::MESHES, sizeof(Mesh), meshes.meshes.size(), meshes.meshes.data()},
+        {Section::INSTANCES, sizeof(Instance), meshes.instances.size(),
+         meshes.instances.data()},
+        {Section::MESH_NODES, sizeof(BVHNode), meshes.nodes.size(), meshes.nodes.data()},
+        {Section::MESH_TRIANGLES, sizeof(MeshTriangle), meshes.triangles.size(),
+         meshes.triangles.data()},
+        {Section::MESH_VERTICES, sizeof(MeshVertex), meshes.vertices.size(),
+         meshes.vertices.data()},
+    };
+    size_t const section_count {std::size(blocks)};
+
+    Header header {};
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.section_count = section_count;
+    header.flags = scene.ground_plane ? GROUND_PLANE : 0;
+    header.camera_pos = scene.camera.pos;
+    header.camera_fov = scene.camera.fov;
+    header.camera_pitch = scene.camera.pitch;
+    header.camera_yaw = scene.camera.yaw;
+
+    auto const align = [](uint64_t offset) {
+        return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    };
+    std::vector<SectionEntry> entries {};
+    uint64_t offset {align(sizeof(Header) + section_count * sizeof(SectionEntry))};
+    for (Block const& block : blocks) {
+        entries.push_back({block.type, block.element_size, block.count, offset});
+        offset = align(offset + block.count * block.element_size);
+    }
+
+    std::ofstream file {path, std::ios::binary};
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to create scene file " + path);
+    }
+    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    file.write(reinterpret_cast<char const*>(entries.data()),
+               entries.size() * sizeof(SectionEntry));
+    for (size_t i = 0; i < section_count; i++) {
+        // Pad up to the start of the section
+        uint64_t const position = file.tellp();
+        std::vector<char> const padding(entries[i].offset - position, 0);
+        file.write(padding.data(), padding.size());
+        file.write(static_cast<char const*>(blocks[i].data),
+                   blocks[i].count * blocks[i].element_size);
+    }
+    if (!file) {
+        throw std::runtime_error("Failed to write scene file " + path);
+    }
+}
+
+}; // namespace SceneFile
@@ -0,0 +1,471 @@
+#include "scene_soa.h"
+#include "bvh.h"
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_KERNELS
+#endif
+
+/* Kernels intersecting one ray with a range of slots. They keep the closest
+ * hit nearer than dist, updating both dist and slot when they find one. */
+using SphereKernel = void (*)(SceneSoA const& scene, size_t begin, size_t end,
+                              vec3 const& origin, vec3 const& dir, GLfloat& dist, GLint& slot);
+using QuadKernel = SphereKernel;
+
+/* ================================================================ *
+ *                         SCALAR KERNELS                           *
+ * ================================================================ */
+
+static void spheres_scalar(SceneSoA const& s, size_t begin, size_t end, vec3 const& o,
+                           vec3 const& d, GLfloat& dist, GLint& slot) {
+    GLfloat const a {d.dot(d)};
+
+    for (size_t i = begin; i < end; i++) {
+        GLfloat const oc_x {s.center_x[i] - o.x};
+        GLfloat const oc_y {s.center_y[i] - o.y};
+        GLfloat const oc_z {s.center_z[i] - o.z};
+        GLfloat const b {-2.0f * (d.x*oc_x + d.y*oc_y + d.z*oc_z)};
+        GLfloat const c {oc_x*oc_x + oc_y*oc_y + oc_z*oc_z - s.radius[i]*s.radius[i]};
+        GLfloat const discriminant {b*b - 4.0f*a*c};
+        if (discriminant < 0.0f) {
+            continue;
+        }
+
+        GLfloat const t {(-b - std::sqrt(discriminant)) / (2.0f * a)};
+        if (RAY_MIN_DIST <= t && t < dist) {
+            dist = t;
+            slot = i;
+        }
+    }
+}
+
+static void quads_scalar(SceneSoA const& s, size_t begin, size_t end, vec3 const& o,
+                         vec3 const& d, GLfloat& dist, GLint& slot) {
+    for (size_t i = begin; i < end; i++) {
+        GLfloat const denom {s.normal_x[i]*d.x + s.normal_y[i]*d.y + s.normal_z[i]*d.z};
+        if (std::abs(denom) < 1e-8f) {
+            continue;
+        }
+
+        GLfloat const t {
+            (s.plane_d[i] - (s.normal_x[i]*o.x + s.normal_y[i]*o.y + s.normal_z[i]*o.z)) / denom
+        };
+        if (t <= RAY_MIN_DIST || t > RAY_MAX_DIST || t >= dist) {
+            continue;
+        }
+
+        GLfloat const p_x {o.x + t*d.x - s.q_x[i]};
+        GLfloat const p_y {o.y + t*d.y - s.q_y[i]};
+        GLfloat const p_z {o.z + t*d.z - s.q_z[i]};
+        GLfloat const alpha {p_x*s.edge_u_x[i] + p_y*s.edge_u_y[i] + p_z*s.edge_u_z[i]};
+        GLfloat const beta {p_x*s.edge_v_x[i] + p_y*s.edge_v_y[i] + p_z*s.edge_v_z[i]};
+
+        if (0.0f < alpha && alpha <= 1.0f && 0.0f < beta && beta <= 1.0f) {
+            dist = t;
+            slot = i;
+        }
+    }
+}
+
+#ifdef HAS_X86_KERNELS
+
+/* ================================================================ *
+ *                      SSE KERNELS (4 WIDE)                        *
+ * ================================================================ */
+
+/* Reduce the per lane closest hits into dist and slot */
+__attribute__((target("sse4.1")))
+static void reduce_sse(__m128 best_t, __m128i best_slot, GLfloat& dist, GLint& slot) {
+    alignas(16) GLfloat t[4];
+    alignas(16) GLint slots[4];
+    _mm_store_ps(t, best_t);
+    _mm_store_si128(reinterpret_cast<__m128i*>(slots), best_slot);
+
+    for (size_t lane = 0; lane < 4; lane++) {
+        if (slots[lane] >= 0 && t[lane] < dist) {
+            dist = t[lane];
+            slot = slots[lane];
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void spheres_sse(SceneSoA const& s, size_t begin, size_t end, vec3 const& o,
+                        vec3 const& d, GLfloat& dist, GLint& slot) {
+    __m128 const o_x {_mm_set1_ps(o.x)}, o_y {_mm_set1_ps(o.y)}, o_z {_mm_set1_ps(o.z)};
+    __m128 const d_x {_mm_set1_ps(d.x)}, d_y {_mm_set1_ps(d.y)}, d_z {_mm_set1_ps(d.z)};
+    GLfloat const a {d.dot(d)};
+    __m128 const four_a {_mm_set1_ps(4.0f * a)};
+    __m128 const two_a {_mm_set1_ps(2.0f * a)};
+    __m128 const min_dist {_mm_set1_ps(RAY_MIN_DIST)};
+    __m128 const zero {_mm_setzero_ps()};
+
+    __m128 best_t {_mm_set1_ps(dist)};
+    __m128i best_slot {_mm_set1_epi32(-1)};
+    __m128i index {_mm_setr_epi32(begin, begin + 1, begin + 2, begin + 3)};
+
+    size_t i {begin};
+    for (; i + 4 <= end; i += 4) {
+        __m128 const oc_x {_mm_sub_ps(_mm_loadu_ps(&s.center_x[i]), o_x)};
+        __m128 const oc_y {_mm_sub_ps(_mm_loadu_ps(&s.center_y[i]), o_y)};
+        __m128 const oc_z {_mm_sub_ps(_mm_loadu_ps(&s.center_z[i]), o_z)};
+        __m128 const r {_mm_loadu_ps(&s.radius[i])};
+
+        __m128 const dot_d {_mm_add_ps(_mm_add_ps(_mm_mul_ps(d_x, oc_x), _mm_mul_ps(d_y, oc_y)),
+                                       _mm_mul_ps(d_z, oc_z))};
+        __m128 const b {_mm_mul_ps(_mm_set1_ps(-2.0f), dot_d)};
+        __m128 const c {_mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(oc_x, oc_x), _mm_mul_ps(oc_y, oc_y)),
+                       _mm_mul_ps(oc_z, oc_z)),
+            _mm_mul_ps(r, r))};
+        __m128 const discriminant {_mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(four_a, c))};
+        __m128 const t {_mm_div_ps(
+            _mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(discriminant)), two_a)};
+
+        __m128 const mask {_mm_and_ps(
+            _mm_cmpge_ps(discriminant, zero),
+            _mm_and_ps(_mm_cmple_ps(min_dist, t), _mm_cmplt_ps(t, best_t)))};
+        best_t = _mm_blendv_ps(best_t, t, mask);
+        best_slot = _mm_castps_si128(
+            _mm_blendv_ps(_mm_castsi128_ps(best_slot), _mm_castsi128_ps(index), mask));
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+
+    reduce_sse(best_t, best_slot, dist, slot);
+    spheres_scalar(s, i, end, o, d, dist, slot);
+}
+
+__attribute__((target("sse4.1")))
+static void quads_sse(SceneSoA const& s, size_t begin, size_t end, vec3 const& o,
+                      vec3 const& d, GLfloat& dist, GLint& slot) {
+    __m128 const o_x {_mm_set1_ps(o.x)}, o_y {_mm_set1_ps(o.y)}, o_z {_mm_set1_ps(o.z)};
+    __m128 const d_x {_mm_set1_ps(d.x)}, d_y {_mm_set1_ps(d.y)}, d_z {_mm_set1_ps(d.z)};
+    __m128 const min_dist {_mm_set1_ps(RAY_MIN_DIST)};
+    __m128 const max_dist {_mm_set1_ps(RAY_MAX_DIST)};
+    __m128 const epsilon {_mm_set1_ps(1e-8f)};
+    __m128 const sign {_mm_set1_ps(-0.0f)};
+    __m128 const zero {_mm_setzero_ps()};
+    __m128 const one {_mm_set1_ps(1.0f)};
+
+    __m128 best_t {_mm_set1_ps(dist)};
+    __m128i best_slot {_mm_set1_epi32(-1)};
+    __m128i index {_mm_setr_epi32(begin, begin + 1, begin + 2, begin + 3)};
+
+    size_t i {begin};
+    for (; i + 4 <= end; i += 4) {
+        __m128 const n_x {_mm_loadu_ps(&s.normal_x[i])};
+        __m128 const n_y {_mm_loadu_ps(&s.normal_y[i])};
+        __m128 const n_z {_mm_loadu_ps(&s.normal_z[i])};
+
+        __m128 const denom {_mm_add_ps(_mm_add_ps(_mm_mul_ps(n_x, d_x), _mm_mul_ps(n_y, d_y)),
+                                       _mm_mul_ps(n_z, d_z))};
+        __m128 const n_dot_o {_mm_add_ps(_mm_add_ps(_mm_mul_ps(n_x, o_x), _mm_mul_ps(n_y, o_y)),
+                                         _mm_mul_ps(n_z, o_z))};
+        __m128 const t {_mm_div_ps(_mm_sub_ps(_mm_loadu_ps(&s.plane_d[i]), n_dot_o), denom)};
+
+        __m128 const p_x {_mm_sub_ps(_mm_add_ps(o_x, _mm_mul_ps(t, d_x)), _mm_loadu_ps(&s.q_x[i]))};
+        __m128 const p_y {_mm_sub_ps(_mm_add_ps(o_y, _mm_mul_ps(t, d_y)), _mm_loadu_ps(&s.q_y[i]))};
+        __m128 const p_z {_mm_sub_ps(_mm_add_ps(o_z, _mm_mul_ps(t, d_z)), _mm_loadu_ps(&s.q_z[i]))};
+        __m128 const alpha {_mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(p_x, _mm_loadu_ps(&s.edge_u_x[i])),
+                       _mm_mul_ps(p_y, _mm_loadu_ps(&s.edge_u_y[i]))),
+            _mm_mul_ps(p_z, _mm_loadu_ps(&s.edge_u_z[i])))};
+        __m128 const beta {_mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(p_x, _mm_loadu_ps(&s.edge_v_x[i])),
+                       _mm_mul_ps(p_y, _mm_loadu_ps(&s.edge_v_y[i]))),
+            _mm_mul_ps(p_z, _mm_loadu_ps(&s.edge_v_z[i])))};
+
+        __m128 mask {_mm_cmpge_ps(_mm_andnot_ps(sign, denom), epsilon)};
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, min_dist));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(t, max_dist));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, best_t));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmplt_ps(zero, alpha), _mm_cmple_ps(alpha, one)));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmplt_ps(zero, beta), _mm_cmple_ps(beta, one)));
+
+        best_t = _mm_blendv_ps(best_t, t, mask);
+        best_slot = _mm_castps_si128(
+            _mm_blendv_ps(_mm_castsi128_ps(best_slot), _mm_castsi128_ps(index), mask));
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+
+    reduce_sse(best_t, best_slot, dist, slot);
+    quads_scalar(s, i, end, o, d, dist, slot);
+}
+
+/* ================================================================ *
+ *                      AVX2 KERNELS (8 WIDE)                       *
+ * ================================================================ */
+
+__attribute__((target("avx2")))
+static void reduce_avx2(__m256 best_t, __m256i best_slot, GLfloat& dist, GLint& slot) {
+    alignas(32) GLfloat t[8];
+    alignas(32) GLint slots[8];
+    _mm256_store_ps(t, best_t);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(slots), best_slot);
+
+    for (size_t lane = 0; lane < 8; lane++) {
+        if (slots[lane] >= 0 && t[lane] < dist) {
+            dist = t[lane];
+            slot = slots[lane];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void spheres_avx2(SceneSoA const& s, size_t begin, size_t end, vec3 const& o,
+                         vec3 const& d, GLfloat& dist, GLint& slot) {
+    __m256 const o_x {_mm256_set1_ps(o.x)}, o_y {_mm256_set1_ps(o.y)}, o_z {_mm256_set1_ps(o.z)};
+    __m256 const d_x {_mm256_set1_ps(d.x)}, d_y {_mm256_set1_ps(d.y)}, d_z {_mm256_set1_ps(d.z)};
+    GLfloat const a {d.dot(d)};
+    __m256 const four_a {_mm256_set1_ps(4.0f * a)};
+    __m256 const two_a {_mm256_set1_ps(2.0f * a)};
+    __m256 const min_dist {_mm256_set1_ps(RAY_MIN_DIST)};
+    __m256 const zero {_mm256_setzero_ps()};
+
+    __m256 best_t {_mm256_set1_ps(dist)};
+    __m256i best_slot {_mm256_set1_epi32(-1)};
+    __m256i index {_mm256_add_epi32(_mm256_set1_epi32(begin),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))};
+
+    size_t i {begin};
+    for (; i + 8 <= end; i += 8) {
+        __m256 const oc_x {_mm256_sub_ps(_mm256_loadu_ps(&s.center_x[i]), o_x)};
+        __m256 const oc_y {_mm256_sub_ps(_mm256_loadu_ps(&s.center_y[i]), o_y)};
+        __m256 const oc_z {_mm256_sub_ps(_mm256_loadu_ps(&s.center_z[i]), o_z)};
+        __m256 const r {_mm256_loadu_ps(&s.radius[i])};
+
+        __m256 const dot_d {_mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(d_x, oc_x), _mm256_mul_ps(d_y, oc_y)),
+            _mm256_mul_ps(d_z, oc_z))};
+        __m256 const b {_mm256_mul_ps(_mm256_set1_ps(-2.0f), dot_d)};
+        __m256 const c {_mm256_sub_ps(
+            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(oc_x, oc_x), _mm256_mul_ps(oc_y, oc_y)),
+                          _mm256_mul_ps(oc_z, oc_z)),
+            _mm256_mul_ps(r, r))};
+        __m256 const discriminant {_mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(four_a, c))};
+        __m256 const t {_mm256_div_ps(
+            _mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(discriminant)), two_a)};
+
+        __m256 const mask {_mm256_and_ps(
+            _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(min_dist, t, _CMP_LE_OQ),
+                          _mm256_cmp_ps(t, best_t, _CMP_LT_OQ)))};
+        best_t = _mm256_blendv_ps(best_t, t, mask);
+        best_slot = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(best_slot), _mm256_castsi256_ps(index), mask));
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+
+    reduce_avx2(best_t, best_slot, dist, slot);
+    spheres_scalar(s, i, end, o, d, dist, slot);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 dot3(__m256 a_x, __m256 a_y, __m256 a_z,
+                          __m256 b_x, __m256 b_y, __m256 b_z) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a_x, b_x), _mm256_mul_ps(a_y, b_y)),
+                         _mm256_mul_ps(a_z, b_z));
+}
+
+__attribute__((target("avx2")))
+static void quads_avx2(SceneSoA const& s, size_t begin, size_t end, vec3 const& o,
+                       vec3 const& d, GLfloat& dist, GLint& slot) {
+    __m256 const o_x {_mm256_set1_ps(o.x)}, o_y {_mm256_set1_ps(o.y)}, o_z {_mm256_set1_ps(o.z)};
+    __m256 const d_x {_mm256_set1_ps(d.x)}, d_y {_mm256_set1_ps(d.y)}, d_z {_mm256_set1_ps(d.z)};
+    __m256 const min_dist {_mm256_set1_ps(RAY_MIN_DIST)};
+    __m256 const max_dist {_mm256_set1_ps(RAY_MAX_DIST)};
+    __m256 const epsilon {_mm256_set1_ps(1e-8f)};
+    __m256 const sign {_mm256_set1_ps(-0.0f)};
+    __m256 const zero {_mm256_setzero_ps()};
+    __m256 const one {_mm256_set1_ps(1.0f)};
+
+    __m256 best_t {_mm256_set1_ps(dist)};
+    __m256i best_slot {_mm256_set1_epi32(-1)};
+    __m256i index {_mm256_add_epi32(_mm256_set1_epi32(begin),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))};
+
+    size_t i {begin};
+    for (; i + 8 <= end; i += 8) {
+        __m256 const n_x {_mm256_loadu_ps(&s.normal_x[i])};
+        __m256 const n_y {_mm256_loadu_ps(&s.normal_y[i])};
+        __m256 const n_z {_mm256_loadu_ps(&s.normal_z[i])};
+
+        __m256 const denom {dot3(n_x, n_y, n_z, d_x, d_y, d_z)};
+        __m256 const t {_mm256_div_ps(
+            _mm256_sub_ps(_mm256_loadu_ps(&s.plane_d[i]), dot3(n_x, n_y, n_z, o_x, o_y, o_z)),
+            denom)};
+
+        __m256 const p_x {_mm256_sub_ps(_mm256_add_ps(o_x, _mm256_mul_ps(t, d_x)),
+                                        _mm256_loadu_ps(&s.q_x[i]))};
+        __m256 const p_y {_mm256_sub_ps(_mm256_add_ps(o_y, _mm256_mul_ps(t, d_y)),
+                                        _mm256_loadu_ps(&s.q_y[i]))};
+        __m256 const p_z {_mm256_sub_ps(_mm256_add_ps(o_z, _mm256_mul_ps(t, d_z)),
+                                        _mm256_loadu_ps(&s.q_z[i]))};
+        __m256 const alpha {dot3(p_x, p_y, p_z, _mm256_loadu_ps(&s.edge_u_x[i]),
+                                 _mm256_loadu_ps(&s.edge_u_y[i]), _mm256_loadu_ps(&s.edge_u_z[i]))};
+        __m256 const beta {dot3(p_x, p_y, p_z, _mm256_loadu_ps(&s.edge_v_x[i]),
+                                _mm256_loadu_ps(&s.edge_v_y[i]), _mm256_loadu_ps(&s.edge_v_z[i]))};
+
+        __m256 mask {_mm256_cmp_ps(_mm256_andnot_ps(sign, denom), epsilon, _CMP_GE_OQ)};
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, min_dist, _CMP_GT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, max_dist, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, best_t, _CMP_LT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(zero, alpha, _CMP_LT_OQ),
+                                                 _mm256_cmp_ps(alpha, one, _CMP_LE_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(zero, beta, _CMP_LT_OQ),
+                                                 _mm256_cmp_ps(beta, one, _CMP_LE_OQ)));
+
+        best_t = _mm256_blendv_ps(best_t, t, mask);
+        best_slot = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(best_slot), _mm256_castsi256_ps(index), mask));
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+
+    reduce_avx2(best_t, best_slot, dist, slot);
+    quads_scalar(s, i, end, o, d, dist, slot);
+}
+
+#endif
+
+/* ================================================================ *
+ *                            SCENE SOA                             *
+ * ================================================================ */
+
+/* Returns: The sphere kernel written for an instruction set */
+static SphereKernel sphere_kernel_for(SceneSoA::ISA isa) {
+    switch (isa) {
+#ifdef HAS_X86_KERNELS
+    case SceneSoA::ISA::AVX2:
+        return spheres_avx2;
+    case SceneSoA::ISA::SSE:
+        return spheres_sse;
+#endif
+    default:
+        return spheres_scalar;
+    }
+}
+
+/* Returns: The quad kernel written for an instruction set */
+static QuadKernel quad_kernel_for(SceneSoA::ISA isa) {
+    switch (isa) {
+#ifdef HAS_X86_KERNELS
+    case SceneSoA::ISA::AVX2:
+        return quads_avx2;
+    case SceneSoA::ISA::SSE:
+        return quads_sse;
+#endif
+    default:
+        return quads_scalar;
+    }
+}
+
+// Picked before main so tracing threads only ever read them
+static SceneSoA::ISA current {SceneSoA::best_isa()};
+static SphereKernel sphere_kernel {sphere_kernel_for(current)};
+static QuadKernel quad_kernel {quad_kernel_for(current)};
+
+void SceneSoA::build(std::vector<Sphere> const& spheres, std::vector<Quad> const& quads,
+                     std::vector<GLint> const& refs) {
+    *this = SceneSoA();
+    sphere_prefix.reserve(refs.size() + 1);
+    sphere_prefix.push_back(0);
+    quad_prefix.reserve(refs.size() + 1);
+    quad_prefix.push_back(0);
+
+    for (GLint const ref : refs) {
+        GLint const index {BVH::ref_index(ref)};
+
+        if (BVH::ref_type(ref) == BVH::SPHERE) {
+            Sphere const& sphere {spheres[index]};
+            center_x.push_back(sphere.center.x);
+            center_y.push_back(sphere.center.y);
+            center_z.push_back(sphere.center.z);
+            radius.push_back(sphere.radius);
+            sphere_index.push_back(index);
+        } else if (BVH::ref_type(ref) == BVH::QUAD) {
+            Quad const& quad {quads[index]};
+            vec3 const n {quad.u.cross(quad.v)};
+            vec3 const normal {n / n.length()};
+            vec3 const w {n / n.dot(n)};
+            vec3 const edge_u {quad.v.cross(w)};
+            vec3 const edge_v {w.cross(quad.u)};
+
+            q_x.push_back(quad.Q.x);
+            q_y.push_back(quad.Q.y);
+            q_z.push_back(quad.Q.z);
+            normal_x.push_back(normal.x);
+            normal_y.push_back(normal.y);
+            normal_z.push_back(normal.z);
+            plane_d.push_back(normal.dot(quad.Q));
+            edge_u_x.push_back(edge_u.x);
+            edge_u_y.push_back(edge_u.y);
+            edge_u_z.push_back(edge_u.z);
+            edge_v_x.push_back(edge_v.x);
+            edge_v_y.push_back(edge_v.y);
+            edge_v_z.push_back(edge_v.z);
+            quad_index.push_back(index);
+        }
+
+        sphere_prefix.push_back(center_x.size());
+        quad_prefix.push_back(q_x.size());
+    }
+}
+
+/* Returns: The first sphere slot at or after a reference */
+size_t SceneSoA::sphere_slot(size_t ref) const {
+    return sphere_prefix[ref];
+}
+
+/* Returns: The first quad slot at or after a reference */
+size_t SceneSoA::quad_slot(size_t ref) const {
+    return quad_prefix[ref];
+}
+
+void SceneSoA::intersect_spheres(size_t begin, size_t end, vec3 const& origin, vec3 const& dir,
+                                 GLfloat& dist, GLint& slot) const {
+    sphere_kernel(*this, begin, end, origin, dir, dist, slot);
+}
+
+void SceneSoA::intersect_quads(size_t begin, size_t end, vec3 const& origin, vec3 const& dir,
+                               GLfloat& dist, GLint& slot) const {
+    quad_kernel(*this, begin, end, origin, dir, dist, slot);
+}
+
+/* Returns: The widest instruction set the running CPU supports */
+SceneSoA::ISA SceneSoA::best_isa() {
+#ifdef HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return ISA::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return ISA::SSE;
+    }
+#endif
+    return ISA::SCALAR;
+}
+
+/* Switch kernels, falling back to narrower ones the CPU can run. Not safe
+ * while other threads are tracing. */
+void SceneSoA::use_isa(ISA isa) {
+    current = std::min(isa, best_isa());
+    sphere_kernel = sphere_kernel_for(current);
+    quad_kernel = quad_kernel_for(current);
+}
+
+SceneSoA::ISA SceneSoA::current_isa() {
+    return current;
+}
+
+char const* SceneSoA::isa_name(ISA isa) {
+    switch (isa) {
+    case ISA::AVX2:
+        return "avx2";
+    case ISA::SSE:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,114 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    thread_count = std::max<size_t>(thread_count, 1);
+
+    for (size_t i = 0; i < thread_count; i++) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        threads.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock {mutex};
+        stopping = true;
+    }
+    start.notify_all();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return threads.size();
+}
+
+/*
+ * run - Run a task for every index in [0, task_count) and wait for all of
+ *       them to finish
+ */
+void ThreadPool::run(size_t task_count, std::function<void(size_t)> const& task) {
+    if (task_count == 0) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock {mutex};
+        current = &task;
+        remaining = task_count;
+
+        // Deal the tasks out in contiguous runs so neighbouring tasks tend
+        // to stay on the same worker until stolen
+        size_t const per_queue {(task_count + queues.size() - 1) / queues.size()};
+        for (size_t i = 0; i < task_count; i++) {
+            Queue& queue {*queues[i / per_queue]};
+            std::lock_guard<std::mutex> queue_lock {queue.mutex};
+            queue.tasks.push_front(i);
+        }
+
+        generation++;
+    }
+    start.notify_all();
+
+    std::unique_lock<std::mutex> lock {mutex};
+    done.wait(lock, [this] { return remaining == 0; });
+}
+
+void ThreadPool::work(size_t id) {
+    size_t seen {};
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock {mutex};
+            start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+
+        size_t task {};
+        while (pop(id, task)) {
+            (*current)(task);
+
+            if (--remaining == 0) {
+                std::lock_guard<std::mutex> lock {mutex};
+                done.notify_all();
+            }
+        }
+    }
+}
+
+/*
+ * pop - Take a task from the worker's own queue, or steal one from another
+ *
+ * Returns: false once every queue is empty
+ */
+bool ThreadPool::pop(size_t id, size_t& task) {
+    {
+        Queue& own {*queues[id]};
+        std::lock_guard<std::mutex> lock {own.mutex};
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue& victim {*queues[(id + i) % queues.size()]};
+        std::lock_guard<std::mutex> lock {victim.mutex};
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -1,11 +1,98 @@
 #include "tracer_objects.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Flat primitives get a bit of thickness so the box slabs never collapse
+static GLfloat const AABB_PADDING {1e-4};
+
+AABB::AABB()
+    : min{vec3(1.0, 1.0, 1.0) * std::numeric_limits<GLfloat>::max()},
+      max{vec3(1.0, 1.0, 1.0) * -std::numeric_limits<GLfloat>::max()} {};
+
+void AABB::grow(vec3 const& p) {
+    min = {std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z)};
+    max = {std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z)};
+}
+
+void AABB::grow(AABB const& other) {
+    grow(other.min);
+    grow(other.max);
+}
+
+vec3 AABB::centroid() const {
+    return (min + max) * 0.5;
+}
+
+GLfloat AABB::area() const {
+    vec3 const d {max - min};
+    return 2.0 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
 
 Sphere::Sphere(vec3 const& center, GLfloat radius, Material const& material)
     : center{center}, radius{radius}, material{material} {};
 
+AABB Sphere::bounds() const {
+    vec3 const r {radius, radius, radius};
+    return {center - r, center + r};
+}
+
+GLfloat Sphere::area() const {
+    return 4.0f * static_cast<GLfloat>(M_PI) * radius * radius;
+}
+
 Quad::Quad(vec3 const& Q, vec3 const& u, vec3 const& v, Material const& material)
     : Q{Q}, u{u}, v{v}, material{material} {};
 
+AABB Quad::bounds() const {
+    vec3 const pad {AABB_PADDING, AABB_PADDING, AABB_PADDING};
+    AABB box {Q - pad, Q + pad};
+    box.grow(Q + u);
+    box.grow(Q + v);
+    box.grow(Q + u + v);
+    return box;
+}
+
+GLfloat Quad::area() const {
+    return u.cross(v).length();
+}
+
+/* Returns: The power a light is picked by, or 0 if it emits nothing */
+GLfloat Light::power(Material const& material, GLfloat area) {
+    if (material.material != static_cast<GLint>(Material::EMISSIVE)) {
+        return 0.0;
+    }
+    vec3 const& radiance {material.albedo};
+    return (0.2126f * radiance.x + 0.7152f * radiance.y + 0.0722f * radiance.z) * area;
+}
+
+void LightList::build(Sphere const* spheres, size_t sphere_count, Quad const* quads,
+                      size_t quad_count) {
+    lights.clear();
+    total_power = 0.0;
+
+    auto const add = [&](GLint type, size_t index, GLfloat power) {
+        if (power > 0.0f) {
+            total_power += power;
+            lights.push_back({type, static_cast<GLint>(index), total_power, 0.0});
+        }
+    };
+    for (size_t i = 0; i < sphere_count; i++) {
+        add(Light::SPHERE, i, Light::power(spheres[i].material, spheres[i].area()));
+    }
+    for (size_t i = 0; i < quad_count; i++) {
+        add(Light::QUAD, i, Light::power(quads[i].material, quads[i].area()));
+    }
+
+    for (Light& light : lights) {
+        light.cdf /= total_power;
+    }
+    // Keep rounding from leaving a sliver past the last light
+    if (!lights.empty()) {
+        lights.back().cdf = 1.0;
+    }
+}
+
 Material& Material::lambertian(vec3 const& albedo) {
     this->albedo = albedo;
     this->material = LAMBERTIAN;
@@ -27,3 +114,9 @@ Material& Material::dielectric(vec3 const& albedo, GLfloat ri) {
     this->material = DIELECTRIC;
     return *this;
 }
+
+Material& Material::emissive(vec3 const& radiance) {
+    this->albedo = radiance;
+    this->material = EMISSIVE;
+    return *this;
+}
@@ -0,0 +1,34 @@
+/* Converts a text scene into a binary scene file the renderer maps with
+ * --scene, building its BVH along the way. The text format is described in
+ * src/scene_file.cpp, scenes/default.scene is the built in scene.
+ *
+ * Usage: scene_convert input.scene output.bin
+ */
+#include "scene_file.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " input.scene output.bin" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto const start {std::chrono::steady_clock::now()};
+    try {
+        SceneFile::Scene const scene {SceneFile::read_text(argv[1])};
+        SceneFile::write(argv[2], scene);
+        double const elapsed {std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count()};
+        std::printf("Wrote %zu spheres, %zu quads and %zu instances of %zu meshes of %zu "
+                    "triangles to %s in %.3f s\n", scene.spheres.size(), scene.quads.size(),
+                    scene.meshes.instances.size(), scene.meshes.meshes.size(),
+                    scene.meshes.triangles.size(), argv[2], elapsed);
+    } catch (std::runtime_error const& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}